@@ -1,10 +1,14 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "analysis.h"
+#include "batch.h"
+#include "bincache.h"
 #include "modtable.h"
+#include "tcl.h"
 #include "util.h"
 #include "log.h"
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -30,105 +34,303 @@
 
 #include <dirent.h>
 #include <errno.h>
-#include <regex.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <wordexp.h>
+#include <time.h>
 
-#if !MII_ENABLE_LUA
-static const char* _mii_analysis_lmod_regex_src =
-    "\\s*(prepend_path|append_path)\\s*\\(\\s*"
-    "\"PATH\"\\s*,\\s*\"([^\"]+)\"";
+#if MII_ENABLE_LUA
+/* the sandbox (utils.lua and sandbox.lua), compiled with luac and embedded by the makefile */
+static const unsigned char _mii_analysis_sandbox[] = {
+#include "lua/sandbox.inc"
+};
 
-static regex_t _mii_analysis_lmod_regex;
-#else
-/* Lua interpreter state */
-static lua_State *lua_state;
+/* a modulefile is given up on after running this many instructions or holding this much memory,
+ * so one which loops or recurses forever costs a bounded amount of time */
+#define MII_ANALYSIS_LUA_MAX_INSTRUCTIONS 10000000
+#define MII_ANALYSIS_LUA_MAX_MEMORY (64 << 20)
 
-/* run lua module code in a sandbox */
-int _mii_analysis_lua_run(lua_State* lua_state, const char* code, char*** paths_out, int* num_paths_out);
+/* instructions between checks of the budget */
+#define MII_ANALYSIS_LUA_HOOK_COUNT 10000
+
+/* registry key of the worker owning an interpreter, its address is the key */
+static const char _mii_analysis_lua_worker_key = 0;
 #endif
 
-/* word expansion functions */
-char* _mii_analysis_expand(const char* expr);
+/* analysis state owned by each worker, so workers never share an interpreter */
+typedef struct {
+#if MII_ENABLE_LUA
+    lua_State* lua_state; /* preloaded with the sandbox */
+    size_t lua_memory; /* bytes held by lua_state */
+    int lua_hooks; /* budget checks during the current modulefile */
+#endif
+    mii_batch batch; /* bin directory entries are stat'ed as a batch */
+} _mii_analysis_worker;
+
+static _mii_analysis_worker* _mii_analysis_workers = NULL;
+static int _mii_analysis_num_workers = 0;
+
+/* listings of bin directories already scanned, shared by every worker */
+static mii_bincache _mii_analysis_bincache;
+static int _mii_analysis_bincache_loaded = 0;
+
+/* where an analysis puts its results */
+typedef struct {
+    char*** bins;
+    int* num_bins;
+    char*** dirs; /* directories scanned, with their mtimes */
+    int64_t** dir_mtimes;
+    int* num_dirs;
+} _mii_analysis_out;
+
+int _mii_analysis_worker_init(_mii_analysis_worker* w);
+void _mii_analysis_worker_free(_mii_analysis_worker* w);
+
+#if MII_ENABLE_LUA
+/* run lua module code in a sandbox */
+int _mii_analysis_lua_open(_mii_analysis_worker* w);
+int _mii_analysis_lua_run(_mii_analysis_worker* w, const char* code, char*** paths_out, int* num_paths_out);
+void* _mii_analysis_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+void _mii_analysis_lua_hook(lua_State* lua_state, lua_Debug* ar);
+#endif
 
 /* module type analysis functions */
-int _mii_analysis_lmod(const char* path, char*** bins_out, int* num_bins_out);
-int _mii_analysis_tcl(const char* path, char*** bins_out, int* num_bins_out);
+int _mii_analysis_lmod(_mii_analysis_worker* w, const char* path, const char* text, size_t size, _mii_analysis_out* out);
+#if !MII_ENABLE_LUA
+const char* _mii_analysis_lmod_next(const char** cur, const char* end, size_t* len_out);
+const char* _mii_analysis_lmod_skip(const char* cur, const char* end, const char* expect);
+#endif
+int _mii_analysis_tcl(_mii_analysis_worker* w, const char* path, const char* text, size_t size, _mii_analysis_out* out);
 
 /* path scanning functions */
-int _mii_analysis_scan_path(char* path, char*** bins_out, int* num_bins_out);
+int _mii_analysis_scan_path(mii_batch* batch, char* path, _mii_analysis_out* out);
+int _mii_analysis_scan_dir(mii_batch* batch, const char* path, char*** bins_out, int* num_bins_out);
+int64_t _mii_analysis_dir_mtime(const char* path);
 
 #if MII_ENABLE_SPIDER
 int _mii_analysis_parents_from_json(const cJSON* json, char*** parents_out, int* num_parents_out);
 #endif
 
-#if !MII_ENABLE_LUA
 /*
- * compile regexes
+ * set up analysis state for each worker
  */
-int mii_analysis_init() {
-    if (regcomp(&_mii_analysis_lmod_regex, _mii_analysis_lmod_regex_src, REG_EXTENDED | REG_NEWLINE)) {
-        mii_error("failed to compile Lmod analysis regex");
-        return -1;
+int mii_analysis_init(int num_workers) {
+    if (num_workers < 1) num_workers = 1;
+
+    _mii_analysis_workers = calloc(num_workers, sizeof *_mii_analysis_workers);
+
+    for (_mii_analysis_num_workers = 0; _mii_analysis_num_workers < num_workers; ++_mii_analysis_num_workers) {
+        if (_mii_analysis_worker_init(_mii_analysis_workers + _mii_analysis_num_workers)) {
+            mii_analysis_free();
+            return -1;
+        }
+
+        mii_batch_init(&_mii_analysis_workers[_mii_analysis_num_workers].batch);
     }
 
     return 0;
 }
-#else
+
 /*
- * initialize Lua interpreter
+ * cleanup every worker's state
  */
-int mii_analysis_init() {
-    lua_state = luaL_newstate();
-    luaL_openlibs(lua_state);
-
-    /* sandbox path when mii is installed */
-    char* lua_path = mii_join_path(MII_PREFIX, "share/mii/lua/sandbox.luac");
-
-    if(access(lua_path, F_OK) == 0) {
-        /* found file, try to execute it and return */
-        if(luaL_dofile(lua_state, lua_path) == LUA_OK) {
-            free(lua_path);
-            return 0;
-        }
+void mii_analysis_free() {
+    for (int i = 0; i < _mii_analysis_num_workers; ++i) {
+        _mii_analysis_worker_free(_mii_analysis_workers + i);
+        mii_batch_free(&_mii_analysis_workers[i].batch);
     }
-    free(lua_path);
 
-    lua_path = "./sandbox.luac";
-    if(access(lua_path, F_OK) == 0) {
-        /* mii is not installed, but should work anyway */
-        if(luaL_dofile(lua_state, lua_path) == LUA_OK)
-            return 0;
+    free(_mii_analysis_workers);
+
+    _mii_analysis_workers = NULL;
+    _mii_analysis_num_workers = 0;
+
+    if (_mii_analysis_bincache_loaded) {
+        mii_bincache_free(&_mii_analysis_bincache);
+        _mii_analysis_bincache_loaded = 0;
     }
+}
+
+int mii_analysis_num_workers() {
+    return _mii_analysis_num_workers;
+}
+
+/*
+ * load the bin directory cache, scans reuse the listings of unchanged directories from then on
+ * with rescan set the loaded listings are only kept for saving, every directory is listed again once.
+ * changes which leave the mtime alone, such as chmod +x, are then picked up
+ * a cache which can't be read is started over
+ */
+int mii_analysis_load_cache(const char* path, int rescan) {
+    if (_mii_analysis_bincache_loaded) mii_bincache_free(&_mii_analysis_bincache);
+
+    mii_bincache_init(&_mii_analysis_bincache);
+    _mii_analysis_bincache_loaded = 1;
 
-    mii_error("failed to load Lua file");
-    lua_close(lua_state);
+    int res = mii_bincache_load(&_mii_analysis_bincache, path);
 
-    return -1;
+    if (res) {
+        mii_bincache_free(&_mii_analysis_bincache);
+        mii_bincache_init(&_mii_analysis_bincache);
+    }
+
+    _mii_analysis_bincache.rescan = rescan;
+
+    return res ? -1 : 0;
 }
-#endif
 
 /*
- * cleanup regexes or Lua interpreter
+ * save the bin directory cache, dropping directories no module used if prune is set
  */
-void mii_analysis_free() {
+int mii_analysis_save_cache(const char* path, int prune) {
+    if (!_mii_analysis_bincache_loaded) return 0;
+
+    return mii_bincache_save(&_mii_analysis_bincache, path, prune);
+}
+
+/*
+ * drop directories from the bin directory cache, for changes such as permissions which don't touch the mtime
+ */
+void mii_analysis_forget_dirs(char** dirs, int num_dirs) {
+    if (!_mii_analysis_bincache_loaded) return;
+
+    for (int i = 0; i < num_dirs; ++i) {
+        mii_bincache_forget(&_mii_analysis_bincache, dirs[i]);
+    }
+}
+
 #if !MII_ENABLE_LUA
-    regfree(&_mii_analysis_lmod_regex);
+/*
+ * without Lua, workers only need their batch
+ */
+int _mii_analysis_worker_init(_mii_analysis_worker* w) {
+    return 0;
+}
+
+void _mii_analysis_worker_free(_mii_analysis_worker* w) {
+}
 #else
-    lua_close(lua_state);
-#endif
+/*
+ * initialize Lua interpreter
+ */
+int _mii_analysis_worker_init(_mii_analysis_worker* w) {
+    return _mii_analysis_lua_open(w);
+}
+
+/*
+ * cleanup Lua interpreter
+ */
+void _mii_analysis_worker_free(_mii_analysis_worker* w) {
+    if (w->lua_state) lua_close(w->lua_state);
+    w->lua_state = NULL;
+}
+
+/*
+ * create a worker's interpreter and load the embedded sandbox into it
+ * the interpreter allocates through the worker, which keeps count of its memory
+ */
+int _mii_analysis_lua_open(_mii_analysis_worker* w) {
+    w->lua_memory = 0;
+    w->lua_state = lua_newstate(_mii_analysis_lua_alloc, w);
+
+    /* LuaJIT on 64-bit hosts has no custom allocators, its interpreters only get the instruction budget */
+    if (!w->lua_state) {
+        mii_debug("custom Lua allocators are unsupported by %s, modulefiles run without a memory limit", LUA_RELEASE);
+        w->lua_state = luaL_newstate();
+    }
+
+    if (!w->lua_state) {
+        mii_error("failed to create a Lua interpreter");
+        return -1;
+    }
+
+    /* the hook finds the worker through the registry, the allocator's userdata isn't ours after a fallback */
+    lua_pushlightuserdata(w->lua_state, (void*) &_mii_analysis_lua_worker_key);
+    lua_pushlightuserdata(w->lua_state, w);
+    lua_rawset(w->lua_state, LUA_REGISTRYINDEX);
+
+    luaL_openlibs(w->lua_state);
+
+    if (luaL_loadbuffer(w->lua_state, (const char*) _mii_analysis_sandbox, sizeof _mii_analysis_sandbox, "=sandbox") != LUA_OK
+            || lua_pcall(w->lua_state, 0, 0, 0) != LUA_OK) {
+        mii_error("failed to load the Lua sandbox : %s", lua_tostring(w->lua_state, -1));
+        lua_close(w->lua_state);
+        w->lua_state = NULL;
+        return -1;
+    }
+
+    return 0;
 }
 
 /*
- * run analysis for an arbitrary module
+ * allocator for worker interpreters, which refuses to grow one past MII_ANALYSIS_LUA_MAX_MEMORY
+ * a refused allocation fails the modulefile being run with a memory error
  */
-int mii_analysis_run(const char* modfile, int modtype, char*** bins_out, int* num_bins_out) {
+void* _mii_analysis_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    _mii_analysis_worker* w = ud;
+
+    /* without a block, osize is not a size (it tells the type of object in 5.2 and later) */
+    if (!ptr) osize = 0;
+
+    if (!nsize) {
+        free(ptr);
+        w->lua_memory -= osize;
+        return NULL;
+    }
+
+    if (nsize > osize && w->lua_memory - osize + nsize > MII_ANALYSIS_LUA_MAX_MEMORY) return NULL;
+
+    void* out = realloc(ptr, nsize);
+
+    if (out) w->lua_memory = w->lua_memory - osize + nsize;
+
+    return out;
+}
+
+/*
+ * called every MII_ANALYSIS_LUA_HOOK_COUNT instructions, stops a modulefile which ran out of budget
+ */
+void _mii_analysis_lua_hook(lua_State* lua_state, lua_Debug* ar) {
+    lua_pushlightuserdata(lua_state, (void*) &_mii_analysis_lua_worker_key);
+    lua_rawget(lua_state, LUA_REGISTRYINDEX);
+
+    _mii_analysis_worker* w = lua_touserdata(lua_state, -1);
+    lua_pop(lua_state, 1);
+
+    if (++w->lua_hooks > MII_ANALYSIS_LUA_MAX_INSTRUCTIONS / MII_ANALYSIS_LUA_HOOK_COUNT) {
+        luaL_error(lua_state, "ran for more than %d instructions", MII_ANALYSIS_LUA_MAX_INSTRUCTIONS);
+    }
+}
+#endif
+
+/*
+ * run analysis for an arbitrary module, using a worker's state
+ * workers can run concurrently, but each worker only on one thread at a time
+ */
+int mii_analysis_run(int worker, const char* modfile, int modtype, const char* text, size_t size, char*** bins_out, int* num_bins_out, char*** dirs_out, int64_t** dir_mtimes_out, int* num_dirs_out) {
+    _mii_analysis_out out = { bins_out, num_bins_out, dirs_out, dir_mtimes_out, num_dirs_out };
+
+    /* an empty modulefile sets nothing */
+    if (!size) return 0;
+
     switch (modtype) {
     case MII_MODTABLE_MODTYPE_LMOD:
-        return _mii_analysis_lmod(modfile, bins_out, num_bins_out);
+        return _mii_analysis_lmod(_mii_analysis_workers + worker, modfile, text, size, &out);
     case MII_MODTABLE_MODTYPE_TCL:
-        return _mii_analysis_tcl(modfile, bins_out, num_bins_out);
+        return _mii_analysis_tcl(_mii_analysis_workers + worker, modfile, text, size, &out);
+    }
+
+    return 0;
+}
+
+/*
+ * check whether any directory scanned by an earlier analysis has changed since
+ */
+int mii_analysis_dirs_changed(char** dirs, const int64_t* dir_mtimes, int num_dirs) {
+    for (int i = 0; i < num_dirs; ++i) {
+        if (_mii_analysis_dir_mtime(dirs[i]) != dir_mtimes[i]) {
+            mii_debug("bin directory %s changed", dirs[i]);
+            return 1;
+        }
     }
 
     return 0;
@@ -137,34 +339,62 @@ int mii_analysis_run(const char* modfile, int modtype, char*** bins_out, int* nu
 #if MII_ENABLE_LUA
 /*
  * run a modulefile's code in a Lua sandbox
+ * each modulefile runs in a fresh environment and with a budget of its own. an interpreter
+ * which ran a modulefile out of its budget is replaced, in case it was left in a bad state
  */
-int _mii_analysis_lua_run(lua_State* lua_state, const char* code, char*** paths_out, int* num_paths_out) {
+int _mii_analysis_lua_run(_mii_analysis_worker* w, const char* code, char*** paths_out, int* num_paths_out) {
+    lua_State* lua_state = w->lua_state;
+
+    if (!lua_state) return -1;
+
     /* execute modulefile */
     int res;
+    lua_settop(lua_state, 0);
     lua_getglobal(lua_state, "sandbox_run");
     lua_pushstring(lua_state, code);
+
+    w->lua_hooks = 0;
+    lua_sethook(lua_state, _mii_analysis_lua_hook, LUA_MASKCOUNT, MII_ANALYSIS_LUA_HOOK_COUNT);
+
     res = lua_pcall(lua_state, 1, 1, 0);
 
+    lua_sethook(lua_state, NULL, 0, 0);
+
     if(res != LUA_OK) {
         mii_error("Error occured in Lua sandbox : %s", lua_tostring(lua_state, -1));
-        lua_pop(lua_state, 1);
+
+        if (res == LUA_ERRMEM || w->lua_hooks > MII_ANALYSIS_LUA_MAX_INSTRUCTIONS / MII_ANALYSIS_LUA_HOOK_COUNT) {
+            _mii_analysis_worker_free(w);
+            _mii_analysis_lua_open(w);
+        } else {
+            lua_pop(lua_state, 1);
+        }
+
         return -1;
     }
 
-    luaL_checktype(lua_state, 1, LUA_TTABLE);
+    if (!lua_istable(lua_state, 1)) {
+        lua_settop(lua_state, 0);
+        return -1;
+    }
 
     /* allocate memory for the paths */
-    *num_paths_out = mii_lua_len(lua_state, -1);
-    *paths_out = malloc(*num_paths_out * sizeof(char*));
+    int num_paths = mii_lua_len(lua_state, 1);
+
+    *paths_out = malloc((num_paths ? num_paths : 1) * sizeof **paths_out);
+    *num_paths_out = 0;
+
+    /* retrieve paths from the table. paths built by functions the sandbox doesn't know are fake objects, which are skipped */
+    for (int i = 1; i <= num_paths; ++i) {
+        lua_rawgeti(lua_state, 1, i);
+
+        if (lua_type(lua_state, -1) == LUA_TSTRING) (*paths_out)[(*num_paths_out)++] = mii_strdup(lua_tostring(lua_state, -1));
 
-    /* retrieve paths from Lua stack */
-    for (int i = 1; i <= *num_paths_out; ++i) {
-        lua_rawgeti(lua_state, -i, i);
-        (*paths_out)[i-1] = mii_strdup(lua_tostring(lua_state, -1));
+        lua_pop(lua_state, 1);
     }
 
-    /* pop every rawgeti + table */
-    lua_pop(lua_state, *num_paths_out + 1);
+    /* nothing from the modulefile stays on the stack */
+    lua_settop(lua_state, 0);
 
     return 0;
 }
@@ -173,182 +403,253 @@ int _mii_analysis_lua_run(lua_State* lua_state, const char* code, char*** paths_
 /*
  * extract paths from an lmod file
  */
-int _mii_analysis_lmod(const char* path, char*** bins_out, int* num_bins_out) {
-    FILE* f = fopen(path, "r");
-
-    if (!f) {
-        mii_error("Couldn't open %s for reading : %s", path, strerror(errno));
-        return -1;
-    }
-
+int _mii_analysis_lmod(_mii_analysis_worker* w, const char* path, const char* text, size_t size, _mii_analysis_out* out) {
 #if !MII_ENABLE_LUA
-    char linebuf[MII_ANALYSIS_LINEBUF_SIZE];
-    regmatch_t matches[3];
+    const char* cur = text, *end = text + size, *match;
+    size_t len;
 
-    while (fgets(linebuf, sizeof linebuf, f)) {
-        /* strip off newline */
-        int len = strlen(linebuf);
-        if (linebuf[len - 1] == '\n') linebuf[len - 1] = 0;
+    while ((match = _mii_analysis_lmod_next(&cur, end, &len))) {
+        char* bin_path = malloc(len + 1);
 
-        /* execute regex */
-        if (!regexec(&_mii_analysis_lmod_regex, linebuf, 3, matches, 0)) {
-            if (matches[2].rm_so < 0) continue;
-            linebuf[matches[2].rm_eo] = 0;
+        memcpy(bin_path, match, len);
+        bin_path[len] = 0;
 
-            _mii_analysis_scan_path(linebuf + matches[2].rm_so, bins_out, num_bins_out);
-        }
+        _mii_analysis_scan_path(&w->batch, bin_path, out);
+        free(bin_path);
     }
-
-    fclose(f);
 #else
-    char* buffer;
-    fseek(f, 0L, SEEK_END);
-    long s = ftell(f);
-    rewind(f);
-    buffer = malloc(s + 1);
-    if ( buffer != NULL ) {
-        fread(buffer, s, 1, f);
-        fclose(f); f = NULL;
-        buffer[s] = '\0';
-
-        /* get binaries paths */
-        char** bin_paths;
-        int num_paths;
-        if(_mii_analysis_lua_run(lua_state, buffer, &bin_paths, &num_paths)) {
-            mii_error("Error occured when executing %s, skipping", path);
-            free(buffer);
-            return -1;
-        }
-
-        /* scan every path returned */
-        for(int i = 0; i < num_paths; ++i) {
-            _mii_analysis_scan_path(bin_paths[i], bins_out, num_bins_out);
-            free(bin_paths[i]);
-        }
+    /* get binaries paths */
+    char** bin_paths;
+    int num_paths;
+    if(_mii_analysis_lua_run(w, text, &bin_paths, &num_paths)) {
+        mii_error("Error occured when executing %s, skipping", path);
+        return -1;
+    }
 
-        free(bin_paths);
-        free(buffer);
+    /* scan every path returned */
+    for(int i = 0; i < num_paths; ++i) {
+        _mii_analysis_scan_path(&w->batch, bin_paths[i], out);
+        free(bin_paths[i]);
     }
-    if (f != NULL) fclose(f);
+
+    free(bin_paths);
 #endif
 
     return 0;
 }
 
+#if !MII_ENABLE_LUA
 /*
- * extract paths from a tcl file
+ * find the next path added to PATH by a line like
+ *
+ *     prepend_path("PATH", "/some/bin")    (or append_path)
+ *
+ * the text is searched for the '_' of each call with memchr, so most of it is skipped
+ * without looking at every byte. at most one path is taken from each line, the first
+ * call on it which adds to PATH. lines have no length limit.
+ *
+ * returns the path (not terminated) with its length in *len_out, moving *cur past
+ * its line, or NULL at the end of the text
  */
-int _mii_analysis_tcl(const char* path, char*** bins_out, int* num_bins_out) {
-    char linebuf[MII_ANALYSIS_LINEBUF_SIZE];
+const char* _mii_analysis_lmod_next(const char** cur, const char* end, size_t* len_out) {
+    const char* text = *cur;
 
-    FILE* f = fopen(path, "r");
+    for (const char* u = text; (u = memchr(u, '_', end - u)); ++u) {
+        /* both names end with "pend_path" */
+        if (u - text < 6 || memcmp(u - 4, "pend", 4)) continue;
+        if (memcmp(u - 6, "ap", 2) && (u - text < 7 || memcmp(u - 7, "pre", 3))) continue;
 
-    if (!f) {
-        mii_error("Couldn't open %s for reading : %s", path, strerror(errno));
-        return -1;
+        if (end - u < 5 || memcmp(u + 1, "path", 4)) continue;
+
+        const char* p = _mii_analysis_lmod_skip(u + 5, end, "(");
+        if (p) p = _mii_analysis_lmod_skip(p, end, "\"PATH\"");
+        if (p) p = _mii_analysis_lmod_skip(p, end, ",");
+        if (p) p = _mii_analysis_lmod_skip(p, end, "\"");
+        if (!p) continue;
+
+        /* the path runs up to the closing quote, on the same line */
+        const char* q = p;
+        while (q < end && *q != '"' && *q != '\n' && *q) ++q;
+
+        if (q == p || q == end || *q != '"') continue;
+
+        const char* eol = memchr(q, '\n', end - q);
+        *cur = eol ? eol + 1 : end;
+
+        *len_out = q - p;
+        return p;
     }
 
-    char* cmd, *key, *val, *expanded;
+    *cur = end;
+    return NULL;
+}
 
-    while (fgets(linebuf, sizeof linebuf, f)) {
-        /* strip off newline */
-        int len = strlen(linebuf);
-        if (linebuf[len - 1] == '\n') linebuf[len - 1] = 0;
+/*
+ * skip whitespace (within the line), then expect a token
+ * returns the position after the token, or NULL if it isn't there
+ */
+const char* _mii_analysis_lmod_skip(const char* cur, const char* end, const char* expect) {
+    size_t len = strlen(expect);
 
-        if (!(cmd = strtok(linebuf, " \t"))) continue;
+    while (cur < end && *cur != '\n' && isspace((unsigned char) *cur)) ++cur;
 
-        if (*cmd == '#') continue; /* skip comments */
+    if ((size_t) (end - cur) < len || memcmp(cur, expect, len)) return NULL;
 
-        if (!strcmp(cmd, "set")) {
-            if (!(key = strtok(NULL, " \t"))) continue;
-            if (!(val = strtok(NULL, " \t"))) continue;
-            if (!(expanded = _mii_analysis_expand(val))) continue;
+    return cur + len;
+}
+#endif
 
-            setenv(key, expanded, 1);
-            free(expanded);
-        } else if (!strcmp(cmd, "prepend-path") || !strcmp(cmd, "append-path")) {
-            if (!(key = strtok(NULL, " \t"))) continue;
-            if (strcmp(key, "PATH")) continue;
+/*
+ * extract paths from a tcl file
+ * each file is evaluated with its own variables, so files are analyzed concurrently
+ */
+int _mii_analysis_tcl(_mii_analysis_worker* w, const char* path, const char* text, size_t size, _mii_analysis_out* out) {
+    mii_tcl t;
 
-            if (!(val = strtok(NULL, " \t"))) continue;
-            if (!(expanded = _mii_analysis_expand(val))) continue;
+    mii_tcl_init(&t);
+    mii_tcl_eval(&t, text, size);
 
-            _mii_analysis_scan_path(expanded, bins_out, num_bins_out);
-            free(expanded);
-        }
+    /* scanning splits the entries in place, they're owned by the evaluator until it's freed */
+    for (int i = 0; i < t.num_paths; ++i) {
+        _mii_analysis_scan_path(&w->batch, t.paths[i], out);
     }
 
-    fclose(f);
+    mii_debug("Evaluated %s, %d PATH entries", path, t.num_paths);
+
+    mii_tcl_free(&t);
     return 0;
 }
 
 /*
  * scan a path for commands
+ * each directory is recorded with its mtime, so later syncs can tell when its commands change
  */
-int _mii_analysis_scan_path(char* path, char*** bins_out, int* num_bins_out) {
+int _mii_analysis_scan_path(mii_batch* batch, char* path, _mii_analysis_out* out) {
     /* paths might contain multiple in one (seperated by ':'),
      * break them up here */
 
-    DIR* d;
-    struct dirent* dp;
-    struct stat st;
+    char* save;
+    time_t now = time(NULL);
+
+    for (const char* cur_path = strtok_r(path, ":", &save); cur_path; cur_path = strtok_r(NULL, ":", &save)) {
+        /* undecidable conditionals run every branch, so a module can name the same directory more than once */
+        int seen = 0;
+
+        for (int i = 0; i < *out->num_dirs && !seen; ++i) {
+            seen = !strcmp((*out->dirs)[i], cur_path);
+        }
 
-    for (const char* cur_path = strtok(path, ":"); cur_path; cur_path = strtok(NULL, ":")) {
-        mii_debug("scanning PATH %s", cur_path);
+        if (seen) continue;
 
-        /* TODO: this could be faster, do some benchmarking to see if it's actually slow */
-        if (!(d = opendir(cur_path))) {
-            mii_debug("Failed to open %s, ignoring : %s", cur_path, strerror(errno));
+        int64_t mtime = _mii_analysis_dir_mtime(cur_path);
+
+        /* a directory changed within a second of the scan might change again without a new mtime */
+        ++*out->num_dirs;
+        *out->dirs = realloc(*out->dirs, *out->num_dirs * sizeof **out->dirs);
+        *out->dir_mtimes = realloc(*out->dir_mtimes, *out->num_dirs * sizeof **out->dir_mtimes);
+        (*out->dirs)[*out->num_dirs - 1] = mii_strdup(cur_path);
+        (*out->dir_mtimes)[*out->num_dirs - 1] = (mtime / 1000000000 >= now - 1) ? MII_MODTABLE_MTIME_UNSETTLED : mtime;
+
+        /* missing directories are still recorded, in case they are created later */
+        if (!mtime) continue;
+
+        if (!_mii_analysis_bincache_loaded) {
+            _mii_analysis_scan_dir(batch, cur_path, out->bins, out->num_bins);
             continue;
         }
 
-        while ((dp = readdir(d))) {
-            if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) continue;
-
-            char* abs_path = mii_join_path(cur_path, dp->d_name);
-
-            if (!stat(abs_path, &st)) {
-                /* check the file is executable by the user */
-                if ((S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) && !access(abs_path, X_OK)) {
-                    /* found a binary! append it to the list */
-                    ++*num_bins_out;
-                    *bins_out = realloc(*bins_out, *num_bins_out * sizeof **bins_out);
-                    (*bins_out)[*num_bins_out - 1] = mii_strdup(dp->d_name);
-                }
-            } else {
-                mii_warn("Couldn't stat %s : %s", abs_path, strerror(errno));
-            }
+        /* directories are cached by mtime, which changes whenever a command is added or removed */
+        if (!mii_bincache_lookup(&_mii_analysis_bincache, cur_path, mtime, out->bins, out->num_bins)) continue;
+
+        char** dir_bins = NULL;
+        int num_dir_bins = 0;
+
+        if (_mii_analysis_scan_dir(batch, cur_path, &dir_bins, &num_dir_bins)) continue;
 
-            free(abs_path);
+        mii_bincache_store(&_mii_analysis_bincache, cur_path, mtime, dir_bins, num_dir_bins);
+
+        /* move the listing into the output */
+        if (num_dir_bins) {
+            *out->bins = realloc(*out->bins, (*out->num_bins + num_dir_bins) * sizeof **out->bins);
+            memcpy(*out->bins + *out->num_bins, dir_bins, num_dir_bins * sizeof *dir_bins);
+            *out->num_bins += num_dir_bins;
         }
 
-        closedir(d);
+        free(dir_bins);
     }
 
     return 0;
 }
 
-char* _mii_analysis_expand(const char* expr) {
-    wordexp_t w;
+/*
+ * get the mtime of a directory in nanoseconds, 0 if it can't be reached
+ */
+int64_t _mii_analysis_dir_mtime(const char* path) {
+    struct stat st;
 
-    if (wordexp(expr, &w, WRDE_NOCMD)) {
-        /* expansion failed. die quietly */
-        mii_debug("Expansion failed on string \"%s\"!", expr);
-        return NULL;
+    if (stat(path, &st)) {
+        mii_debug("Failed to stat %s : %s", path, strerror(errno));
+        return 0;
     }
 
-    char* output = NULL;
-    int len = 0;
+    return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/*
+ * list the commands in a single directory
+ * the entries are stat'ed as one batch, only those with an execute bit need asking whether the user can run them
+ */
+int _mii_analysis_scan_dir(mii_batch* batch, const char* path, char*** bins_out, int* num_bins_out) {
+    DIR* d;
+    struct dirent* dp;
+
+    mii_debug("scanning PATH %s", path);
+
+    if (!(d = opendir(path))) {
+        mii_debug("Failed to open %s, ignoring : %s", path, strerror(errno));
+        return -1;
+    }
+
+    char** names = NULL;
+    int num_names = 0, max_names = 0;
+
+    while ((dp = readdir(d))) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) continue;
 
-    for (int i = 0; i < w.we_wordc; ++i) {
-        int wsize = strlen(w.we_wordv[i]);
-        len += wsize;
-        output = realloc(output, len + 1);
-        memcpy(output + len - wsize, w.we_wordv[i], len + 1);
+        if (num_names == max_names) {
+            max_names = max_names ? max_names * 2 : 64;
+            names = realloc(names, max_names * sizeof *names);
+        }
+
+        names[num_names++] = mii_strdup(dp->d_name);
+    }
+
+    struct stat* sts = malloc(mii_max(num_names, 1) * sizeof *sts);
+    int* errs = malloc(mii_max(num_names, 1) * sizeof *errs);
+
+    mii_batch_stat(batch, dirfd(d), names, num_names, sts, errs);
+
+    for (int i = 0; i < num_names; ++i) {
+        if (errs[i]) {
+            mii_warn("Couldn't stat %s/%s : %s", path, names[i], strerror(errs[i]));
+        } else if (S_ISREG(sts[i].st_mode) && (sts[i].st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))
+                && !faccessat(dirfd(d), names[i], X_OK, 0)) {
+            /* found a binary! append it to the list */
+            ++*num_bins_out;
+            *bins_out = realloc(*bins_out, *num_bins_out * sizeof **bins_out);
+            (*bins_out)[*num_bins_out - 1] = names[i];
+            continue;
+        }
+
+        free(names[i]);
     }
 
-    wordfree(&w);
-    return output;
+    free(names);
+    free(sts);
+    free(errs);
+
+    closedir(d);
+    return 0;
 }
 
 #if MII_ENABLE_SPIDER
@@ -379,18 +680,29 @@ int mii_analysis_parse_module_json(const cJSON* mod_json, mii_modtable_entry* mo
     /* fill up some of the info */
     mod->bins = NULL;
     mod->num_bins = 0;
+    mod->bin_dirs = NULL;
+    mod->bin_dir_mtimes = NULL;
+    mod->num_bin_dirs = 0;
     mod->path = mii_strdup(mod_json->string);
     mod->type = MII_MODTABLE_MODTYPE_LMOD;
-    mod->timestamp = st.st_mtime;
+    mod->fingerprint.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    mod->fingerprint.size = st.st_size;
+    mod->fingerprint.inode = st.st_ino;
+    mod->fingerprint.hash = 0;
+    mod->previous = NULL;
     mod->code = mii_strdup(code->valuestring);
     mod->analysis_complete = 1;
+    mod->stale = 0;
+    mod->changed = 1; /* analyzed by the spider, not taken from the saved index */
 
     /* get the bins */
     cJSON* bin_paths = cJSON_GetObjectItemCaseSensitive(mod_json, "pathA");
     if (bin_paths != NULL) {
+        _mii_analysis_out out = { &mod->bins, &mod->num_bins, &mod->bin_dirs, &mod->bin_dir_mtimes, &mod->num_bin_dirs };
+
         for (cJSON* path = bin_paths->child; path != NULL; path = path->next) {
             /* analyze the bin paths */
-            _mii_analysis_scan_path(path->string, &mod->bins, &mod->num_bins);
+            _mii_analysis_scan_path(NULL, path->string, &out);
         }
     }
 
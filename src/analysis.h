@@ -6,7 +6,8 @@
 #include "modtable.h"
 #endif
 
-#define MII_ANALYSIS_LINEBUF_SIZE 512
+#include <stddef.h>
+#include <stdint.h>
 
 /*
  * analysis.h
@@ -14,10 +15,21 @@
  * functions for analyzing module files and extracting command names
  */
 
-int mii_analysis_init();
+int mii_analysis_init(int num_workers); /* state for up to num_workers concurrent analyses */
 void mii_analysis_free();
+int mii_analysis_num_workers();
 
-int mii_analysis_run(const char* modfile, int modtype, char*** bins_out, int* num_bins_out);
+/* bin directory cache, saved next to the index */
+int mii_analysis_load_cache(const char* path, int rescan);
+int mii_analysis_save_cache(const char* path, int prune);
+void mii_analysis_forget_dirs(char** dirs, int num_dirs); /* list these directories again, even at the same mtime */
+
+/* analyze the text of a modulefile (null-terminated, size bytes long).
+ * the bin directories scanned are appended to dirs_out with their mtimes */
+int mii_analysis_run(int worker, const char* modfile, int modtype, const char* text, size_t size, char*** bins_out, int* num_bins_out, char*** dirs_out, int64_t** dir_mtimes_out, int* num_dirs_out);
+
+/* truthy if any directory scanned by an earlier analysis has changed */
+int mii_analysis_dirs_changed(char** dirs, const int64_t* dir_mtimes, int num_dirs);
 
 #if MII_ENABLE_SPIDER
 int mii_analysis_parse_module_json(const cJSON* mod_json, mii_modtable_entry* mod);
@@ -0,0 +1,442 @@
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* statx, syscall */
+
+#include "batch.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#if MII_ENABLE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MII_BATCH_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_SIZE | STATX_INO)
+
+int _mii_batch_read_one(const char* path, char** buf_out, size_t* size_out);
+int _mii_batch_read_fd(int fd, char** buf, size_t* size, size_t max_size);
+
+#if MII_ENABLE_URING
+int _mii_batch_uring_init(mii_batch* b);
+void _mii_batch_uring_free(mii_batch* b);
+struct io_uring_sqe* _mii_batch_sqe(mii_batch* b, int i);
+int _mii_batch_submit(mii_batch* b, int num, int* res);
+int _mii_batch_uring_stat(mii_batch* b, int dir_fd, char** names, int num, struct stat* out, int* errs);
+int _mii_batch_uring_read(mii_batch* b, char** paths, int num, char** bufs, size_t* sizes, int* errs);
+#endif
+
+/*
+ * initialize a batch, on io_uring if it is enabled and the kernel supports it
+ */
+void mii_batch_init(mii_batch* b) {
+    memset(b, 0, sizeof *b);
+    b->fd = -1;
+
+#if MII_ENABLE_URING
+    if (_mii_batch_uring_init(b)) mii_debug("Couldn't set up io_uring, filesystem requests will run one at a time: %s", strerror(errno));
+#endif
+}
+
+/*
+ * cleanup a batch
+ */
+void mii_batch_free(mii_batch* b) {
+#if MII_ENABLE_URING
+    if (b->fd >= 0) _mii_batch_uring_free(b);
+#endif
+
+    memset(b, 0, sizeof *b);
+    b->fd = -1;
+}
+
+/*
+ * read the type, mtime, size and inode of a path, relative to a directory descriptor
+ * statx only asks for those fields, and lets network filesystems answer from their
+ * attribute cache instead of revalidating every entry with the server
+ */
+int mii_batch_stat_at(int dir_fd, const char* name, struct stat* out) {
+#ifdef STATX_TYPE
+    struct statx stx;
+
+    if (!statx(dir_fd, name, AT_STATX_DONT_SYNC, MII_BATCH_STATX_MASK, &stx)) {
+        memset(out, 0, sizeof *out);
+
+        out->st_mode = stx.stx_mode;
+        out->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        out->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+        out->st_size = stx.stx_size;
+        out->st_ino = stx.stx_ino;
+
+        return 0;
+    }
+
+    /* kernels before 4.11 don't have statx */
+    if (errno != ENOSYS) return -1;
+#endif
+
+    return fstatat(dir_fd, name, out, 0);
+}
+
+/*
+ * stat many names relative to a directory descriptor
+ */
+void mii_batch_stat(mii_batch* b, int dir_fd, char** names, int num, struct stat* out, int* errs) {
+    int done = 0;
+
+#if MII_ENABLE_URING
+    if (b && b->fd >= 0) done = _mii_batch_uring_stat(b, dir_fd, names, num, out, errs);
+#endif
+
+    /* whatever the ring didn't take runs one at a time */
+    for (int i = done; i < num; ++i) {
+        errs[i] = mii_batch_stat_at(dir_fd, names[i], out + i) ? errno : 0;
+    }
+}
+
+/*
+ * read many files whole
+ */
+void mii_batch_read(mii_batch* b, char** paths, int num, char** bufs, size_t* sizes, int* errs) {
+    int done = 0;
+
+#if MII_ENABLE_URING
+    if (b && b->fd >= 0) done = _mii_batch_uring_read(b, paths, num, bufs, sizes, errs);
+#endif
+
+    for (int i = done; i < num; ++i) {
+        errs[i] = _mii_batch_read_one(paths[i], bufs + i, sizes + i) ? errno : 0;
+    }
+}
+
+/*
+ * read a file whole, one request at a time
+ */
+int _mii_batch_read_one(const char* path, char** buf_out, size_t* size_out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    *buf_out = NULL;
+    *size_out = 0;
+
+    if (fd < 0) return -1;
+
+    char* buf = malloc(MII_BATCH_READ_SIZE + 1);
+    size_t size = 0;
+
+    if (_mii_batch_read_fd(fd, &buf, &size, MII_BATCH_READ_SIZE)) {
+        int err = errno;
+
+        free(buf);
+        close(fd);
+
+        errno = err;
+        return -1;
+    }
+
+    close(fd);
+
+    *buf_out = buf;
+    *size_out = size;
+
+    return 0;
+}
+
+/*
+ * read the rest of a file into a buffer of max_size bytes (plus the terminator) holding the first size bytes
+ * the buffer is grown as needed and terminated
+ */
+int _mii_batch_read_fd(int fd, char** buf, size_t* size, size_t max_size) {
+    for (;;) {
+        if (*size == max_size) {
+            max_size *= 2;
+            *buf = realloc(*buf, max_size + 1);
+        }
+
+        /* reads on the ring don't move the file offset, so reads here are positioned too */
+        ssize_t len = pread(fd, *buf + *size, max_size - *size, *size);
+
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        if (!len) break;
+
+        *size += len;
+    }
+
+    (*buf)[*size] = 0;
+    return 0;
+}
+
+#if MII_ENABLE_URING
+/*
+ * set up a ring, failing if the kernel lacks io_uring or any operation used here (before 5.6)
+ * errno is set on failure
+ */
+int _mii_batch_uring_init(mii_batch* b) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    /* completions are reaped after each batch, so the ring never holds more than one */
+    int fd = syscall(__NR_io_uring_setup, MII_BATCH_SIZE, &params);
+
+    if (fd < 0) return -1;
+
+    /* rings mapped as one region and the opcodes used here both arrived by 5.6 */
+    struct io_uring_probe* probe = calloc(1, sizeof *probe + IORING_OP_LAST * sizeof *probe->ops);
+    int supported = (params.features & IORING_FEAT_SINGLE_MMAP)
+                 && !syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+
+    const int ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ };
+
+    for (size_t i = 0; supported && i < sizeof ops / sizeof *ops; ++i) {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+
+    if (!supported) {
+        close(fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    b->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+    b->sqes_ring_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    b->sqes_ring = mmap(NULL, b->sqes_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (b->ring == MAP_FAILED || b->sqes_ring == MAP_FAILED) {
+        int err = errno;
+
+        if (b->ring != MAP_FAILED) munmap(b->ring, b->ring_size);
+        if (b->sqes_ring != MAP_FAILED) munmap(b->sqes_ring, b->sqes_ring_size);
+        close(fd);
+
+        errno = err;
+        return -1;
+    }
+
+    char* ring = b->ring;
+
+    b->sq_tail  = (unsigned*) (ring + params.sq_off.tail);
+    b->sq_mask  = (unsigned*) (ring + params.sq_off.ring_mask);
+    b->sq_array = (unsigned*) (ring + params.sq_off.array);
+    b->cq_head  = (unsigned*) (ring + params.cq_off.head);
+    b->cq_tail  = (unsigned*) (ring + params.cq_off.tail);
+    b->cq_mask  = (unsigned*) (ring + params.cq_off.ring_mask);
+    b->cqes     = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+    b->sqes     = b->sqes_ring;
+
+    b->fd = fd;
+    return 0;
+}
+
+/*
+ * unmap and close a ring, requests run one at a time from then on
+ */
+void _mii_batch_uring_free(mii_batch* b) {
+    munmap(b->sqes_ring, b->sqes_ring_size);
+    munmap(b->ring, b->ring_size);
+    close(b->fd);
+
+    b->fd = -1;
+}
+
+/*
+ * get the i-th submission entry of the next batch, cleared
+ */
+struct io_uring_sqe* _mii_batch_sqe(mii_batch* b, int i) {
+    unsigned index = (*b->sq_tail + i) & *b->sq_mask;
+    struct io_uring_sqe* sqe = b->sqes + index;
+
+    b->sq_array[index] = index;
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = i;
+
+    return sqe;
+}
+
+/*
+ * submit the next num entries and wait for all of them, res[i] gets the result of the i-th
+ * if the ring fails it is closed and -1 returned
+ */
+int _mii_batch_submit(mii_batch* b, int num, int* res) {
+    __atomic_store_n(b->sq_tail, *b->sq_tail + num, __ATOMIC_RELEASE);
+
+    for (int to_submit = num, completed = 0; completed < num; ) {
+        int submitted = syscall(__NR_io_uring_enter, b->fd, to_submit, num - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+
+            mii_warn("io_uring failed, falling back to one request at a time: %s", strerror(errno));
+            _mii_batch_uring_free(b);
+            return -1;
+        }
+
+        to_submit -= submitted;
+
+        unsigned head = *b->cq_head, tail = __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head, ++completed) {
+            const struct io_uring_cqe* cqe = b->cqes + (head & *b->cq_mask);
+            res[cqe->user_data] = cqe->res;
+        }
+
+        __atomic_store_n(b->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+/*
+ * stat names on the ring, returns how many were done
+ */
+int _mii_batch_uring_stat(mii_batch* b, int dir_fd, char** names, int num, struct stat* out, int* errs) {
+    struct statx stx[MII_BATCH_SIZE];
+    int res[MII_BATCH_SIZE];
+    int done = 0;
+
+    while (done < num) {
+        int n = (num - done < MII_BATCH_SIZE) ? num - done : MII_BATCH_SIZE;
+
+        for (int i = 0; i < n; ++i) {
+            struct io_uring_sqe* sqe = _mii_batch_sqe(b, i);
+
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dir_fd;
+            sqe->addr = (uintptr_t) names[done + i];
+            sqe->len = MII_BATCH_STATX_MASK;
+            sqe->off = (uintptr_t) (stx + i);
+            sqe->statx_flags = AT_STATX_DONT_SYNC;
+        }
+
+        if (_mii_batch_submit(b, n, res)) break;
+
+        for (int i = 0; i < n; ++i) {
+            struct stat* st = out + done + i;
+
+            if (res[i] < 0) {
+                errs[done + i] = -res[i];
+                continue;
+            }
+
+            memset(st, 0, sizeof *st);
+
+            st->st_mode = stx[i].stx_mode;
+            st->st_mtim.tv_sec = stx[i].stx_mtime.tv_sec;
+            st->st_mtim.tv_nsec = stx[i].stx_mtime.tv_nsec;
+            st->st_size = stx[i].stx_size;
+            st->st_ino = stx[i].stx_ino;
+
+            errs[done + i] = 0;
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+
+/*
+ * read files on the ring, returns how many were done
+ * every file of a batch is opened at once, then read at once. the few which don't fit
+ * the first buffer are finished one at a time
+ */
+int _mii_batch_uring_read(mii_batch* b, char** paths, int num, char** bufs, size_t* sizes, int* errs) {
+    int fds[MII_BATCH_SIZE], res[MII_BATCH_SIZE];
+    int done = 0;
+
+    while (done < num) {
+        int n = (num - done < MII_BATCH_SIZE) ? num - done : MII_BATCH_SIZE;
+
+        for (int i = 0; i < n; ++i) {
+            struct io_uring_sqe* sqe = _mii_batch_sqe(b, i);
+
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) paths[done + i];
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+
+        if (_mii_batch_submit(b, n, fds)) break;
+
+        int num_reads = 0;
+
+        for (int i = 0; i < n; ++i) {
+            bufs[done + i] = NULL;
+            sizes[done + i] = 0;
+
+            if (fds[i] < 0) {
+                errs[done + i] = -fds[i];
+                continue;
+            }
+
+            bufs[done + i] = malloc(MII_BATCH_READ_SIZE + 1);
+
+            struct io_uring_sqe* sqe = _mii_batch_sqe(b, num_reads++);
+
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fds[i];
+            sqe->addr = (uintptr_t) bufs[done + i];
+            sqe->len = MII_BATCH_READ_SIZE;
+            sqe->user_data = i;
+        }
+
+        if (num_reads && _mii_batch_submit(b, num_reads, res)) {
+            /* the opened files are read one at a time instead */
+            for (int i = 0; i < n; ++i) {
+                if (fds[i] < 0) continue;
+
+                errs[done + i] = _mii_batch_read_fd(fds[i], bufs + done + i, sizes + done + i, MII_BATCH_READ_SIZE) ? errno : 0;
+                close(fds[i]);
+            }
+        } else {
+            for (int i = 0; i < n; ++i) {
+                if (fds[i] < 0) continue;
+
+                errs[done + i] = 0;
+
+                if (res[i] < 0) {
+                    errs[done + i] = -res[i];
+                } else {
+                    sizes[done + i] = res[i];
+
+                    /* a full buffer might not be the whole file */
+                    if (res[i] < MII_BATCH_READ_SIZE) {
+                        bufs[done + i][res[i]] = 0;
+                    } else if (_mii_batch_read_fd(fds[i], bufs + done + i, sizes + done + i, MII_BATCH_READ_SIZE)) {
+                        errs[done + i] = errno;
+                    }
+                }
+
+                close(fds[i]);
+            }
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (errs[done + i] && bufs[done + i]) {
+                free(bufs[done + i]);
+                bufs[done + i] = NULL;
+                sizes[done + i] = 0;
+            }
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * mii_batch
+ *
+ * batches of filesystem requests
+ *
+ * on network filesystems a crawl spends most of its time waiting on one round trip
+ * after another. with io_uring (MII_ENABLE_URING) every request of a batch is
+ * submitted at once, so they are in flight together from a single thread.
+ * without it, or on kernels which don't support it, requests run one at a time.
+ *
+ * a batch is not thread safe, concurrent workers each use their own. a NULL batch
+ * runs requests one at a time.
+ */
+
+#include <sys/stat.h>
+#include <stddef.h>
+
+#if MII_ENABLE_URING
+#include <linux/io_uring.h>
+#endif
+
+/* requests in flight at once */
+#define MII_BATCH_SIZE 64
+
+/* reads start with a buffer of this size, which fits most modulefiles */
+#define MII_BATCH_READ_SIZE 16384
+
+typedef struct _mii_batch {
+    int fd; /* io_uring descriptor, -1 if requests run one at a time */
+#if MII_ENABLE_URING
+    unsigned* sq_tail, *sq_mask, *sq_array;
+    unsigned* cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* ring, *sqes_ring;
+    size_t ring_size, sqes_ring_size;
+#endif
+} mii_batch;
+
+void mii_batch_init(mii_batch* b); /* falls back to running requests one at a time */
+void mii_batch_free(mii_batch* b);
+
+/* read the type, mtime, size and inode of a path relative to a directory descriptor (or AT_FDCWD) */
+int mii_batch_stat_at(int dir_fd, const char* name, struct stat* out);
+
+/* mii_batch_stat_at for many names, errs[i] is 0 or the errno of names[i] */
+void mii_batch_stat(mii_batch* b, int dir_fd, char** names, int num, struct stat* out, int* errs);
+
+/* read whole files into null-terminated buffers owned by the caller.
+ * bufs[i] is NULL with errs[i] set if paths[i] couldn't be read */
+void mii_batch_read(mii_batch* b, char** paths, int num, char** bufs, size_t* sizes, int* errs);
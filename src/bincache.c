@@ -0,0 +1,386 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bincache.h"
+#include "util.h"
+#include "log.h"
+
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash/xxhash.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static const unsigned char MII_BINCACHE_MAGIC_BYTES[] = { 0xBE, 0xE5, 0x1D, 0x42 };
+
+/* written in host order, reads back differently on a foreign-endian host */
+#define MII_BINCACHE_BYTE_ORDER 0x0102
+
+int _mii_bincache_get_target_index(const char* path);
+mii_bincache_dir* _mii_bincache_locate(mii_bincache* p, const char* path);
+mii_bincache_dir* _mii_bincache_insert(mii_bincache* p, char* path, int64_t mtime, int settled, char** bins, int num_bins);
+void _mii_bincache_dir_free(mii_bincache_dir* d);
+int _mii_bincache_parse(mii_bincache* p, const char* path, const char* body, size_t size, uint32_t num_dirs);
+
+/*
+ * initialize an empty cache
+ */
+void mii_bincache_init(mii_bincache* p) {
+    memset(p, 0, sizeof *p);
+    p->load_time = time(NULL);
+    pthread_mutex_init(&p->lock, NULL);
+}
+
+/*
+ * cleanup cache memory
+ */
+void mii_bincache_free(mii_bincache* p) {
+    for (int i = 0; i < MII_BINCACHE_HASHTABLE_WIDTH; ++i) {
+        for (mii_bincache_dir* cur = p->buf[i], *next; cur; cur = next) {
+            next = cur->next;
+            _mii_bincache_dir_free(cur);
+        }
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    memset(p, 0, sizeof *p);
+}
+
+/*
+ * load a saved cache from the disk
+ * a missing cache is empty, a damaged one is ignored with a warning
+ */
+int mii_bincache_load(mii_bincache* p, const char* path) {
+    mii_bincache_header header;
+    FILE* f = fopen(path, "rb");
+
+    if (!f) {
+        if (errno == ENOENT) return 0;
+
+        mii_warn("Couldn't open %s for reading: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&header, sizeof header, 1, f) != 1
+            || memcmp(header.magic, MII_BINCACHE_MAGIC_BYTES, sizeof header.magic)
+            || header.version != MII_BINCACHE_VERSION
+            || header.byte_order != MII_BINCACHE_BYTE_ORDER
+            || header.body_size > SIZE_MAX) {
+        mii_warn("Ignoring the bin directory cache at %s: bad header", path);
+        fclose(f);
+        return -1;
+    }
+
+    char* body = malloc(header.body_size ? header.body_size : 1);
+
+    if (fread(body, 1, header.body_size, f) != header.body_size || XXH3_64bits(body, header.body_size) != header.checksum) {
+        mii_warn("Ignoring the bin directory cache at %s: bad checksum", path);
+        free(body);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+
+    int res = _mii_bincache_parse(p, path, body, header.body_size, header.num_dirs);
+
+    free(body);
+
+    mii_debug("Loaded %d cached bin directories from %s", p->num_dirs, path);
+    return res;
+}
+
+/*
+ * save the settled directories to the disk, if anything changed
+ * the cache is replaced atomically. it isn't synced, losing it only costs a rescan
+ */
+int mii_bincache_save(mii_bincache* p, const char* path, int prune) {
+    mii_bincache_header header;
+    char* body = NULL;
+    size_t body_size = 0, max_body_size = 0;
+
+    memset(&header, 0, sizeof header);
+
+    for (int i = 0; i < MII_BINCACHE_HASHTABLE_WIDTH; ++i) {
+        for (mii_bincache_dir* cur = p->buf[i]; cur; cur = cur->next) {
+            if (!cur->settled) continue;
+
+            if (prune && !cur->used) {
+                p->dirty = 1;
+                continue;
+            }
+
+            mii_bincache_record rec;
+            memset(&rec, 0, sizeof rec);
+
+            rec.mtime = cur->mtime;
+            rec.path_size = strlen(cur->path) + 1;
+            rec.num_bins = cur->num_bins;
+
+            for (int j = 0; j < cur->num_bins; ++j) {
+                rec.bins_size += strlen(cur->bins[j]) + 1;
+            }
+
+            size_t size = sizeof rec + rec.path_size + rec.bins_size;
+
+            if (body_size + size > max_body_size) {
+                max_body_size = (body_size + size) * 2;
+                body = realloc(body, max_body_size);
+            }
+
+            memcpy(body + body_size, &rec, sizeof rec);
+            body_size += sizeof rec;
+
+            memcpy(body + body_size, cur->path, rec.path_size);
+            body_size += rec.path_size;
+
+            for (int j = 0; j < cur->num_bins; ++j) {
+                size_t len = strlen(cur->bins[j]) + 1;
+
+                memcpy(body + body_size, cur->bins[j], len);
+                body_size += len;
+            }
+
+            ++header.num_dirs;
+        }
+    }
+
+    if (!p->dirty) {
+        free(body);
+        return 0;
+    }
+
+    memcpy(header.magic, MII_BINCACHE_MAGIC_BYTES, sizeof header.magic);
+    header.version    = MII_BINCACHE_VERSION;
+    header.byte_order = MII_BINCACHE_BYTE_ORDER;
+    header.body_size  = body_size;
+    header.checksum   = XXH3_64bits(body, body_size);
+
+    /* write next to the cache so the rename stays on one filesystem */
+    char* tmp_path = malloc(strlen(path) + 8);
+    sprintf(tmp_path, "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp_path);
+    FILE* f = (fd < 0) ? NULL : fdopen(fd, "wb");
+
+    if (!f) {
+        mii_warn("Couldn't open %s for writing: %s", tmp_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        free(body);
+        return -1;
+    }
+
+    /* mkstemp creates the file private, the cache is shared like the index */
+    fchmod(fd, 0644);
+
+    int res = (fwrite(&header, sizeof header, 1, f) != 1)
+            | (body_size && fwrite(body, 1, body_size, f) != body_size);
+
+    free(body);
+
+    if (fclose(f) || res || rename(tmp_path, path)) {
+        mii_warn("Couldn't write %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    mii_debug("Saved %u bin directories to %s", header.num_dirs, path);
+
+    free(tmp_path);
+    p->dirty = 0;
+
+    return 0;
+}
+
+/*
+ * append the cached commands of a directory to a list
+ * returns nonzero if the directory isn't cached at this mtime
+ */
+int mii_bincache_lookup(mii_bincache* p, const char* path, int64_t mtime, char*** bins_out, int* num_bins_out) {
+    pthread_mutex_lock(&p->lock);
+
+    mii_bincache_dir* dir = _mii_bincache_locate(p, path);
+
+    if (!dir || dir->mtime != mtime || (p->rescan && !dir->fresh)) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+
+    dir->used = 1;
+
+    if (dir->num_bins) {
+        *bins_out = realloc(*bins_out, (*num_bins_out + dir->num_bins) * sizeof **bins_out);
+
+        for (int i = 0; i < dir->num_bins; ++i) {
+            (*bins_out)[*num_bins_out + i] = mii_strdup(dir->bins[i]);
+        }
+
+        *num_bins_out += dir->num_bins;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/*
+ * cache the commands of a directory, copying them
+ */
+void mii_bincache_store(mii_bincache* p, const char* path, int64_t mtime, char** bins, int num_bins) {
+    char** copy = num_bins ? malloc(num_bins * sizeof *copy) : NULL;
+
+    for (int i = 0; i < num_bins; ++i) {
+        copy[i] = mii_strdup(bins[i]);
+    }
+
+    /* a listing taken in the same second as a change might have missed it */
+    int settled = mtime / 1000000000 < p->load_time - 1;
+
+    pthread_mutex_lock(&p->lock);
+    mii_bincache_dir* dir = _mii_bincache_insert(p, mii_strdup(path), mtime, settled, copy, num_bins);
+    dir->used = 1;
+    dir->fresh = 1;
+    p->dirty = 1;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * drop a cached directory
+ */
+void mii_bincache_forget(mii_bincache* p, const char* path) {
+    pthread_mutex_lock(&p->lock);
+
+    for (mii_bincache_dir** cur = p->buf + _mii_bincache_get_target_index(path); *cur; cur = &(*cur)->next) {
+        if (!strcmp((*cur)->path, path)) {
+            mii_bincache_dir* dir = *cur;
+            *cur = dir->next;
+
+            _mii_bincache_dir_free(dir);
+
+            --p->num_dirs;
+            p->dirty = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * read the records of a loaded cache
+ */
+int _mii_bincache_parse(mii_bincache* p, const char* path, const char* body, size_t size, uint32_t num_dirs) {
+    size_t pos = 0;
+
+    for (uint32_t i = 0; i < num_dirs; ++i) {
+        mii_bincache_record rec;
+
+        if (size - pos < sizeof rec) break;
+
+        memcpy(&rec, body + pos, sizeof rec);
+        pos += sizeof rec;
+
+        /* the strings must fit and be terminated */
+        if (!rec.path_size || rec.path_size > size - pos || rec.bins_size > size - pos - rec.path_size
+                || body[pos + rec.path_size - 1] || (rec.bins_size && body[pos + rec.path_size + rec.bins_size - 1])) {
+            break;
+        }
+
+        const char* dir_path = body + pos;
+        const char* cur = dir_path + rec.path_size, *end = cur + rec.bins_size;
+
+        pos += rec.path_size + rec.bins_size;
+
+        char** bins = rec.num_bins ? malloc(rec.num_bins * sizeof *bins) : NULL;
+        uint32_t num_bins = 0;
+
+        for (; num_bins < rec.num_bins && cur < end; cur += strlen(cur) + 1) {
+            bins[num_bins++] = mii_strdup(cur);
+        }
+
+        _mii_bincache_insert(p, mii_strdup(dir_path), rec.mtime, 1, bins, num_bins);
+    }
+
+    if (pos != size || p->num_dirs != (int) num_dirs) {
+        mii_warn("Bin directory cache at %s is damaged, some directories will be rescanned", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * insert a directory, taking ownership of the path and commands
+ */
+mii_bincache_dir* _mii_bincache_insert(mii_bincache* p, char* path, int64_t mtime, int settled, char** bins, int num_bins) {
+    mii_bincache_dir* dir = _mii_bincache_locate(p, path);
+
+    if (dir) {
+        /* replace the stale listing */
+        free(path);
+
+        for (int i = 0; i < dir->num_bins; ++i) {
+            free(dir->bins[i]);
+        }
+
+        free(dir->bins);
+    } else {
+        int target_index = _mii_bincache_get_target_index(path);
+
+        dir = malloc(sizeof *dir);
+        dir->path = path;
+        dir->next = p->buf[target_index];
+        p->buf[target_index] = dir;
+
+        ++p->num_dirs;
+    }
+
+    dir->mtime = mtime;
+    dir->settled = settled;
+    dir->used = 0;
+    dir->fresh = 0;
+    dir->bins = bins;
+    dir->num_bins = num_bins;
+
+    return dir;
+}
+
+/*
+ * compute the hash index for a path, modulo the hash table width
+ */
+int _mii_bincache_get_target_index(const char* path) {
+    return XXH32(path, strlen(path), 0) % MII_BINCACHE_HASHTABLE_WIDTH;
+}
+
+/*
+ * locate a cached directory, returns NULL if not found
+ */
+mii_bincache_dir* _mii_bincache_locate(mii_bincache* p, const char* path) {
+    for (mii_bincache_dir* cur = p->buf[_mii_bincache_get_target_index(path)]; cur; cur = cur->next) {
+        if (!strcmp(cur->path, path)) return cur;
+    }
+
+    return NULL;
+}
+
+/*
+ * free a cached directory and its commands
+ */
+void _mii_bincache_dir_free(mii_bincache_dir* d) {
+    for (int i = 0; i < d->num_bins; ++i) {
+        free(d->bins[i]);
+    }
+
+    free(d->bins);
+    free(d->path);
+    free(d);
+}
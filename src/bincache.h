@@ -0,0 +1,81 @@
+#pragma once
+
+/*
+ * mii_bincache
+ *
+ * cache of scanned bin directories
+ *
+ * many modules point at the same bin directories, so the commands found in each
+ * directory are kept by path along with the directory's mtime. a directory is only
+ * listed again once its mtime changes, which happens whenever an entry is added,
+ * removed or renamed.
+ *
+ * the cache is saved next to the index (<index>.bins) as a header followed by one
+ * record per directory:
+ *
+ *     header             (magic, version, byte order, number of records, body size, checksum)
+ *     records            (mtime, path length, number of commands, commands size,
+ *                         then the path and each command as null-terminated strings)
+ *
+ * directories modified within a second of being listed might change again without
+ * a new mtime, so they are only cached for the current run.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/* modulo for the hashtable, preferably a power of 2 */
+#define MII_BINCACHE_HASHTABLE_WIDTH 1024
+
+#define MII_BINCACHE_VERSION 1
+
+typedef struct _mii_bincache_header {
+    unsigned char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+    uint32_t num_dirs, reserved;
+    uint64_t body_size;
+    uint64_t checksum; /* XXH3 of the body */
+} mii_bincache_header;
+
+typedef struct _mii_bincache_record {
+    int64_t mtime; /* nanoseconds */
+    uint32_t path_size, num_bins, bins_size; /* sizes include the terminators */
+    uint32_t reserved;
+} mii_bincache_record;
+
+typedef struct _mii_bincache_dir {
+    char* path;
+    int64_t mtime;
+    int settled; /* truthy if the listing can be trusted in later runs */
+    int used; /* truthy if looked up or stored during this run */
+    int fresh; /* truthy if listed during this run rather than loaded */
+    char** bins;
+    int num_bins;
+    struct _mii_bincache_dir* next;
+} mii_bincache_dir;
+
+typedef struct _mii_bincache {
+    mii_bincache_dir* buf[MII_BINCACHE_HASHTABLE_WIDTH];
+    int num_dirs, dirty;
+    int rescan; /* truthy if lookups ignore loaded listings, so every directory is listed again once */
+    time_t load_time;
+    pthread_mutex_t lock; /* lookups and stores come from analysis workers */
+} mii_bincache;
+
+void mii_bincache_init(mii_bincache* p);
+void mii_bincache_free(mii_bincache* p);
+
+int mii_bincache_load(mii_bincache* p, const char* path); /* a missing cache is not an error */
+int mii_bincache_save(mii_bincache* p, const char* path, int prune); /* prune drops directories unused this run */
+
+/* append the commands of a directory to a list if its listing is cached at this mtime, nonzero otherwise.
+ * with rescan set, only listings stored during this run are returned */
+int mii_bincache_lookup(mii_bincache* p, const char* path, int64_t mtime, char*** bins_out, int* num_bins_out);
+
+/* cache the listing of a directory, replacing any older one */
+void mii_bincache_store(mii_bincache* p, const char* path, int64_t mtime, char** bins, int num_bins);
+
+/* drop the listing of a directory, for changes which leave its mtime alone */
+void mii_bincache_forget(mii_bincache* p, const char* path);
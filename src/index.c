@@ -0,0 +1,1455 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "index.h"
+#include "util.h"
+#include "log.h"
+
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash/xxhash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* identify the mii_index file format */
+static const unsigned char MII_INDEX_MAGIC_BYTES[] = { 0xBE, 0xE5, 0x1D, 0x58 };
+static const unsigned char MII_INDEX_JOURNAL_MAGIC_BYTES[] = { 0xBE, 0xE5, 0x1D, 0x4A };
+
+uint32_t _mii_index_writer_string(mii_index_writer* w, const char* str);
+uint32_t _mii_index_writer_refs(mii_index_writer* w, char** strs, int num);
+uint32_t _mii_index_writer_find_string(mii_index_writer* w, const char* str, uint32_t hash);
+uint32_t _mii_index_writer_find_list(mii_index_writer* w, const uint32_t* refs, uint32_t num, uint32_t hash);
+void _mii_index_writer_grow_strings(mii_index_writer* w);
+void _mii_index_writer_grow_lists(mii_index_writer* w);
+uint32_t _mii_index_writer_commands(mii_index_writer* w, mii_index_command** commands_out, uint32_t** providers_out, uint32_t* num_providers_out);
+unsigned char* _mii_index_writer_encode_strings(mii_index_writer* w, uint32_t** ids_out, uint32_t** blocks_out, uint32_t* num_blocks_out, uint32_t* size_out);
+uint32_t _mii_index_writer_string_id(mii_index_writer* w, const uint32_t* ids, uint32_t offset);
+uint32_t _mii_index_writer_bktree(mii_index_writer* w, const mii_index_command* commands, uint32_t num_commands, mii_index_bknode** nodes_out);
+int _mii_index_compare_strings(const void* a, const void* b);
+
+const unsigned char* _mii_index_block(const mii_index* p, uint32_t first);
+const unsigned char* _mii_index_next_string(const mii_index* p, const unsigned char* pos, int first, char* buf, uint32_t* len);
+
+uint32_t _mii_index_command_hash(const char* cmd);
+
+void _mii_index_journal_record(mii_index_journal* j, int type, const void* fixed, size_t fixed_size, const char** strs, int num_strs);
+int _mii_index_journal_create(mii_index_journal* j, const char* journal_path, uint64_t generation);
+int _mii_index_journal_walk(int fd, uint64_t generation, mii_index_journal_handler handler, mii_index_journal_dir_handler dir_handler, void* data, off_t* end_out);
+int _mii_index_write_all(int fd, const void* data, size_t size);
+const void* _mii_index_section(mii_index* p, const char* path, uint32_t id, size_t record_size, uint32_t* count_out, uint32_t* size_out);
+int _mii_index_has_section(mii_index* p, uint32_t id);
+
+/*
+ * map an index file into memory
+ * table sizes are checked against the file size, nothing else is read
+ */
+int mii_index_open(mii_index* p, const char* path) {
+    struct stat st;
+    int fd;
+
+    memset(p, 0, sizeof *p);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        mii_error("Couldn't open %s for reading: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        mii_error("Couldn't stat %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size < sizeof(mii_index_header)) {
+        mii_error("Couldn't parse from %s: file too small", path);
+        close(fd);
+        return -1;
+    }
+
+    p->size = st.st_size;
+    p->base = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    /* the mapping stays valid after the descriptor is closed */
+    close(fd);
+
+    if (p->base == MAP_FAILED) {
+        mii_error("Couldn't map %s: %s", path, strerror(errno));
+        p->base = NULL;
+        return -1;
+    }
+
+    p->header = (const mii_index_header*) p->base;
+
+    if (memcmp(p->header->magic, MII_INDEX_MAGIC_BYTES, sizeof MII_INDEX_MAGIC_BYTES)) {
+        mii_error("Couldn't parse from %s: bad magic sequence", path);
+        mii_index_close(p);
+        return -1;
+    }
+
+    if (p->header->byte_order != MII_INDEX_BYTE_ORDER) {
+        mii_error("Couldn't parse from %s: index was written on a host with a different byte order", path);
+        mii_index_close(p);
+        return -1;
+    }
+
+    if (p->header->version != MII_INDEX_VERSION) {
+        mii_error("Couldn't parse from %s: unsupported index version %u (expected %u)", path, p->header->version, MII_INDEX_VERSION);
+        mii_index_close(p);
+        return -1;
+    }
+
+    /* a truncated or partially written file is caught here without reading it */
+    if (p->header->file_size != p->size) {
+        mii_error("Couldn't parse from %s: expected %llu bytes, found %zu", path, (unsigned long long) p->header->file_size, p->size);
+        mii_index_close(p);
+        return -1;
+    }
+
+    /* older headers lack the generation */
+    if (p->header->header_size < sizeof *p->header || (uint64_t) p->header->header_size + (uint64_t) p->header->num_sections * sizeof(mii_index_section) > p->size) {
+        mii_error("Couldn't parse from %s: bad section directory", path);
+        mii_index_close(p);
+        return -1;
+    }
+
+    /* look up the sections we need */
+    p->modules       = _mii_index_section(p, path, MII_INDEX_SECTION_MODULES, sizeof *p->modules, &p->num_modules, NULL);
+    p->refs          = _mii_index_section(p, path, MII_INDEX_SECTION_REFS, sizeof *p->refs, &p->num_refs, NULL);
+    p->commands      = _mii_index_section(p, path, MII_INDEX_SECTION_COMMANDS, sizeof *p->commands, &p->num_commands, NULL);
+    p->providers     = _mii_index_section(p, path, MII_INDEX_SECTION_PROVIDERS, sizeof *p->providers, &p->num_providers, NULL);
+    p->strings       = _mii_index_section(p, path, MII_INDEX_SECTION_STRINGS, 0, &p->num_strings, &p->strings_size);
+    p->string_blocks = _mii_index_section(p, path, MII_INDEX_SECTION_STRING_BLOCKS, sizeof *p->string_blocks, &p->num_string_blocks, NULL);
+    p->bin_dirs      = _mii_index_section(p, path, MII_INDEX_SECTION_BIN_DIRS, sizeof *p->bin_dirs, &p->num_bin_dirs, NULL);
+
+    if (!p->modules || !p->refs || !p->commands || !p->providers || !p->strings || !p->string_blocks || !p->bin_dirs) {
+        mii_index_close(p);
+        return -1;
+    }
+
+    /* syncs crawl every directory without the dirs section */
+    if (_mii_index_has_section(p, MII_INDEX_SECTION_DIRS)) {
+        if (!(p->dirs = _mii_index_section(p, path, MII_INDEX_SECTION_DIRS, sizeof *p->dirs, &p->num_dirs, NULL))) {
+            mii_index_close(p);
+            return -1;
+        }
+    }
+
+    /* fuzzy searches fall back to a scan without the bk-tree */
+    if (_mii_index_has_section(p, MII_INDEX_SECTION_BKTREE)) {
+        if (!(p->bktree = _mii_index_section(p, path, MII_INDEX_SECTION_BKTREE, sizeof *p->bktree, &p->num_bknodes, NULL))) {
+            mii_index_close(p);
+            return -1;
+        }
+    }
+
+    if (p->num_string_blocks != (p->num_strings + MII_INDEX_STRING_BLOCK - 1) / MII_INDEX_STRING_BLOCK) {
+        mii_error("Couldn't parse from %s: %u string blocks for %u strings", path, p->num_string_blocks, p->num_strings);
+        mii_index_close(p);
+        return -1;
+    }
+
+    /* probing relies on the slot count being a power of 2 */
+    if (!p->num_commands || (p->num_commands & (p->num_commands - 1))) {
+        mii_error("Couldn't parse from %s: bad command table width %u", path, p->num_commands);
+        mii_index_close(p);
+        return -1;
+    }
+
+    /* the blob must be terminated so that no string runs off the end of it */
+    if (p->strings_size && p->strings[p->strings_size - 1]) {
+        mii_error("Couldn't parse from %s: unterminated string table", path);
+        mii_index_close(p);
+        return -1;
+    }
+
+    mii_debug("Mapped index %s: %u modules, %u refs, %u strings in %u bytes", path, p->num_modules, p->num_refs, p->num_strings, p->strings_size);
+
+    return 0;
+}
+
+/*
+ * check the index contents against the header checksum
+ * this reads the whole file, so it is left to callers which read all of it anyway
+ */
+int mii_index_verify(const mii_index* p) {
+    XXH64_hash_t checksum = XXH3_64bits(p->base + p->header->header_size, p->size - p->header->header_size);
+
+    if (checksum != p->header->checksum) {
+        mii_error("Index checksum mismatch, the index is corrupt");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * read the header of an index without mapping it
+ * used to check the generation on disk against a mapped one
+ */
+int mii_index_read_header(const char* path, mii_index_header* out) {
+    FILE* f = fopen(path, "rb");
+
+    if (!f) return -1;
+
+    int res = (fread(out, sizeof *out, 1, f) != 1)
+           || memcmp(out->magic, MII_INDEX_MAGIC_BYTES, sizeof MII_INDEX_MAGIC_BYTES)
+           || out->byte_order != MII_INDEX_BYTE_ORDER
+           || out->header_size < sizeof *out;
+
+    fclose(f);
+    return res ? -1 : 0;
+}
+
+/*
+ * unmap an index
+ */
+void mii_index_close(mii_index* p) {
+    if (p->base) munmap(p->base, p->size);
+
+    free(p->decoded_blob);
+    free(p->decoded);
+
+    memset(p, 0, sizeof *p);
+}
+
+/*
+ * decode a string by id
+ * walks from the start of the string's block, out-of-range ids from a damaged index resolve to the empty string
+ */
+const char* mii_index_string(const mii_index* p, uint32_t id, char* buf) {
+    if (id >= p->num_strings) return "";
+    if (p->decoded) return p->decoded[id];
+
+    uint32_t first = id - id % MII_INDEX_STRING_BLOCK, len = 0;
+    const unsigned char* pos = _mii_index_block(p, first);
+
+    for (uint32_t i = first; i <= id; ++i) {
+        if (!(pos = _mii_index_next_string(p, pos, i == first, buf, &len))) return "";
+    }
+
+    return buf;
+}
+
+/*
+ * decode every string at once
+ * used before reading the whole index, where walking a block for each string would repeat work
+ */
+int mii_index_decode_strings(mii_index* p) {
+    if (p->decoded) return 0;
+
+    char buf[MII_INDEX_STRING_MAX];
+    const unsigned char* pos = NULL;
+    uint32_t len = 0;
+
+    /* decoded strings are usually a few times larger than the section */
+    size_t size = 0, max_size = 4 * (size_t) p->strings_size + 1;
+    size_t* offsets = malloc((p->num_strings ? p->num_strings : 1) * sizeof *offsets);
+
+    p->decoded_blob = malloc(max_size);
+
+    for (uint32_t i = 0; i < p->num_strings; ++i) {
+        int first = !(i % MII_INDEX_STRING_BLOCK);
+
+        if (first) pos = _mii_index_block(p, i);
+        if (pos) pos = _mii_index_next_string(p, pos, first, buf, &len);
+
+        /* the rest of a damaged block decodes to empty strings */
+        if (!pos) len = *buf = 0;
+
+        while (size + len + 1 > max_size) {
+            max_size *= 2;
+            p->decoded_blob = realloc(p->decoded_blob, max_size);
+        }
+
+        memcpy(p->decoded_blob + size, buf, len + 1);
+        offsets[i] = size;
+        size += len + 1;
+    }
+
+    /* the blob is complete, so the offsets can become pointers */
+    p->decoded = malloc((p->num_strings ? p->num_strings : 1) * sizeof *p->decoded);
+
+    for (uint32_t i = 0; i < p->num_strings; ++i) {
+        p->decoded[i] = p->decoded_blob + offsets[i];
+    }
+
+    free(offsets);
+    return 0;
+}
+
+/*
+ * look up a command in the command table
+ * a single hashed probe, independent of the number of modules or bins
+ */
+int mii_index_find_command(const mii_index* p, const char* cmd, const uint32_t** providers_out, uint32_t* num_providers_out) {
+    uint32_t mask = p->num_commands - 1;
+    char name[MII_INDEX_STRING_MAX];
+
+    /* the table is never full, so an empty slot ends the probe. a damaged table might have none,
+     * and the exact lookup doesn't verify the checksum, so the probe also stops after every slot */
+    uint32_t i = _mii_index_command_hash(cmd) & mask;
+
+    for (uint32_t probes = 0; probes < p->num_commands; ++probes, i = (i + 1) & mask) {
+        const mii_index_command* slot = p->commands + i;
+
+        if (slot->name == MII_INDEX_EMPTY_SLOT) return -1;
+        if (strcmp(mii_index_string(p, slot->name, name), cmd)) continue;
+
+        if ((uint64_t) slot->providers + slot->num_providers > p->num_providers) {
+            mii_error("Command table entry for %s is out of range, ignoring", cmd);
+            return -1;
+        }
+
+        *providers_out = p->providers + slot->providers;
+        *num_providers_out = slot->num_providers;
+
+        return 0;
+    }
+
+    mii_error("Index command table is damaged, stopping the lookup of %s", cmd);
+    return -1;
+}
+
+/*
+ * search the bk-tree for command names close to a query
+ * the tree is pruned with the damerau-levenshtein metric, which never exceeds the
+ * optimal string alignment distance. matches are reported with the latter, so results
+ * are the same as comparing the query against every name
+ */
+int mii_index_find_similar(const mii_index* p, const char* cmd, int max_distance, mii_index_similar_handler handler, void* data) {
+    if (!p->bktree) return -1;
+    if (!p->num_bknodes) return 0;
+
+    char name_buf[MII_INDEX_STRING_MAX];
+    uint32_t visited = 0;
+
+    /* each node is pushed at most once */
+    uint32_t* stack = malloc(p->num_bknodes * sizeof *stack);
+    uint32_t top = 0;
+
+    stack[top++] = 0;
+
+    while (top) {
+        const mii_index_bknode* node = p->bktree + stack[--top];
+
+        /* a damaged tree could otherwise loop or overflow the stack */
+        if (++visited > p->num_bknodes || node->command >= p->num_commands || (uint64_t) node->children + node->num_children > p->num_bknodes) {
+            mii_error("Index bk-tree is damaged, stopping fuzzy search");
+            break;
+        }
+
+        const mii_index_command* slot = p->commands + node->command;
+        const char* name = mii_index_string(p, slot->name, name_buf);
+        int dist = mii_damerau_distance(cmd, name);
+
+        if (dist <= max_distance) {
+            int osa_dist = mii_levenshtein_distance(cmd, name);
+
+            if (osa_dist <= max_distance && (uint64_t) slot->providers + slot->num_providers <= p->num_providers) {
+                handler(data, name, osa_dist, p->providers + slot->providers, slot->num_providers);
+            }
+        }
+
+        /* by the triangle inequality, only children labelled within max_distance of dist can match */
+        for (uint32_t i = 0; i < node->num_children; ++i) {
+            int label = p->bktree[node->children + i].distance;
+
+            if (label >= dist - max_distance && label <= dist + max_distance) {
+                if (top == p->num_bknodes) break;
+                stack[top++] = node->children + i;
+            }
+        }
+    }
+
+    mii_debug("Fuzzy search for %s visited %u of %u names", cmd, visited, p->num_bknodes);
+
+    free(stack);
+    return 0;
+}
+
+void mii_index_writer_init(mii_index_writer* w) {
+    memset(w, 0, sizeof *w);
+}
+
+void mii_index_writer_free(mii_index_writer* w) {
+    free(w->modules);
+    free(w->refs);
+    free(w->strings);
+    free(w->string_slots);
+    free(w->list_slots);
+    free(w->dirs);
+    free(w->bin_dirs);
+
+    memset(w, 0, sizeof *w);
+}
+
+/*
+ * append a module to the index being built
+ */
+void mii_index_writer_add(mii_index_writer* w, const char* path, const char* code, int type, char** bins, int num_bins, char** parents, int num_parents, char** bin_dirs, const int64_t* bin_dir_mtimes, int num_bin_dirs, const mii_index_fingerprint* fingerprint) {
+    mii_index_module mod;
+
+    mod.path        = _mii_index_writer_string(w, path);
+    mod.code        = _mii_index_writer_string(w, code);
+    mod.type        = type;
+    mod.num_bins    = num_bins;
+    mod.bins        = _mii_index_writer_refs(w, bins, num_bins);
+    mod.num_parents = num_parents;
+    mod.parents     = _mii_index_writer_refs(w, parents, num_parents);
+    mod.num_bin_dirs = num_bin_dirs;
+    mod.bin_dirs    = w->num_bin_dirs;
+    mod.reserved    = 0;
+    mod.fingerprint = *fingerprint;
+
+    if (w->num_modules == w->max_modules) {
+        w->max_modules = w->max_modules ? w->max_modules * 2 : 256;
+        w->modules = realloc(w->modules, w->max_modules * sizeof *w->modules);
+    }
+
+    /* the mtimes differ between modules, so bin dirs are stored per module rather than interned */
+    while (w->num_bin_dirs + num_bin_dirs > w->max_bin_dirs) {
+        w->max_bin_dirs = w->max_bin_dirs ? w->max_bin_dirs * 2 : 256;
+        w->bin_dirs = realloc(w->bin_dirs, w->max_bin_dirs * sizeof *w->bin_dirs);
+    }
+
+    for (int i = 0; i < num_bin_dirs; ++i) {
+        mii_index_dir* dir = w->bin_dirs + w->num_bin_dirs++;
+
+        dir->path     = _mii_index_writer_string(w, bin_dirs[i]);
+        dir->reserved = 0;
+        dir->mtime    = bin_dir_mtimes[i];
+    }
+
+    w->modules[w->num_modules++] = mod;
+}
+
+/*
+ * append a crawled directory to the index being built
+ */
+void mii_index_writer_add_dir(mii_index_writer* w, const char* path, int64_t mtime) {
+    mii_index_dir dir;
+
+    dir.path     = _mii_index_writer_string(w, path);
+    dir.reserved = 0;
+    dir.mtime    = mtime;
+
+    if (w->num_dirs == w->max_dirs) {
+        w->max_dirs = w->max_dirs ? w->max_dirs * 2 : 256;
+        w->dirs = realloc(w->dirs, w->max_dirs * sizeof *w->dirs);
+    }
+
+    w->dirs[w->num_dirs++] = dir;
+}
+
+/*
+ * write the built index to disk
+ */
+int mii_index_writer_save(mii_index_writer* w, const char* path) {
+    mii_index_header header;
+    mii_index_command* commands;
+    uint32_t num_commands, num_providers, num_blocks, encoded_size;
+    uint32_t* providers, *ids, *blocks;
+
+    num_commands = _mii_index_writer_commands(w, &commands, &providers, &num_providers);
+
+    mii_index_bknode* bktree;
+    uint32_t num_bknodes = _mii_index_writer_bktree(w, commands, num_commands, &bktree);
+
+    /* sort and compress the strings, then point every reference at a string id instead of a raw offset */
+    unsigned char* encoded = _mii_index_writer_encode_strings(w, &ids, &blocks, &num_blocks, &encoded_size);
+    mii_index_module* modules = malloc((w->num_modules ? w->num_modules : 1) * sizeof *modules);
+    uint32_t* refs = malloc((w->num_refs ? w->num_refs : 1) * sizeof *refs);
+
+    for (uint32_t i = 0; i < w->num_modules; ++i) {
+        modules[i] = w->modules[i];
+        modules[i].path = _mii_index_writer_string_id(w, ids, modules[i].path);
+        modules[i].code = _mii_index_writer_string_id(w, ids, modules[i].code);
+    }
+
+    for (uint32_t i = 0; i < w->num_refs; ++i) {
+        refs[i] = _mii_index_writer_string_id(w, ids, w->refs[i]);
+    }
+
+    mii_index_dir* dirs = malloc((w->num_dirs ? w->num_dirs : 1) * sizeof *dirs);
+
+    for (uint32_t i = 0; i < w->num_dirs; ++i) {
+        dirs[i] = w->dirs[i];
+        dirs[i].path = _mii_index_writer_string_id(w, ids, dirs[i].path);
+    }
+
+    mii_index_dir* bin_dirs = malloc((w->num_bin_dirs ? w->num_bin_dirs : 1) * sizeof *bin_dirs);
+
+    for (uint32_t i = 0; i < w->num_bin_dirs; ++i) {
+        bin_dirs[i] = w->bin_dirs[i];
+        bin_dirs[i].path = _mii_index_writer_string_id(w, ids, bin_dirs[i].path);
+    }
+
+    for (uint32_t i = 0; i < num_commands; ++i) {
+        if (commands[i].name != MII_INDEX_EMPTY_SLOT) commands[i].name = _mii_index_writer_string_id(w, ids, commands[i].name);
+    }
+
+    free(ids);
+
+    /* section contents, in file order */
+    struct {
+        uint32_t id, count;
+        const void* data;
+        size_t size;
+    } sections[] = {
+        { MII_INDEX_SECTION_MODULES,       w->num_modules, modules,   w->num_modules * sizeof *modules },
+        { MII_INDEX_SECTION_REFS,          w->num_refs,    refs,      w->num_refs * sizeof *refs },
+        { MII_INDEX_SECTION_COMMANDS,      num_commands,   commands,  num_commands * sizeof *commands },
+        { MII_INDEX_SECTION_PROVIDERS,     num_providers,  providers, num_providers * sizeof *providers },
+        { MII_INDEX_SECTION_STRINGS,       w->num_strings, encoded,   encoded_size },
+        { MII_INDEX_SECTION_STRING_BLOCKS, num_blocks,     blocks,    num_blocks * sizeof *blocks },
+        { MII_INDEX_SECTION_BKTREE,        num_bknodes,    bktree,    num_bknodes * sizeof *bktree },
+        { MII_INDEX_SECTION_DIRS,          w->num_dirs,    dirs,      w->num_dirs * sizeof *dirs },
+        { MII_INDEX_SECTION_BIN_DIRS,      w->num_bin_dirs, bin_dirs, w->num_bin_dirs * sizeof *bin_dirs },
+    };
+
+    const int num_sections = sizeof sections / sizeof *sections;
+
+    /* lay out the directory, every section starts 8-byte aligned */
+    mii_index_section directory[num_sections];
+    uint64_t offset = sizeof header + sizeof directory;
+
+    for (int i = 0; i < num_sections; ++i) {
+        offset = (offset + 7) & ~(uint64_t) 7;
+
+        directory[i].id     = sections[i].id;
+        directory[i].count  = sections[i].count;
+        directory[i].offset = offset;
+        directory[i].size   = sections[i].size;
+
+        offset += sections[i].size;
+    }
+
+    /* assemble everything after the header, padding included.
+     * the checksum is taken over the whole body at once, the vendored XXH3 streaming
+     * interface doesn't match the one-shot hash readers compute for every input */
+    size_t body_size = offset - sizeof header;
+    unsigned char* body = calloc(1, body_size);
+
+    memcpy(body, directory, sizeof directory);
+
+    for (int i = 0; i < num_sections; ++i) {
+        if (sections[i].size) memcpy(body + directory[i].offset - sizeof header, sections[i].data, sections[i].size);
+    }
+
+    free(commands);
+    free(providers);
+    free(modules);
+    free(refs);
+    free(encoded);
+    free(blocks);
+    free(bktree);
+    free(dirs);
+    free(bin_dirs);
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, MII_INDEX_MAGIC_BYTES, sizeof header.magic);
+    header.version      = MII_INDEX_VERSION;
+    header.byte_order   = MII_INDEX_BYTE_ORDER;
+    header.header_size  = sizeof header;
+    header.num_sections = num_sections;
+    header.file_size    = offset;
+    header.checksum     = XXH3_64bits(body, body_size);
+
+    /* follow on from the generation currently on disk */
+    mii_index_header old_header;
+    header.generation = mii_index_read_header(path, &old_header) ? 1 : old_header.generation + 1;
+
+    /* write next to the index so the final rename stays on one filesystem */
+    char* tmp_path = malloc(strlen(path) + 8);
+    sprintf(tmp_path, "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp_path);
+    FILE* f = (fd < 0) ? NULL : fdopen(fd, "wb");
+
+    if (!f) {
+        mii_error("Couldn't open %s for writing: %s", tmp_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        free(body);
+        return -1;
+    }
+
+    /* mkstemp creates the file private, the index is shared */
+    fchmod(fd, 0644);
+
+    mii_debug("Exporting %u modules to %s, generation %llu", w->num_modules, path, (unsigned long long) header.generation);
+
+    int res = (fwrite(&header, sizeof header, 1, f) != 1)
+            | (fwrite(body, 1, body_size, f) != body_size);
+
+    free(body);
+
+    /* the data must be on disk before the rename can publish it */
+    res |= fflush(f) || fsync(fd);
+
+    if (fclose(f) || res) {
+        mii_error("Couldn't write %s: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, path)) {
+        mii_error("Couldn't replace %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    free(tmp_path);
+
+    /* make the rename itself durable */
+    char* dir_path = mii_strdup(path);
+    int dir_fd = open(dirname(dir_path), O_RDONLY);
+
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    free(dir_path);
+    return 0;
+}
+
+/*
+ * intern a string and return its offset in the blob
+ */
+uint32_t _mii_index_writer_string(mii_index_writer* w, const char* str) {
+    char truncated[MII_INDEX_STRING_MAX];
+
+    /* readers decode into fixed buffers */
+    if (strlen(str) >= MII_INDEX_STRING_MAX) {
+        mii_warn("Truncating overlong string in the index: %.64s..", str);
+
+        memcpy(truncated, str, MII_INDEX_STRING_MAX - 1);
+        truncated[MII_INDEX_STRING_MAX - 1] = 0;
+        str = truncated;
+    }
+
+    uint32_t len = strlen(str) + 1, offset = w->strings_size;
+    uint32_t hash = XXH32(str, len - 1, 0);
+    uint32_t slot = _mii_index_writer_find_string(w, str, hash);
+
+    if (w->string_slots[slot] != MII_INDEX_EMPTY_SLOT) return w->string_slots[slot];
+
+    /* new string, append it to the blob */
+    while (w->strings_size + len > w->max_strings) {
+        w->max_strings = w->max_strings ? w->max_strings * 2 : 4096;
+        w->strings = realloc(w->strings, w->max_strings);
+    }
+
+    memcpy(w->strings + offset, str, len);
+    w->strings_size += len;
+
+    w->string_slots[slot] = offset;
+
+    if (2 * ++w->num_strings >= w->max_string_slots) _mii_index_writer_grow_strings(w);
+
+    return offset;
+}
+
+/*
+ * intern a list of strings in the reference table and return the first index
+ */
+uint32_t _mii_index_writer_refs(mii_index_writer* w, char** strs, int num) {
+    uint32_t first = w->num_refs;
+
+    if (!num) return 0;
+
+    while (w->num_refs + num > w->max_refs) {
+        w->max_refs = w->max_refs ? w->max_refs * 2 : 1024;
+        w->refs = realloc(w->refs, w->max_refs * sizeof *w->refs);
+    }
+
+    /* append the list tentatively, then drop it again if it is already present */
+    for (int i = 0; i < num; ++i) {
+        w->refs[first + i] = _mii_index_writer_string(w, strs[i]);
+    }
+
+    uint32_t hash = XXH32(w->refs + first, num * sizeof *w->refs, 0);
+    uint32_t slot = _mii_index_writer_find_list(w, w->refs + first, num, hash);
+
+    if (w->list_slots[2 * slot] != MII_INDEX_EMPTY_SLOT) return w->list_slots[2 * slot];
+
+    w->num_refs += num;
+    w->list_slots[2 * slot] = first;
+    w->list_slots[2 * slot + 1] = num;
+
+    if (2 * ++w->num_lists >= w->max_list_slots) _mii_index_writer_grow_lists(w);
+
+    return first;
+}
+
+/*
+ * locate the interning slot for a string, either holding it or empty
+ */
+uint32_t _mii_index_writer_find_string(mii_index_writer* w, const char* str, uint32_t hash) {
+    if (!w->max_string_slots) _mii_index_writer_grow_strings(w);
+
+    uint32_t mask = w->max_string_slots - 1, slot = hash & mask;
+
+    while (w->string_slots[slot] != MII_INDEX_EMPTY_SLOT && strcmp(w->strings + w->string_slots[slot], str)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/*
+ * locate the interning slot for a reference list, either holding it or empty
+ */
+uint32_t _mii_index_writer_find_list(mii_index_writer* w, const uint32_t* refs, uint32_t num, uint32_t hash) {
+    if (!w->max_list_slots) _mii_index_writer_grow_lists(w);
+
+    uint32_t mask = w->max_list_slots - 1, slot = hash & mask;
+
+    while (w->list_slots[2 * slot] != MII_INDEX_EMPTY_SLOT) {
+        uint32_t cur_first = w->list_slots[2 * slot], cur_num = w->list_slots[2 * slot + 1];
+
+        if (cur_num == num && !memcmp(w->refs + cur_first, refs, num * sizeof *refs)) break;
+
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/*
+ * double the string interning table and reinsert every string
+ */
+void _mii_index_writer_grow_strings(mii_index_writer* w) {
+    uint32_t* old_slots = w->string_slots, old_max = w->max_string_slots;
+
+    w->max_string_slots = old_max ? old_max * 2 : 1024;
+    w->string_slots = malloc(w->max_string_slots * sizeof *w->string_slots);
+
+    for (uint32_t i = 0; i < w->max_string_slots; ++i) w->string_slots[i] = MII_INDEX_EMPTY_SLOT;
+
+    for (uint32_t i = 0; i < old_max; ++i) {
+        if (old_slots[i] == MII_INDEX_EMPTY_SLOT) continue;
+
+        const char* str = w->strings + old_slots[i];
+        w->string_slots[_mii_index_writer_find_string(w, str, XXH32(str, strlen(str), 0))] = old_slots[i];
+    }
+
+    free(old_slots);
+}
+
+/*
+ * double the list interning table and reinsert every list
+ */
+void _mii_index_writer_grow_lists(mii_index_writer* w) {
+    uint32_t* old_slots = w->list_slots, old_max = w->max_list_slots;
+
+    w->max_list_slots = old_max ? old_max * 2 : 1024;
+    w->list_slots = malloc(2 * w->max_list_slots * sizeof *w->list_slots);
+
+    for (uint32_t i = 0; i < w->max_list_slots; ++i) w->list_slots[2 * i] = MII_INDEX_EMPTY_SLOT;
+
+    for (uint32_t i = 0; i < old_max; ++i) {
+        uint32_t first = old_slots[2 * i], num = old_slots[2 * i + 1];
+
+        if (first == MII_INDEX_EMPTY_SLOT) continue;
+
+        uint32_t slot = _mii_index_writer_find_list(w, w->refs + first, num, XXH32(w->refs + first, num * sizeof *w->refs, 0));
+
+        w->list_slots[2 * slot] = first;
+        w->list_slots[2 * slot + 1] = num;
+    }
+
+    free(old_slots);
+}
+
+/*
+ * build the inverted command table from the module bins
+ * returns the number of slots, the provider list is grouped by slot
+ */
+uint32_t _mii_index_writer_commands(mii_index_writer* w, mii_index_command** commands_out, uint32_t** providers_out, uint32_t* num_providers_out) {
+    uint32_t num_bins = 0, num_names = 0;
+
+    for (uint32_t i = 0; i < w->num_modules; ++i) {
+        num_bins += w->modules[i].num_bins;
+    }
+
+    /* count the distinct names first, so the table written out is sized to them.
+     * names are interned, so equal names have equal offsets */
+    uint32_t num_seen = 1;
+    while (num_seen < 2 * num_bins) num_seen <<= 1;
+
+    uint32_t* seen = malloc(num_seen * sizeof *seen);
+    for (uint32_t i = 0; i < num_seen; ++i) seen[i] = MII_INDEX_EMPTY_SLOT;
+
+    for (uint32_t i = 0; i < w->num_modules; ++i) {
+        for (uint32_t j = 0; j < w->modules[i].num_bins; ++j) {
+            uint32_t name = w->refs[w->modules[i].bins + j];
+            uint32_t slot = XXH32(&name, sizeof name, 0) & (num_seen - 1);
+
+            while (seen[slot] != MII_INDEX_EMPTY_SLOT && seen[slot] != name) {
+                slot = (slot + 1) & (num_seen - 1);
+            }
+
+            if (seen[slot] == MII_INDEX_EMPTY_SLOT) {
+                seen[slot] = name;
+                ++num_names;
+            }
+        }
+    }
+
+    free(seen);
+
+    /* keep the table at most half full */
+    uint32_t num_slots = 1;
+    while (num_slots < 2 * num_names) num_slots <<= 1;
+
+    mii_index_command* commands = malloc(num_slots * sizeof *commands);
+    uint32_t mask = num_slots - 1;
+
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        commands[i].name = MII_INDEX_EMPTY_SLOT;
+        commands[i].num_providers = commands[i].providers = 0;
+    }
+
+    /* first pass: find a slot for every bin and count its providers */
+    uint32_t* bin_slots = malloc((num_bins ? num_bins : 1) * sizeof *bin_slots);
+    uint32_t cur_bin = 0;
+
+    for (uint32_t i = 0; i < w->num_modules; ++i) {
+        for (uint32_t j = 0; j < w->modules[i].num_bins; ++j) {
+            uint32_t name = w->refs[w->modules[i].bins + j];
+            uint32_t slot = _mii_index_command_hash(w->strings + name) & mask;
+
+            while (commands[slot].name != MII_INDEX_EMPTY_SLOT && commands[slot].name != name) {
+                slot = (slot + 1) & mask;
+            }
+
+            commands[slot].name = name;
+            ++commands[slot].num_providers;
+            bin_slots[cur_bin++] = slot;
+        }
+    }
+
+    /* lay out the provider ranges */
+    uint32_t next = 0;
+
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        commands[i].providers = next;
+        next += commands[i].num_providers;
+        commands[i].num_providers = 0;
+    }
+
+    /* second pass: fill in the providers in module order */
+    uint32_t* providers = malloc((num_bins ? num_bins : 1) * sizeof *providers);
+    cur_bin = 0;
+
+    for (uint32_t i = 0; i < w->num_modules; ++i) {
+        for (uint32_t j = 0; j < w->modules[i].num_bins; ++j) {
+            mii_index_command* cmd = commands + bin_slots[cur_bin++];
+            providers[cmd->providers + cmd->num_providers++] = i;
+        }
+    }
+
+    free(bin_slots);
+
+    *commands_out = commands;
+    *providers_out = providers;
+    *num_providers_out = num_bins;
+
+    return num_slots;
+}
+
+/*
+ * find the start of the block holding string first
+ * returns NULL if the block is out of range
+ */
+const unsigned char* _mii_index_block(const mii_index* p, uint32_t first) {
+    uint32_t offset = p->string_blocks[first / MII_INDEX_STRING_BLOCK];
+    return (offset < p->strings_size) ? p->strings + offset : NULL;
+}
+
+/*
+ * decode the string at pos over the previous one in buf
+ * returns the position of the next string, or NULL if the string runs off the section
+ */
+const unsigned char* _mii_index_next_string(const mii_index* p, const unsigned char* pos, int first, char* buf, uint32_t* len) {
+    const unsigned char* end = p->strings + p->strings_size;
+    uint32_t shared = 0;
+
+    if (!pos) return NULL;
+
+    /* shared prefix length, 7 bits per byte, low bits first */
+    if (!first) {
+        for (int shift = 0;; shift += 7) {
+            if (pos >= end || shift > 28) return NULL;
+
+            shared |= (uint32_t) (*pos & 0x7F) << shift;
+            if (!(*pos++ & 0x80)) break;
+        }
+    }
+
+    if (shared > *len || pos >= end) return NULL;
+
+    /* the section is null-terminated, so the suffix always ends inside it */
+    size_t suffix = strlen((const char*) pos);
+
+    if (shared + suffix >= MII_INDEX_STRING_MAX) return NULL;
+
+    memcpy(buf + shared, pos, suffix + 1);
+    *len = shared + suffix;
+
+    return pos + suffix + 1;
+}
+
+/*
+ * sort the interned strings and front-code them in blocks
+ * ids_out maps each interning slot to the id (sorted rank) of the string in it
+ */
+unsigned char* _mii_index_writer_encode_strings(mii_index_writer* w, uint32_t** ids_out, uint32_t** blocks_out, uint32_t* num_blocks_out, uint32_t* size_out) {
+    const char** sorted = malloc((w->num_strings ? w->num_strings : 1) * sizeof *sorted);
+    uint32_t* ids = malloc((w->max_string_slots ? w->max_string_slots : 1) * sizeof *ids);
+    uint32_t num = 0;
+
+    for (uint32_t i = 0; i < w->max_string_slots; ++i) {
+        if (w->string_slots[i] != MII_INDEX_EMPTY_SLOT) sorted[num++] = w->strings + w->string_slots[i];
+    }
+
+    qsort(sorted, num, sizeof *sorted, _mii_index_compare_strings);
+
+    /* worst case is every string stored whole behind a 5-byte varint */
+    unsigned char* out = malloc(w->strings_size + 5 * (size_t) num + 1);
+    uint32_t num_blocks = (num + MII_INDEX_STRING_BLOCK - 1) / MII_INDEX_STRING_BLOCK;
+    uint32_t* blocks = malloc((num_blocks ? num_blocks : 1) * sizeof *blocks);
+    uint32_t size = 0;
+
+    for (uint32_t i = 0; i < num; ++i) {
+        const char* str = sorted[i];
+        uint32_t shared = 0;
+
+        if (i % MII_INDEX_STRING_BLOCK) {
+            while (str[shared] && str[shared] == sorted[i - 1][shared]) ++shared;
+
+            for (uint32_t v = shared; ; v >>= 7) {
+                out[size++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+                if (v <= 0x7F) break;
+            }
+        } else {
+            blocks[i / MII_INDEX_STRING_BLOCK] = size;
+        }
+
+        uint32_t len = strlen(str + shared) + 1;
+
+        memcpy(out + size, str + shared, len);
+        size += len;
+
+        ids[_mii_index_writer_find_string(w, str, XXH32(str, strlen(str), 0))] = i;
+    }
+
+    free(sorted);
+
+    *ids_out = ids;
+    *blocks_out = blocks;
+    *num_blocks_out = num_blocks;
+    *size_out = size;
+
+    return out;
+}
+
+/*
+ * build the bk-tree over the command names in the command table
+ * names are inserted in slot order, which is effectively random, to keep the tree shallow.
+ * nodes are then laid out breadth-first so each node's children are contiguous
+ */
+uint32_t _mii_index_writer_bktree(mii_index_writer* w, const mii_index_command* commands, uint32_t num_commands, mii_index_bknode** nodes_out) {
+    /* linked tree while inserting: first child and next sibling per node */
+    uint32_t* slots = malloc((num_commands ? num_commands : 1) * sizeof *slots);
+    uint32_t* labels = malloc((num_commands ? num_commands : 1) * sizeof *labels);
+    uint32_t* first_child = malloc((num_commands ? num_commands : 1) * sizeof *first_child);
+    uint32_t* next_sibling = malloc((num_commands ? num_commands : 1) * sizeof *next_sibling);
+    uint32_t num = 0;
+
+    for (uint32_t i = 0; i < num_commands; ++i) {
+        if (commands[i].name == MII_INDEX_EMPTY_SLOT) continue;
+
+        const char* name = w->strings + commands[i].name;
+        uint32_t node = num++;
+
+        slots[node] = i;
+        labels[node] = 0;
+        first_child[node] = next_sibling[node] = MII_INDEX_EMPTY_SLOT;
+
+        if (!node) continue;
+
+        /* descend through children at the same distance until there is none */
+        for (uint32_t cur = 0;;) {
+            uint32_t dist = mii_damerau_distance(name, w->strings + commands[slots[cur]].name), child;
+
+            for (child = first_child[cur]; child != MII_INDEX_EMPTY_SLOT && labels[child] != dist; child = next_sibling[child]);
+
+            if (child == MII_INDEX_EMPTY_SLOT) {
+                labels[node] = dist;
+                next_sibling[node] = first_child[cur];
+                first_child[cur] = node;
+                break;
+            }
+
+            cur = child;
+        }
+    }
+
+    /* flatten breadth-first, order[] doubles as the queue */
+    mii_index_bknode* nodes = malloc((num ? num : 1) * sizeof *nodes);
+    uint32_t* order = malloc((num ? num : 1) * sizeof *order);
+    uint32_t tail = 0;
+
+    if (num) order[tail++] = 0;
+
+    for (uint32_t head = 0; head < tail; ++head) {
+        uint32_t node = order[head];
+
+        nodes[head].command = slots[node];
+        nodes[head].distance = labels[node];
+        nodes[head].children = tail;
+        nodes[head].num_children = 0;
+
+        for (uint32_t child = first_child[node]; child != MII_INDEX_EMPTY_SLOT; child = next_sibling[child]) {
+            order[tail++] = child;
+            ++nodes[head].num_children;
+        }
+    }
+
+    free(slots);
+    free(labels);
+    free(first_child);
+    free(next_sibling);
+    free(order);
+
+    *nodes_out = nodes;
+    return num;
+}
+
+/*
+ * map a raw string offset to its id after encoding
+ */
+uint32_t _mii_index_writer_string_id(mii_index_writer* w, const uint32_t* ids, uint32_t offset) {
+    const char* str = w->strings + offset;
+    return ids[_mii_index_writer_find_string(w, str, XXH32(str, strlen(str), 0))];
+}
+
+int _mii_index_compare_strings(const void* a, const void* b) {
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/*
+ * hash function for the command table, shared by the reader and writer
+ */
+uint32_t _mii_index_command_hash(const char* cmd) {
+    return XXH32(cmd, strlen(cmd), 0);
+}
+
+/*
+ * check whether the directory lists a section, for optional sections
+ */
+int _mii_index_has_section(mii_index* p, uint32_t id) {
+    const mii_index_section* directory = (const mii_index_section*) (p->base + p->header->header_size);
+
+    for (uint32_t i = 0; i < p->header->num_sections; ++i) {
+        if (directory[i].id == id) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * locate a section through the directory, checking it lies within the file
+ * sections with variable-sized records pass a record_size of 0
+ * returns NULL if the section is missing or damaged
+ */
+const void* _mii_index_section(mii_index* p, const char* path, uint32_t id, size_t record_size, uint32_t* count_out, uint32_t* size_out) {
+    const mii_index_section* directory = (const mii_index_section*) (p->base + p->header->header_size);
+
+    for (uint32_t i = 0; i < p->header->num_sections; ++i) {
+        const mii_index_section* sec = directory + i;
+
+        if (sec->id != id) continue;
+
+        if (sec->offset > p->size || sec->size > p->size - sec->offset || sec->size > UINT32_MAX || (sec->offset & 7)
+                || (record_size && sec->size != (uint64_t) sec->count * record_size)) {
+            mii_error("Couldn't parse from %s: section %u is out of range", path, id);
+            return NULL;
+        }
+
+        *count_out = sec->count;
+        if (size_out) *size_out = sec->size;
+        return p->base + sec->offset;
+    }
+
+    mii_error("Couldn't parse from %s: missing section %u", path, id);
+    return NULL;
+}
+
+/*
+ * get the journal path for an index
+ */
+char* mii_index_journal_path(const char* index_path) {
+    char* out = malloc(strlen(index_path) + sizeof ".journal");
+    sprintf(out, "%s.journal", index_path);
+    return out;
+}
+
+void mii_index_journal_init(mii_index_journal* j) {
+    memset(j, 0, sizeof *j);
+}
+
+void mii_index_journal_free(mii_index_journal* j) {
+    free(j->buf);
+    memset(j, 0, sizeof *j);
+}
+
+/*
+ * queue a record replacing (or adding) a module
+ */
+void mii_index_journal_upsert(mii_index_journal* j, const char* path, const char* code, int type, char** bins, int num_bins, char** parents, int num_parents, char** bin_dirs, const int64_t* bin_dir_mtimes, int num_bin_dirs, const mii_index_fingerprint* fingerprint) {
+    mii_index_journal_module mod;
+    const char* strs[2 + num_bins + num_parents + num_bin_dirs];
+
+    memset(&mod, 0, sizeof mod);
+    mod.type         = type;
+    mod.num_bins     = num_bins;
+    mod.num_parents  = num_parents;
+    mod.num_bin_dirs = num_bin_dirs;
+    mod.fingerprint  = *fingerprint;
+
+    /* the fixed part carries the bin dir mtimes after the module */
+    size_t fixed_size = sizeof mod + num_bin_dirs * sizeof *bin_dir_mtimes;
+    char fixed[fixed_size];
+
+    memcpy(fixed, &mod, sizeof mod);
+    if (num_bin_dirs) memcpy(fixed + sizeof mod, bin_dir_mtimes, num_bin_dirs * sizeof *bin_dir_mtimes);
+
+    strs[0] = path;
+    strs[1] = code;
+
+    for (int i = 0; i < num_bins; ++i) strs[2 + i] = bins[i];
+    for (int i = 0; i < num_parents; ++i) strs[2 + num_bins + i] = parents[i];
+    for (int i = 0; i < num_bin_dirs; ++i) strs[2 + num_bins + num_parents + i] = bin_dirs[i];
+
+    _mii_index_journal_record(j, MII_INDEX_JOURNAL_UPSERT, fixed, fixed_size, strs, 2 + num_bins + num_parents + num_bin_dirs);
+}
+
+/*
+ * queue a record removing a module
+ */
+void mii_index_journal_remove(mii_index_journal* j, const char* path) {
+    _mii_index_journal_record(j, MII_INDEX_JOURNAL_REMOVE, NULL, 0, &path, 1);
+}
+
+/*
+ * queue a record replacing (or adding) a directory mtime
+ */
+void mii_index_journal_upsert_dir(mii_index_journal* j, const char* path, int64_t mtime) {
+    mii_index_journal_dir dir;
+
+    memset(&dir, 0, sizeof dir);
+    dir.mtime = mtime;
+
+    _mii_index_journal_record(j, MII_INDEX_JOURNAL_DIR, &dir, sizeof dir, &path, 1);
+}
+
+/*
+ * queue a record removing a directory
+ */
+void mii_index_journal_remove_dir(mii_index_journal* j, const char* path) {
+    _mii_index_journal_record(j, MII_INDEX_JOURNAL_DIR_REMOVE, NULL, 0, &path, 1);
+}
+
+/*
+ * append the queued records to the journal of an index
+ * a journal for another generation is stale and gets replaced
+ */
+int mii_index_journal_append(mii_index_journal* j, const char* index_path, uint64_t generation) {
+    char* journal_path = mii_index_journal_path(index_path);
+    int res;
+
+    int fd = open(journal_path, O_RDWR | O_APPEND);
+    off_t end;
+
+    /* a journal for another generation is replaced, a torn tail from an interrupted append is cut off */
+    if (fd >= 0) {
+        if (_mii_index_journal_walk(fd, generation, NULL, NULL, NULL, &end)) {
+            close(fd);
+            fd = -1;
+        } else if (ftruncate(fd, end)) {
+            mii_warn("Couldn't truncate damaged journal %s: %s", journal_path, strerror(errno));
+        }
+    }
+
+    if (fd < 0) {
+        /* no usable journal yet, publish a fresh one */
+        res = _mii_index_journal_create(j, journal_path, generation);
+    } else {
+        /* a single append, readers see either nothing or a torn tail which fails its checksum */
+        res = _mii_index_write_all(fd, j->buf, j->size) || fsync(fd);
+
+        if (res) mii_error("Couldn't append to %s: %s", journal_path, strerror(errno));
+
+        close(fd);
+    }
+
+    mii_debug("Journaled %d records (%zu bytes) to %s", j->num_records, j->size, journal_path);
+
+    free(journal_path);
+    return res ? -1 : 0;
+}
+
+/*
+ * replay the journal of an index generation through a handler
+ * a missing or stale journal is not an error, it just has no records
+ */
+int mii_index_journal_read(const char* index_path, uint64_t generation, mii_index_journal_handler handler, mii_index_journal_dir_handler dir_handler, void* data) {
+    char* journal_path = mii_index_journal_path(index_path);
+    int fd = open(journal_path, O_RDONLY);
+
+    free(journal_path);
+
+    if (fd < 0) return 0;
+
+    int res = _mii_index_journal_walk(fd, generation, handler, dir_handler, data, NULL);
+
+    close(fd);
+    return (res > 0) ? 0 : res;
+}
+
+/*
+ * walk the records of a journal
+ * returns 1 if the journal does not belong to the generation, otherwise the first nonzero
+ * handler result. the end of the last intact record is saved in *end_out if non-NULL
+ */
+int _mii_index_journal_walk(int fd, uint64_t generation, mii_index_journal_handler handler, mii_index_journal_dir_handler dir_handler, void* data, off_t* end_out) {
+    mii_index_journal_header header;
+    struct stat st;
+
+    if (fstat(fd, &st) || st.st_size < sizeof header) return 1;
+
+    char* buf = malloc(st.st_size + 1);
+    size_t size = 0;
+
+    /* the journal is small, read it whole */
+    while (size < st.st_size) {
+        ssize_t len = pread(fd, buf + size, st.st_size - size, size);
+
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+
+        size += len;
+    }
+
+    memcpy(&header, buf, sizeof header);
+
+    if (size < sizeof header
+        || memcmp(header.magic, MII_INDEX_JOURNAL_MAGIC_BYTES, sizeof header.magic)
+        || header.version != MII_INDEX_VERSION
+        || header.byte_order != MII_INDEX_BYTE_ORDER
+        || header.generation != generation) {
+        free(buf);
+        return 1;
+    }
+
+    size_t pos = sizeof header;
+    char** strs = NULL;
+    size_t max_strs = 0;
+    int res = 0;
+
+    while (!res && pos + sizeof(mii_index_journal_record) <= size) {
+        mii_index_journal_record rec;
+        memcpy(&rec, buf + pos, sizeof rec);
+
+        char* payload = buf + pos + sizeof rec;
+        size_t fixed_size = 0;
+
+        mii_index_journal_module mod;
+
+        /* upserts are followed by their bin dir mtimes, the count is read from an intact payload below */
+        if (rec.type == MII_INDEX_JOURNAL_UPSERT) fixed_size = sizeof mod;
+        if (rec.type == MII_INDEX_JOURNAL_DIR) fixed_size = sizeof(mii_index_journal_dir);
+
+        /* stop at a torn or damaged record, its payload must also end in a terminator */
+        if (rec.size > size - pos - sizeof rec || rec.size <= fixed_size || payload[rec.size - 1] || XXH3_64bits(payload, rec.size) != rec.checksum) {
+            mii_debug("Journal ends with a damaged record at offset %zu", pos);
+            break;
+        }
+
+        pos += sizeof rec + rec.size;
+
+        if (!handler) continue;
+
+        if (rec.type == MII_INDEX_JOURNAL_UPSERT) {
+            memcpy(&mod, payload, sizeof mod);
+
+            if ((size_t) mod.num_bin_dirs * sizeof(int64_t) >= rec.size - fixed_size) {
+                mii_warn("Ignoring malformed journal record");
+                continue;
+            }
+
+            fixed_size += mod.num_bin_dirs * sizeof(int64_t);
+        }
+
+        /* split the strings following the fixed part */
+        size_t num_strs = 0;
+
+        for (size_t cur = fixed_size; cur < rec.size; cur += strlen(payload + cur) + 1) {
+            if (num_strs == max_strs) {
+                max_strs = max_strs ? max_strs * 2 : 64;
+                strs = realloc(strs, max_strs * sizeof *strs);
+            }
+
+            strs[num_strs++] = payload + cur;
+        }
+
+        if (rec.type == MII_INDEX_JOURNAL_REMOVE && num_strs == 1) {
+            res = handler(data, MII_INDEX_JOURNAL_REMOVE, strs[0], NULL, 0, NULL, 0, NULL, 0, NULL, NULL, 0, NULL);
+        } else if (rec.type == MII_INDEX_JOURNAL_UPSERT) {
+            if (num_strs != 2 + (size_t) mod.num_bins + mod.num_parents + mod.num_bin_dirs) {
+                mii_warn("Ignoring malformed journal record");
+                continue;
+            }
+
+            /* payloads aren't aligned, so the mtimes are copied out */
+            int64_t mtimes[mod.num_bin_dirs ? mod.num_bin_dirs : 1];
+            memcpy(mtimes, payload + sizeof mod, mod.num_bin_dirs * sizeof *mtimes);
+
+            res = handler(data, MII_INDEX_JOURNAL_UPSERT, strs[0], strs[1], mod.type, strs + 2, mod.num_bins, strs + 2 + mod.num_bins, mod.num_parents,
+                          strs + 2 + mod.num_bins + mod.num_parents, mtimes, mod.num_bin_dirs, &mod.fingerprint);
+        } else if (rec.type == MII_INDEX_JOURNAL_DIR && num_strs == 1) {
+            if (!dir_handler) continue;
+
+            mii_index_journal_dir dir;
+            memcpy(&dir, payload, sizeof dir);
+
+            res = dir_handler(data, MII_INDEX_JOURNAL_DIR, strs[0], dir.mtime);
+        } else if (rec.type == MII_INDEX_JOURNAL_DIR_REMOVE && num_strs == 1) {
+            if (!dir_handler) continue;
+
+            res = dir_handler(data, MII_INDEX_JOURNAL_DIR_REMOVE, strs[0], 0);
+        } else {
+            mii_warn("Ignoring unknown journal record type %u", rec.type);
+        }
+    }
+
+    if (end_out) *end_out = pos;
+
+    free(strs);
+    free(buf);
+
+    return res;
+}
+
+/*
+ * serialize a journal record into the pending buffer
+ */
+void _mii_index_journal_record(mii_index_journal* j, int type, const void* fixed, size_t fixed_size, const char** strs, int num_strs) {
+    size_t size = fixed_size;
+
+    for (int i = 0; i < num_strs; ++i) size += strlen(strs[i]) + 1;
+
+    while (j->size + sizeof(mii_index_journal_record) + size > j->max_size) {
+        j->max_size = j->max_size ? j->max_size * 2 : 4096;
+        j->buf = realloc(j->buf, j->max_size);
+    }
+
+    mii_index_journal_record rec;
+    char* payload = j->buf + j->size + sizeof rec;
+    char* cur = payload + fixed_size;
+
+    if (fixed_size) memcpy(payload, fixed, fixed_size);
+
+    for (int i = 0; i < num_strs; ++i) {
+        size_t len = strlen(strs[i]) + 1;
+        memcpy(cur, strs[i], len);
+        cur += len;
+    }
+
+    rec.type = type;
+    rec.size = size;
+    rec.checksum = XXH3_64bits(payload, size);
+
+    memcpy(j->buf + j->size, &rec, sizeof rec);
+    j->size += sizeof rec + size;
+    ++j->num_records;
+}
+
+/*
+ * write a new journal holding only the pending records, replacing any old one
+ */
+int _mii_index_journal_create(mii_index_journal* j, const char* journal_path, uint64_t generation) {
+    mii_index_journal_header header;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, MII_INDEX_JOURNAL_MAGIC_BYTES, sizeof header.magic);
+    header.version    = MII_INDEX_VERSION;
+    header.byte_order = MII_INDEX_BYTE_ORDER;
+    header.generation = generation;
+
+    char* tmp_path = malloc(strlen(journal_path) + 8);
+    sprintf(tmp_path, "%s.XXXXXX", journal_path);
+
+    int fd = mkstemp(tmp_path);
+
+    if (fd < 0) {
+        mii_error("Couldn't open %s for writing: %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+
+    fchmod(fd, 0644);
+
+    int res = _mii_index_write_all(fd, &header, sizeof header)
+           || _mii_index_write_all(fd, j->buf, j->size)
+           || fsync(fd);
+
+    if (close(fd) || res || rename(tmp_path, journal_path)) {
+        mii_error("Couldn't write %s: %s", journal_path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    free(tmp_path);
+    return 0;
+}
+
+/*
+ * write a whole buffer to a descriptor
+ */
+int _mii_index_write_all(int fd, const void* data, size_t size) {
+    const char* cur = data;
+
+    while (size) {
+        ssize_t written = write(fd, cur, size);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        cur += written;
+        size -= written;
+    }
+
+    return 0;
+}
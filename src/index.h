@@ -0,0 +1,275 @@
+#pragma once
+
+/*
+ * mii_index
+ *
+ * on-disk module index format
+ *
+ * the index is laid out as fixed-width tables followed by a string blob,
+ * so it can be mapped into memory and read in place without parsing.
+ * strings and bin/parent lists are interned, so each distinct command name,
+ * parent string or bin list is stored once and shared by every module using it.
+ *
+ * a fixed header and a section directory locate each table. readers check the
+ * header in O(1), look sections up by id and ignore ids they don't know:
+ *
+ *     header             (magic, version, byte order, file size, checksum, generation)
+ *     section directory  (num_sections entries)
+ *     modules            (module records)
+ *     refs               (string offsets, used for bin/parent lists)
+ *     commands           (hash slots, inverted command -> provider index)
+ *     providers          (module indices, grouped by command)
+ *     strings            (front-coded strings)
+ *     string blocks      (offset of each block in the strings section)
+ *     bk-tree            (metric tree over command names, for fuzzy search)
+ *     dirs               (directories crawled and their mtimes)
+ *     bin dirs           (bin directories scanned for each module and their mtimes)
+ *
+ * sections start on 8-byte boundaries. the checksum is an XXH3 hash of
+ * everything after the header.
+ *
+ * strings are referenced by id, their rank in sorted order. module paths,
+ * codes and command names share long prefixes, so sorted strings are
+ * front-coded in blocks of MII_INDEX_STRING_BLOCK: the first string of a
+ * block is stored whole, each following string as a varint count of bytes
+ * shared with its predecessor and the null-terminated remainder. decoding a
+ * string walks at most one block.
+ *
+ * the bk-tree holds every distinct command name once. each node's children
+ * are contiguous and labelled with their damerau-levenshtein distance to it,
+ * so a fuzzy search only descends into children whose label is within the
+ * search radius of the node's own distance to the query.
+ *
+ * the dirs section records the mtime of every directory crawled, so the next
+ * sync can reuse the listing of a directory which hasn't changed. the bin dirs
+ * section does the same for the directories each module's commands were found
+ * in, so the sync can tell when commands were added to an unchanged module.
+ *
+ * each module records a fingerprint of its modulefile: size, inode, mtime and a
+ * hash of the contents. a file whose metadata changed is only analyzed again if
+ * its hash did too, since copies and publishes often touch files without
+ * changing them.
+ *
+ * indices are never rewritten in place: a new index is written to a temporary
+ * file and renamed over the old one with a higher generation, so readers which
+ * still have the previous generation mapped are unaffected.
+ *
+ * small changes are appended to a journal next to the index (<index>.journal)
+ * instead. the journal holds checksummed records which replace or remove
+ * modules and directories, and only applies to the index generation recorded in its header.
+ * a torn record at the end of the journal is ignored.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* bumped on any incompatible change to the layout of existing sections */
+#define MII_INDEX_VERSION 4
+
+/* written in host order, reads back differently on a foreign-endian host */
+#define MII_INDEX_BYTE_ORDER 0x0102
+
+/* section ids */
+#define MII_INDEX_SECTION_MODULES   1
+#define MII_INDEX_SECTION_REFS      2
+#define MII_INDEX_SECTION_COMMANDS  3
+#define MII_INDEX_SECTION_PROVIDERS 4
+#define MII_INDEX_SECTION_STRINGS   5
+#define MII_INDEX_SECTION_STRING_BLOCKS 6
+#define MII_INDEX_SECTION_BKTREE   7
+#define MII_INDEX_SECTION_DIRS     8
+#define MII_INDEX_SECTION_BIN_DIRS 9
+
+/* strings per front-coded block */
+#define MII_INDEX_STRING_BLOCK 16
+
+/* longest string stored, including the terminator. decode buffers are this size */
+#define MII_INDEX_STRING_MAX 4096
+
+typedef struct _mii_index_header {
+    unsigned char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+    uint32_t header_size; /* the section directory starts here */
+    uint32_t num_sections;
+    uint64_t file_size;
+    uint64_t checksum;
+    uint64_t generation; /* incremented each time the index is replaced */
+} mii_index_header;
+
+typedef struct _mii_index_section {
+    uint32_t id;
+    uint32_t count; /* number of records in the section */
+    uint64_t offset, size; /* in bytes, from the start of the file */
+} mii_index_section;
+
+/* what a modulefile looked like when it was analyzed */
+typedef struct _mii_index_fingerprint {
+    int64_t mtime; /* nanoseconds */
+    uint64_t size, inode;
+    uint64_t hash; /* XXH3 of the contents, 0 if unknown */
+} mii_index_fingerprint;
+
+typedef struct _mii_index_module {
+    uint32_t path, code; /* string ids */
+    uint32_t type;
+    uint32_t num_bins, bins; /* bins are refs[bins .. bins + num_bins] */
+    uint32_t num_parents, parents; /* parents are refs[parents .. parents + num_parents] */
+    uint32_t num_bin_dirs, bin_dirs; /* bin dirs are bin_dirs[bin_dirs .. bin_dirs + num_bin_dirs] */
+    uint32_t reserved;
+    mii_index_fingerprint fingerprint;
+} mii_index_module;
+
+/* open-addressed slot in the command table, empty if name is MII_INDEX_EMPTY_SLOT */
+typedef struct _mii_index_command {
+    uint32_t name; /* string id */
+    uint32_t num_providers, providers; /* providers[providers .. providers + num_providers] */
+} mii_index_command;
+
+#define MII_INDEX_EMPTY_SLOT UINT32_MAX
+
+/* bk-tree node, the root is node 0 */
+typedef struct _mii_index_bknode {
+    uint32_t command; /* slot in the command table */
+    uint32_t distance; /* distance from the parent's name to this one */
+    uint32_t children, num_children; /* nodes[children .. children + num_children] */
+} mii_index_bknode;
+
+typedef struct _mii_index_dir {
+    uint32_t path; /* string id */
+    uint32_t reserved;
+    int64_t mtime; /* nanoseconds */
+} mii_index_dir;
+
+/* journal record types */
+#define MII_INDEX_JOURNAL_UPSERT     1
+#define MII_INDEX_JOURNAL_REMOVE     2
+#define MII_INDEX_JOURNAL_DIR        3
+#define MII_INDEX_JOURNAL_DIR_REMOVE 4
+
+typedef struct _mii_index_journal_header {
+    unsigned char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+    uint64_t generation; /* generation of the index this journal applies to */
+} mii_index_journal_header;
+
+typedef struct _mii_index_journal_record {
+    uint32_t type, size; /* size of the payload following the record */
+    uint64_t checksum; /* XXH3 of the payload */
+} mii_index_journal_record;
+
+/* upsert payload, followed by the mtime of each bin dir, then the path, code, bins, parents and
+ * bin dirs as null-terminated strings.
+ * remove payloads are only the path, dir payloads the mtime followed by the path */
+typedef struct _mii_index_journal_module {
+    uint32_t type, num_bins, num_parents, num_bin_dirs;
+    mii_index_fingerprint fingerprint;
+} mii_index_journal_module;
+
+typedef struct _mii_index_journal_dir {
+    int64_t mtime;
+} mii_index_journal_dir;
+
+/* read-only view of a mapped index */
+typedef struct _mii_index {
+    unsigned char* base;
+    size_t size;
+
+    const mii_index_header* header;
+    uint32_t num_modules, num_refs, num_commands, num_providers, num_strings, strings_size, num_string_blocks;
+
+    const mii_index_module* modules;
+    const uint32_t* refs;
+    const mii_index_command* commands;
+    const uint32_t* providers;
+    const unsigned char* strings;
+    const uint32_t* string_blocks;
+    const mii_index_bknode* bktree; /* NULL in indices written without one */
+    uint32_t num_bknodes;
+    const mii_index_dir* dirs; /* NULL in indices written without one */
+    uint32_t num_dirs;
+    const mii_index_dir* bin_dirs;
+    uint32_t num_bin_dirs;
+
+    /* every string decoded at once by mii_index_decode_strings(), or NULL */
+    char* decoded_blob;
+    char** decoded;
+} mii_index;
+
+/* in-memory index builder */
+typedef struct _mii_index_writer {
+    mii_index_module* modules;
+    uint32_t num_modules, max_modules;
+
+    uint32_t* refs;
+    uint32_t num_refs, max_refs;
+
+    /* raw interned strings, references are offsets here until they are sorted on save */
+    char* strings;
+    uint32_t strings_size, max_strings;
+
+    /* interning tables, open-addressed and at most half full */
+    uint32_t* string_slots; /* string offsets */
+    uint32_t num_strings, max_string_slots;
+
+    uint32_t* list_slots; /* (first, num) reference ranges */
+    uint32_t num_lists, max_list_slots;
+
+    mii_index_dir* dirs;
+    uint32_t num_dirs, max_dirs;
+
+    mii_index_dir* bin_dirs;
+    uint32_t num_bin_dirs, max_bin_dirs;
+} mii_index_writer;
+
+/* journal records waiting to be appended */
+typedef struct _mii_index_journal {
+    char* buf;
+    size_t size, max_size;
+    int num_records;
+} mii_index_journal;
+
+/* called for each command name close to a query */
+typedef void (*mii_index_similar_handler)(void* data, const char* name, int distance, const uint32_t* providers, uint32_t num_providers);
+
+/* called for each journal record, strings are only valid during the call */
+typedef int (*mii_index_journal_handler)(void* data, int op, const char* path, const char* code, int type, char** bins, int num_bins, char** parents, int num_parents, char** bin_dirs, const int64_t* bin_dir_mtimes, int num_bin_dirs, const mii_index_fingerprint* fingerprint);
+typedef int (*mii_index_journal_dir_handler)(void* data, int op, const char* path, int64_t mtime);
+
+int mii_index_open(mii_index* p, const char* path); /* map an index from the disk */
+int mii_index_verify(const mii_index* p); /* check the index against its checksum */
+int mii_index_read_header(const char* path, mii_index_header* out); /* read only the header, without mapping */
+void mii_index_close(mii_index* p);
+
+/* decode a string into buf, which holds MII_INDEX_STRING_MAX bytes.
+ * buf may be NULL after mii_index_decode_strings() */
+const char* mii_index_string(const mii_index* p, uint32_t id, char* buf);
+int mii_index_decode_strings(mii_index* p); /* decode every string in one pass, kept until close */
+
+/* look up the modules providing a command, returns nonzero if no module does */
+int mii_index_find_command(const mii_index* p, const char* cmd, const uint32_t** providers_out, uint32_t* num_providers_out);
+
+/* report every command name within a distance of a query, returns nonzero if the index has no bk-tree */
+int mii_index_find_similar(const mii_index* p, const char* cmd, int max_distance, mii_index_similar_handler handler, void* data);
+
+void mii_index_writer_init(mii_index_writer* w);
+void mii_index_writer_free(mii_index_writer* w);
+
+void mii_index_writer_add(mii_index_writer* w, const char* path, const char* code, int type, char** bins, int num_bins, char** parents, int num_parents, char** bin_dirs, const int64_t* bin_dir_mtimes, int num_bin_dirs, const mii_index_fingerprint* fingerprint);
+void mii_index_writer_add_dir(mii_index_writer* w, const char* path, int64_t mtime);
+int mii_index_writer_save(mii_index_writer* w, const char* path); /* atomically replace the index on disk */
+
+char* mii_index_journal_path(const char* index_path);
+
+void mii_index_journal_init(mii_index_journal* j);
+void mii_index_journal_free(mii_index_journal* j);
+
+void mii_index_journal_upsert(mii_index_journal* j, const char* path, const char* code, int type, char** bins, int num_bins, char** parents, int num_parents, char** bin_dirs, const int64_t* bin_dir_mtimes, int num_bin_dirs, const mii_index_fingerprint* fingerprint);
+void mii_index_journal_remove(mii_index_journal* j, const char* path);
+void mii_index_journal_upsert_dir(mii_index_journal* j, const char* path, int64_t mtime);
+void mii_index_journal_remove_dir(mii_index_journal* j, const char* path);
+
+int mii_index_journal_append(mii_index_journal* j, const char* index_path, uint64_t generation); /* append pending records to the journal on disk */
+int mii_index_journal_read(const char* index_path, uint64_t generation, mii_index_journal_handler handler, mii_index_journal_dir_handler dir_handler, void* data); /* replay the journal for an index generation */
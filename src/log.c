@@ -5,8 +5,6 @@
 #include <time.h>
 #include <unistd.h>
 
-static char _mii_log_datestr[64];
-
 static int _mii_log_verbosity = MII_LOG_VERBOSITY_DEFAULT;
 static int _mii_log_colors    = MII_LOG_COLOR_DEFAULT;
 
@@ -15,10 +13,15 @@ void mii_log(int level, const char* color, const char* tag, const char* fmt, va_
 
     /* get current time */
     time_t time_point = time(NULL);
+    struct tm tm_point;
+    char datestr[64];
+
+    /* lines logged from worker threads are written whole */
+    flockfile(stderr);
 
     /* print time prefix */
-    strftime(_mii_log_datestr, sizeof _mii_log_datestr, "%H:%M:%S", localtime(&time_point));
-    fprintf(stderr, "[%s] ", _mii_log_datestr);
+    strftime(datestr, sizeof datestr, "%H:%M:%S", localtime_r(&time_point, &tm_point));
+    fprintf(stderr, "[%s] ", datestr);
 
     /* determine if we need colors */
     int write_colors = 0;
@@ -45,6 +48,8 @@ void mii_log(int level, const char* color, const char* tag, const char* fmt, va_
 
     vfprintf(stderr, fmt, args);
     fprintf(stderr, "\n");
+
+    funlockfile(stderr);
 }
 
 void mii_info(const char* fmt, ...) {
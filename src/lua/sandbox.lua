@@ -34,6 +34,10 @@
 
 local concatTbl = table.concat
 
+-- LuaJIT doesn't call hooks from compiled code, so a looping modulefile
+-- would never run out of its instruction budget
+if jit then jit.off() end
+
 local meta_table     = {}
 fake_obj             = {}
 
@@ -50,20 +54,29 @@ function getenv (...)
     if val then return val else return "" end
 end
 
--- The bare minimum to check for PATH modifications in modulefiles
-test_env = {
-    pathJoin        = pathJoin,
-    prepend_path    = handle_path,
-    append_path     = handle_path,
-    os              = {getenv = getenv},
-    assert          = assert,
-    error           = error,
-    ipairs          = ipairs,
-    pairs           = pairs,
-}
-
 meta_table.__index  = fake_func
 
+-- The bare minimum to check for PATH modifications in modulefiles.
+-- Each modulefile runs in a new one, so nothing it sets leaks into the next
+local function new_env()
+    local env = {
+        pathJoin        = pathJoin,
+        prepend_path    = handle_path,
+        append_path     = handle_path,
+        os              = {getenv = getenv},
+        assert          = assert,
+        error           = error,
+        ipairs          = ipairs,
+        pairs           = pairs,
+        loadfile        = loadfile,
+        dofile          = dofile,
+    }
+    return setmetatable(env, meta_table)
+end
+
+-- environment of the modulefile being run, files it loads share it
+local test_env = nil
+
 -- These functions may get called if the modulefile tries to use a
 -- function which isn't defined in the test env
 local meta_obj = {
@@ -77,7 +90,6 @@ local meta_obj = {
 }
 
 setmetatable(fake_obj, meta_obj)
-setmetatable(test_env, meta_table)
 
 --------------------------------------------------------------------------
 -- Load the provided code in a sandbox environment and return it as a
@@ -120,15 +132,13 @@ function dofile(filename)
     return assert(loadfile(filename))()
 end
 
--- add the functions to the sandbox env
-test_env.loadfile = loadfile
-test_env.dofile   = dofile
-
 --------------------------------------------------------------------------
 -- Load the provided code in a sandbox environment and execute it
 -- @param untrusted_code A string containing lua code
 function sandbox_run(untrusted_code)
     paths = {}
+    test_env = new_env()
     loadcode(untrusted_code)()
+    test_env = nil
     return paths
 end
\ No newline at end of file
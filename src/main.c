@@ -22,10 +22,18 @@ static const char* USAGE_STRING =
     "    -v, --version    Show Mii build version\n"
     "\nOPTIONS:\n"
     "    -d, --datadir <datadir>    Use <datadir> to store index data\n"
+    "    -s, --system               Build or sync the system index at $MII_INDEX_FILE\n"
     "    -m, --modulepath <path>    Use <path> instead of $MODULEPATH\n"
+    "\nBUILD, SYNC AND WATCH OPTIONS:\n"
+    "    -j, --jobs <n>             Crawl and analyze with <n> threads\n"
+    "    -b, --budget <ms>          Sync for at most <ms> milliseconds, leaving the rest for the next sync\n"
+    "    -w, --wait                 Wait for a sync already running and use its index, instead of leaving\n"
     "\nSUBCOMMANDS:\n"
     "    build               Regenerate the module index\n"
     "    sync                Update the module index\n"
+    "    watch               Keep the module index updated as modules change\n"
+    "    watching            Exit successfully only if a watcher is running\n"
+    "    compact             Merge pending index changes into the index\n"
     "    exact <command>     Find modules which provide <command>\n"
     "    search <command>    Search for commands similar to <command>\n"
     "    show <module>       Show commands provided by <module>\n"
@@ -40,12 +48,33 @@ static const char* USAGE_STRING =
 static struct option long_options[] = {
     { "datadir",    required_argument, NULL, 'd' },
     { "modulepath", required_argument, NULL, 'm' },
+    { "system",     no_argument,       NULL, 's' },
     { "help",       no_argument,       NULL, 'h' },
     { "json",       no_argument,       NULL, 'j' },
     { "version",    no_argument,       NULL, 'v' },
     { NULL,         0,                 NULL,  0 },
 };
 
+/* options following the subcommand, -j means --jobs after build, sync and watch.
+ * the global options which take part in every subcommand are accepted there too */
+static struct option jobs_options[] = {
+    { "jobs",       required_argument, NULL, 'j' },
+    { "budget",     required_argument, NULL, 'b' },
+    { "wait",       no_argument,       NULL, 'w' },
+    { "datadir",    required_argument, NULL, 'd' },
+    { "modulepath", required_argument, NULL, 'm' },
+    { "system",     no_argument,       NULL, 's' },
+    { NULL,         0,                 NULL,  0 },
+};
+
+static struct option json_options[] = {
+    { "json",       no_argument,       NULL, 'j' },
+    { "datadir",    required_argument, NULL, 'd' },
+    { "modulepath", required_argument, NULL, 'm' },
+    { "system",     no_argument,       NULL, 's' },
+    { NULL,         0,                 NULL,  0 },
+};
+
 static void usage(int header, char* a0);
 static int install();
 static void version();
@@ -54,7 +83,8 @@ int main(int argc, char** argv) {
     int opt;
     int search_result_flags = 0;
 
-    while ((opt = getopt_long(argc, argv, "d:m:hjv", long_options, NULL)) != -1) {
+    /* global options stop at the subcommand, which takes its own */
+    while ((opt = getopt_long(argc, argv, "+d:m:shjv", long_options, NULL)) != -1) {
         switch (opt) {
         case 'd': /* set datadir */
             mii_option_datadir(optarg);
@@ -62,6 +92,9 @@ int main(int argc, char** argv) {
         case 'm': /* set modulepath */
             mii_option_modulepath(optarg);
             break;
+        case 's': /* write the system index */
+            mii_option_system();
+            break;
         case 'j':
             search_result_flags |= MII_SEARCH_RESULT_JSON;
             break;
@@ -81,15 +114,89 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    char* subcommand = argv[optind];
+    int sub = optind, takes_jobs = !strcmp(subcommand, "build") || !strcmp(subcommand, "sync") || !strcmp(subcommand, "watch");
+
+    /* parse the subcommand's options, starting after it.
+     * optind 0 makes getopt start over, dropping the stop-at-operand mode of the global options */
+    optind = 0;
+
+    while ((opt = getopt_long(argc - sub, argv + sub, takes_jobs ? "j:b:wd:m:s" : "jd:m:s", takes_jobs ? jobs_options : json_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            mii_option_datadir(optarg);
+            break;
+        case 'm':
+            mii_option_modulepath(optarg);
+            break;
+        case 's':
+            mii_option_system();
+            break;
+        case 'j':
+            if (!takes_jobs) {
+                search_result_flags |= MII_SEARCH_RESULT_JSON;
+                break;
+            }
+
+            char* end;
+            long jobs = strtol(optarg, &end, 10);
+
+            if (*end || jobs < 1 || jobs > 1024) {
+                mii_error("%s: invalid job count \"%s\"", subcommand, optarg);
+                return -1;
+            }
+
+            mii_option_jobs(jobs);
+            break;
+        case 'b':
+            if (strcmp(subcommand, "sync")) {
+                mii_error("%s: --budget only applies to sync", subcommand);
+                return -1;
+            }
+
+            char* budget_end;
+            long budget = strtol(optarg, &budget_end, 10);
+
+            if (*budget_end || budget < 1 || budget > 86400000) {
+                mii_error("%s: invalid budget \"%s\"", subcommand, optarg);
+                return -1;
+            }
+
+            mii_option_budget(budget);
+            break;
+        case 'w':
+            if (strcmp(subcommand, "sync")) {
+                mii_error("%s: --wait only applies to sync", subcommand);
+                return -1;
+            }
+
+            mii_option_wait();
+            break;
+        default:
+            usage(0, *argv);
+            return -1;
+        }
+    }
+
+    /* options were moved ahead of the positional arguments, so ++optind reaches the first one */
+    optind += sub - 1;
+
     /* initialize mii */
     if (mii_init()) return -1;
 
     /* execute subcommand */
-    if (!strcmp(argv[optind], "sync")) {
+    if (!strcmp(subcommand, "sync")) {
         if (mii_sync()) return -1;
-    } else if (!strcmp(argv[optind], "build")) {
+    } else if (!strcmp(subcommand, "build")) {
         if (mii_build()) return -1;
-    } else if (!strcmp(argv[optind], "exact")) {
+    } else if (!strcmp(subcommand, "watch")) {
+        if (mii_watch()) return -1;
+    } else if (!strcmp(subcommand, "watching")) {
+        /* the shell integration skips its login sync on success */
+        if (!mii_watching()) return 1;
+    } else if (!strcmp(subcommand, "compact")) {
+        if (mii_compact()) return -1;
+    } else if (!strcmp(subcommand, "exact")) {
         /* check there is a second positional argument */
         if (++optind >= argc) {
             mii_error("exact: missing argument");
@@ -104,7 +211,7 @@ int main(int argc, char** argv) {
         /* output the result and clean up */
         mii_search_result_write(&res, stdout, MII_SEARCH_RESULT_MODE_EXACT, search_result_flags);
         mii_search_result_free(&res);
-    } else if (!strcmp(argv[optind], "search")) {
+    } else if (!strcmp(subcommand, "search")) {
         /* check there is a second positional argument */
         if (++optind >= argc) {
             mii_error("search: missing argument");
@@ -119,7 +226,7 @@ int main(int argc, char** argv) {
         /* output the result and clean up */
         mii_search_result_write(&res, stdout, MII_SEARCH_RESULT_MODE_FUZZY, search_result_flags);
         mii_search_result_free(&res);
-    } else if (!strcmp(argv[optind], "show")) {
+    } else if (!strcmp(subcommand, "show")) {
         /* check there is a second positional argument */
         if (++optind >= argc) {
             mii_error("show: missing argument");
@@ -134,7 +241,7 @@ int main(int argc, char** argv) {
         /* output the result and clean up */
         mii_search_result_write(&res, stdout, MII_SEARCH_RESULT_MODE_SHOW, search_result_flags);
         mii_search_result_free(&res);
-    } else if (!strcmp(argv[optind], "select")) {
+    } else if (!strcmp(subcommand, "select")) {
         /* check there is a second positional argument */
         if (++optind >= argc) {
             mii_error("select: missing argument");
@@ -268,22 +375,22 @@ int main(int argc, char** argv) {
         }
 
         mii_search_result_free(&res);
-    } else if (!strcmp(argv[optind], "list")) {
+    } else if (!strcmp(subcommand, "list")) {
         if (mii_list()) return -1;
-    } else if (!strcmp(argv[optind], "help")) {
+    } else if (!strcmp(subcommand, "help")) {
         usage(1, *argv);
-    } else if (!strcmp(argv[optind], "install")) {
+    } else if (!strcmp(subcommand, "install")) {
         if (install()) return -1;
-    } else if (!strcmp(argv[optind], "disable")) {
+    } else if (!strcmp(subcommand, "disable")) {
         if (mii_disable()) return -1;
-    } else if (!strcmp(argv[optind], "enable")) {
+    } else if (!strcmp(subcommand, "enable")) {
         if (mii_enable()) return -1;
-    } else if (!strcmp(argv[optind], "status")) {
+    } else if (!strcmp(subcommand, "status")) {
         if (mii_status()) return -1;
-    } else if (!strcmp(argv[optind], "version")) {
+    } else if (!strcmp(subcommand, "version")) {
         version();
     } else {
-        mii_error("Unrecognized subcommand \"%s\"!", argv[optind]);
+        mii_error("Unrecognized subcommand \"%s\"!", subcommand);
     }
 
     /* cleanup */
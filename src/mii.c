@@ -4,21 +4,56 @@
 #include "util.h"
 #include "log.h"
 #include "analysis.h"
+#include "pool.h"
+#include "watch.h"
+
+#include "xxhash/xxhash.h"
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
 
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 /* options */
 static char* _mii_modulepath = NULL;
 static char* _mii_datadir    = NULL;
+static int _mii_system       = 0;
+static int _mii_jobs         = MII_POOL_DEFAULT_JOBS;
+static int _mii_budget_ms    = 0;
+static int _mii_wait         = 0;
 
 /* state */
-static char* _mii_datafile = NULL;
+static char* _mii_datafile        = NULL;
+static char* _mii_system_datafile = NULL;
+static char* _mii_binfile         = NULL;
+static char* _mii_lockfile        = NULL;
+static int64_t _mii_deadline      = 0; /* mii_clock_ns() at which syncs stop analyzing, 0 for none */
+static char* _mii_watch_pid_path  = NULL; /* removed by the watcher when it is stopped */
+
+/* MODULEPATH roots, each indexed in its own shard.
+ * roots covered by the system index are read from it and never written */
+static char** _mii_roots = NULL;
+static char** _mii_shards = NULL;
+static int* _mii_readonly = NULL;
+static int _mii_num_roots = 0;
+
+int _mii_init_roots();
+char* _mii_shard_path(const char* datafile, const char* root);
+int _mii_build_root(int root, int* count);
+int _mii_sync_root(int root, const mii_modtable_hints* hints, mii_watcher* watcher, int* count, int* num_removed, int* num_stale);
+int _mii_root_current(int root);
+void _mii_watch_table(mii_watcher* watcher, mii_modtable* table, int all);
+int _mii_lock(int wait, int* held);
+void _mii_unlock(int fd);
+int _mii_watch_lock(const char* pid_path);
+void _mii_watch_signal(int sig);
+mii_modtable* _mii_load_shards();
+void _mii_free_shards(mii_modtable* tables);
 
 void mii_option_modulepath(const char* modulepath) {
     if (modulepath) _mii_modulepath = mii_strdup(modulepath);
@@ -28,6 +63,22 @@ void mii_option_datadir(const char* datadir) {
     if (datadir) _mii_datadir = mii_strdup(datadir);
 }
 
+void mii_option_system() {
+    _mii_system = 1;
+}
+
+void mii_option_jobs(int jobs) {
+    _mii_jobs = jobs;
+}
+
+void mii_option_budget(int budget_ms) {
+    _mii_budget_ms = budget_ms;
+}
+
+void mii_option_wait() {
+    _mii_wait = 1;
+}
+
 int mii_init() {
     if (!_mii_modulepath) {
         char* env_modulepath = getenv("MODULEPATH");
@@ -45,24 +96,8 @@ int mii_init() {
     {
         char *index_file = getenv("MII_INDEX_FILE");
 
-        if (index_file)
-        {
-            char* index_file_cpy = mii_strdup(index_file);
-            char* mii_index_dir = dirname(index_file_cpy);
-
-            /* create parent dir */
-            int res = mii_recursive_mkdir(mii_index_dir, 0755);
-
-            free(index_file_cpy);
-
-            /* couldn't create index dir */
-            if (res) {
-                mii_error("Error initializing index directory: %s", strerror(errno));
-                return -1;
-            }
-
-            _mii_datafile = mii_strdup(index_file);
-        }
+        /* the system index is read before the user's own shards, and only written with --system */
+        if (index_file) _mii_system_datafile = mii_strdup(index_file);
 
         char* home = getenv("HOME");
 
@@ -74,6 +109,27 @@ int mii_init() {
         _mii_datadir = mii_join_path(home, ".mii");
     }
 
+    if (_mii_system) {
+        if (!_mii_system_datafile) {
+            mii_error("--system requires MII_INDEX_FILE to be set!");
+            return -1;
+        }
+
+        char* index_file_cpy = mii_strdup(_mii_system_datafile);
+        char* mii_index_dir = dirname(index_file_cpy);
+
+        /* create parent dir */
+        int res = mii_recursive_mkdir(mii_index_dir, 0755);
+
+        free(index_file_cpy);
+
+        /* couldn't create index dir */
+        if (res) {
+            mii_error("Error initializing index directory: %s", strerror(errno));
+            return -1;
+        }
+    }
+
     int res = mkdir(_mii_datadir, 0755);
 
     if (res && (errno != EEXIST)) {
@@ -86,7 +142,19 @@ int mii_init() {
         _mii_datafile = mii_join_path(_mii_datadir, "index");
     }
 
-    mii_debug("Initialized mii with cache path %s", _mii_datafile);
+    /* bin directory listings are cached next to the index being written */
+    const char* binfile_base = _mii_system ? _mii_system_datafile : _mii_datafile;
+
+    _mii_binfile = malloc(strlen(binfile_base) + 6);
+    sprintf(_mii_binfile, "%s.bins", binfile_base);
+
+    /* so is the lock which keeps concurrent syncs from writing it at once */
+    _mii_lockfile = malloc(strlen(binfile_base) + 6);
+    sprintf(_mii_lockfile, "%s.lock", binfile_base);
+
+    if (_mii_init_roots()) return -1;
+
+    mii_debug("Initialized mii with cache path %s, %d roots", _mii_datafile, _mii_num_roots);
     return 0;
 }
 
@@ -94,6 +162,18 @@ void mii_free() {
     if (_mii_modulepath) free(_mii_modulepath);
     if (_mii_datadir) free(_mii_datadir);
     if (_mii_datafile) free(_mii_datafile);
+    if (_mii_system_datafile) free(_mii_system_datafile);
+    if (_mii_binfile) free(_mii_binfile);
+    if (_mii_lockfile) free(_mii_lockfile);
+
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        free(_mii_roots[i]);
+        free(_mii_shards[i]);
+    }
+
+    free(_mii_roots);
+    free(_mii_shards);
+    free(_mii_readonly);
 }
 
 int mii_build() {
@@ -102,215 +182,434 @@ int mii_build() {
      * this is equivalent to a sync, but without the import/merge step
      */
 
-    mii_modtable index;
-    mii_modtable_init(&index);
-    int count;
+    int count = 0, held, res = 0;
 
-#if MII_ENABLE_SPIDER
-    if (mii_modtable_spider_gen(&index, _mii_modulepath, &count)) {
-        mii_error("Unexpected failure generating the index with spider!");
-        return -1;
-    }
-#else
-    /* initialize analysis regular expressions */
-    if (mii_analysis_init()) {
+    /* a rebuild was asked for, so it waits its turn instead of reusing another sync */
+    int lock = _mii_lock(1, &held);
+
+#if !MII_ENABLE_SPIDER
+    /* initialize analysis state for each job */
+    if (mii_analysis_init(_mii_jobs)) {
         mii_error("Unexpected failure initializing analysis functions!");
+        _mii_unlock(lock);
         return -1;
     }
 
-    /* generate a partial index from the disk */
-    if (mii_modtable_gen(&index, _mii_modulepath)) {
-        mii_error("Error occurred during index generation, terminating!");
-        return -1;
-    }
+    /* a rebuild lists every bin directory again, as chmod +x leaves the mtime the cache goes by alone */
+    mii_analysis_load_cache(_mii_binfile, 1);
+#endif
 
-    /* perform analysis over the entire index */
-    if (mii_modtable_analysis(&index, &count)) {
-        mii_error("Error occurred during index analysis, terminating!");
-        return -1;
+    /* roots in the system index are left to it. each root has its own shard,
+     * so one which fails keeps its previous shard and the others are still built */
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (!_mii_readonly[i] && _mii_build_root(i, &count)) {
+            mii_warn("Couldn't build the index for %s, continuing with the other roots", _mii_roots[i]);
+            res = -1;
+        }
     }
 
+#if !MII_ENABLE_SPIDER
+    /* a full build visits every module, so directories left unused are gone.
+     * a failed root didn't visit its own, so nothing is pruned then */
+    mii_analysis_save_cache(_mii_binfile, !res);
+    mii_analysis_free();
 #endif
 
+    _mii_unlock(lock);
+
     if (count) {
         mii_info("Finished analysis on %d modules", count);
-    } else {
+    } else if (!res) {
         mii_warn("Didn't analyze any modules. Is the MODULEPATH correct?");
     }
 
-    /* export back to the disk */
-    if (mii_modtable_export(&index, _mii_datafile)) {
-        mii_error("Error occurred during index write, terminating!");
+    return res;
+}
+
+int mii_sync() {
+    /*
+     * SYNC: sychronize the index if necessary
+     */
+
+    int count = 0, num_removed = 0, num_stale = 0, held, res = 0;
+
+    /* shells all sync at login, only one of them crawls.
+     * the others leave, or with --wait take the index it wrote */
+    int lock = _mii_lock(_mii_wait, &held);
+
+    if (held) {
+        if (_mii_wait) {
+            mii_info("Index was synced by another process");
+            _mii_unlock(lock);
+        } else {
+            mii_info("Another sync is running, leaving the index to it");
+        }
+
+        return 0;
+    }
+
+    /* the budget covers the whole sync, the crawl included.
+     * analysis still gets through a first chunk of modules in each root, so every sync makes progress */
+    if (_mii_budget_ms) _mii_deadline = mii_clock_ns() + (int64_t) _mii_budget_ms * 1000000;
+
+    /* roots whose directories all kept their mtimes are up to date without a crawl.
+     * roots in the system index are left to it */
+    int* changed = calloc(_mii_num_roots ? _mii_num_roots : 1, sizeof *changed);
+    int num_changed = 0;
+
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        changed[i] = !_mii_readonly[i] && !_mii_root_current(i);
+        num_changed += changed[i];
+    }
+
+    if (!num_changed) {
+        mii_info("All modules up to date :)");
+        free(changed);
+        _mii_unlock(lock);
+        return 0;
+    }
+
+    /* initialize analysis state for each job */
+    if (mii_analysis_init(_mii_jobs)) {
+        mii_error("Unexpected failure initializing analysis functions!");
+        free(changed);
+        _mii_unlock(lock);
         return -1;
     }
 
-    /* cleanup */
-    mii_modtable_free(&index);
+    mii_analysis_load_cache(_mii_binfile, 0);
 
-#if !MII_ENABLE_SPIDER
+    /* each changed root is synced against its own shard, one which fails is left for the next sync */
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (changed[i] && _mii_sync_root(i, NULL, NULL, &count, &num_removed, &num_stale)) {
+            mii_warn("Couldn't sync the index for %s, continuing with the other roots", _mii_roots[i]);
+            res = -1;
+        }
+    }
+
+    free(changed);
+
+    if (count || num_removed || num_stale) {
+        mii_info("Finished analysis on %d modules", count);
+        if (num_removed) mii_info("Removed %d modules", num_removed);
+        if (num_stale) mii_info("Ran out of time, %d modules are left for the next sync", num_stale);
+    } else if (!res) {
+        mii_info("All modules up to date :)");
+    }
+
+    /* bin directories scanned for every root are kept, including those before a failure */
+    mii_analysis_save_cache(_mii_binfile, 0);
     mii_analysis_free();
-#endif
 
-    return 0;
+    _mii_unlock(lock);
+
+    return res;
 }
 
-int mii_sync() {
+int mii_watch() {
     /*
-     * SYNC: sychronize the index if necessary
+     * WATCH: keep the index up to date as modules and commands change
      */
 
-    mii_modtable index;
-    mii_modtable_init(&index);
+    mii_watcher watcher;
+    int count = 0, num_removed = 0, num_stale = 0, held;
+
+    if (mii_watcher_init(&watcher)) return -1;
 
-    /* initialize analysis regular expressions */
-    if (mii_analysis_init()) {
+    /* changes are applied as they arrive, each only lists the directories involved */
+    if (mii_analysis_init(_mii_jobs)) {
         mii_error("Unexpected failure initializing analysis functions!");
+        mii_watcher_free(&watcher);
         return -1;
     }
 
-    /* generate a partial index from the disk */
-    if (mii_modtable_gen(&index, _mii_modulepath)) {
-        mii_error("Error occurred during index generation, terminating!");
+    mii_analysis_load_cache(_mii_binfile, 0);
+
+    /* shell integration skips its login sync while the pid file is locked, which only lasts as long as the watcher */
+    char* pid_path = mii_join_path(_mii_datadir, "watch.pid");
+    int pid_fd = _mii_watch_lock(pid_path);
+
+    if (pid_fd < 0) {
+        mii_watcher_free(&watcher);
+        mii_analysis_free();
+        free(pid_path);
         return -1;
     }
 
-    /* try and import up-to-date modules from the cache */
-    if (mii_modtable_preanalysis(&index, _mii_datafile)) {
-        mii_warn("Error occurred during index preanalysis, will rebuild the whole cache!");
+    /* being stopped is the usual way out, so the pid file goes with it */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+
+    sa.sa_handler = _mii_watch_signal;
+    sigemptyset(&sa.sa_mask);
+
+    _mii_watch_pid_path = pid_path;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    /* bring the index up to date, watching every directory in it.
+     * the lock is only held while writing, so a sync or build can still run in between */
+    int lock = _mii_lock(1, &held);
+
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (!_mii_readonly[i] && _mii_sync_root(i, NULL, &watcher, &count, &num_removed, &num_stale)) {
+            _mii_unlock(lock);
+            mii_watcher_free(&watcher);
+            mii_analysis_free();
+            _mii_watch_pid_path = NULL;
+            unlink(pid_path);
+            free(pid_path);
+            _mii_unlock(pid_fd);
+            return -1;
+        }
     }
 
-    /* perform analysis over any remaining modules */
-    int count;
+    mii_analysis_save_cache(_mii_binfile, 0);
+    _mii_unlock(lock);
+    mii_info("Watching %d directories for changes", watcher.num_dirs);
 
-    if (mii_modtable_analysis(&index, &count)) {
-        mii_error("Error occurred during index analysis, terminating!");
-        return -1;
-    }
+    /* roots whose last update failed lost the hints of that batch, so they get a full check next */
+    int* full = calloc(_mii_num_roots ? _mii_num_roots : 1, sizeof *full);
 
+    for (;;) {
+        mii_modtable_hints hints;
+        int lost = mii_watcher_wait(&watcher, &hints);
 
-    /* export back to the disk only if modules were analyzed */
-    if (count) {
-        mii_info("Finished analysis on %d modules", count);
+        if (lost < 0) break;
 
-        if (mii_modtable_export(&index, _mii_datafile)) {
-            mii_error("Error occurred during index write, terminating!");
-            return -1;
+        /* lost events or unwatched directories leave only a full check */
+        const mii_modtable_hints* batch = (lost || watcher.incomplete) ? NULL : &hints;
+
+        count = num_removed = 0;
+
+        /* commands made executable leave the mtime of their directory alone, so the cached listing goes */
+        mii_analysis_forget_dirs(hints.bin_dirs, hints.num_bin_dirs);
+
+        lock = _mii_lock(1, &held);
+
+        for (int i = 0; i < _mii_num_roots; ++i) {
+            if (_mii_readonly[i]) continue;
+
+            full[i] = _mii_sync_root(i, full[i] ? NULL : batch, &watcher, &count, &num_removed, &num_stale) != 0;
+
+            if (full[i]) mii_warn("Couldn't update the index for %s, will check all of it on the next change", _mii_roots[i]);
         }
-    } else {
-        mii_info("All modules up to date :)");
+
+        if (count || num_removed) mii_info("Analyzed %d modules, removed %d", count, num_removed);
+
+        mii_analysis_save_cache(_mii_binfile, 0);
+        _mii_unlock(lock);
+
+        mii_modtable_hints_free(&hints);
     }
 
-    /* cleanup */
-    mii_modtable_free(&index);
+    free(full);
+
+    _mii_watch_pid_path = NULL;
+    unlink(pid_path);
+    free(pid_path);
+    _mii_unlock(pid_fd);
+
+    mii_watcher_free(&watcher);
     mii_analysis_free();
 
-    return 0;
+    return -1;
 }
 
-int mii_search_exact(mii_search_result* res, const char* cmd) {
-    mii_modtable index;
-    mii_modtable_init(&index);
+/*
+ * take the pid file of a watcher and write our pid to it
+ * the file stays locked until the watcher exits, however it exits, so a stale file is never mistaken for a watcher
+ * returns the locked descriptor, or -1 if another watcher holds it or it couldn't be written
+ */
+int _mii_watch_lock(const char* pid_path) {
+    struct flock fl;
+    memset(&fl, 0, sizeof fl);
 
-    /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
 
-        if (mii_build()) return -1;
+    int fd = open(pid_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
 
-        mii_info("Trying to import new index..");
+    if (fd < 0) {
+        mii_error("Couldn't open %s: %s", pid_path, strerror(errno));
+        return -1;
+    }
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
-            return -1;
+    if (fcntl(fd, F_SETLK, &fl)) {
+        if (errno == EACCES || errno == EAGAIN) {
+            mii_error("Another watcher is already running (pid %ld)", (long) mii_watching());
+        } else {
+            mii_error("Couldn't lock %s: %s", pid_path, strerror(errno));
         }
+
+        close(fd);
+        return -1;
     }
 
-    /* perform the search */
-    if (mii_modtable_search_exact(&index, cmd, res)) {
-        mii_error("Error occurred during search, terminating!");
+    char pid[32];
+    int len = snprintf(pid, sizeof pid, "%ld\n", (long) getpid());
+
+    if (ftruncate(fd, 0) || write(fd, pid, len) != len) {
+        mii_error("Couldn't write %s: %s", pid_path, strerror(errno));
+        close(fd);
         return -1;
     }
 
-    /* cleanup */
-    mii_modtable_free(&index);
+    return fd;
+}
 
-    return 0;
+/*
+ * remove the pid file of a watcher being stopped, then stop as the signal asked
+ */
+void _mii_watch_signal(int sig) {
+    if (_mii_watch_pid_path) unlink(_mii_watch_pid_path);
+
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-int mii_search_fuzzy(mii_search_result* res, const char* cmd) {
-    mii_modtable index;
-    mii_modtable_init(&index);
+/*
+ * find the running watcher through the lock on its pid file
+ * returns its pid, or 0 if there is none
+ */
+long mii_watching() {
+    char* pid_path = mii_join_path(_mii_datadir, "watch.pid");
+    int fd = open(pid_path, O_RDONLY | O_CLOEXEC);
 
-    /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+    free(pid_path);
 
-        if (mii_build()) return -1;
+    if (fd < 0) return 0;
 
-        mii_info("Trying to import new index..");
+    struct flock fl;
+    memset(&fl, 0, sizeof fl);
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+
+    long pid = (!fcntl(fd, F_GETLK, &fl) && fl.l_type != F_UNLCK) ? (long) fl.l_pid : 0;
+
+    close(fd);
+    return pid;
+}
+
+int mii_search_exact(mii_search_result* res, const char* cmd) {
+    mii_modtable* tables = _mii_load_shards();
+
+    if (!tables) return -1;
+
+    mii_search_result_init(res, cmd);
+
+    /* perform the search */
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (mii_modtable_search_exact(tables + i, cmd, res)) {
+            mii_error("Error occurred during search, terminating!");
+            _mii_free_shards(tables);
             return -1;
         }
     }
 
+    mii_search_result_sort(res);
+
+    /* cleanup */
+    _mii_free_shards(tables);
+
+    return 0;
+}
+
+int mii_search_fuzzy(mii_search_result* res, const char* cmd) {
+    mii_modtable* tables = _mii_load_shards();
+
+    if (!tables) return -1;
+
+    mii_search_result_init(res, cmd);
+
     /* perform the search */
-    if (mii_modtable_search_similar(&index, cmd, res)) {
-        mii_error("Error occurred during search, terminating!");
-        return -1;
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (mii_modtable_search_similar(tables + i, cmd, res)) {
+            mii_error("Error occurred during search, terminating!");
+            _mii_free_shards(tables);
+            return -1;
+        }
     }
 
+    mii_search_result_sort(res);
+
     /* cleanup */
-    mii_modtable_free(&index);
+    _mii_free_shards(tables);
 
     return 0;
 }
 
 int mii_search_info(mii_search_result* res, const char* cmd) {
-    mii_modtable index;
-    mii_modtable_init(&index);
-
-    /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+    mii_modtable* tables = _mii_load_shards();
 
-        if (mii_build()) return -1;
+    if (!tables) return -1;
 
-        mii_info("Trying to import new index..");
+    mii_search_result_init(res, cmd);
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
+    /* the module is loaded from the first root providing it, like the module system does */
+    for (int i = 0; i < _mii_num_roots && !res->num_results; ++i) {
+        if (mii_modtable_search_info(tables + i, cmd, res)) {
+            mii_error("Error occurred during search, terminating!");
+            _mii_free_shards(tables);
             return -1;
         }
     }
 
-    /* perform the search */
-    if (mii_modtable_search_info(&index, cmd, res)) {
-        mii_error("Error occurred during search, terminating!");
-        return -1;
-    }
-
     /* cleanup */
-    mii_modtable_free(&index);
+    _mii_free_shards(tables);
 
     return 0;
 }
 
-int mii_list() {
-    mii_modtable index;
-    mii_modtable_init(&index);
+int mii_compact() {
+    /*
+     * COMPACT: fold the journals back into the index shards
+     */
 
-    /* try and import the cache from the disk */
-    if (mii_modtable_import(&index, _mii_datafile)) {
-        mii_warn("Couldn't import module index, will try and build one now.");
+    int count = 0, held;
+    int lock = _mii_lock(1, &held);
 
-        if (mii_build()) return -1;
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (_mii_readonly[i]) continue;
 
-        mii_info("Trying to import new index..");
+        mii_modtable index;
+        mii_modtable_init(&index);
 
-        if (mii_modtable_import(&index, _mii_datafile)) {
-            mii_error("Failed to import again, giving up..");
+        if (mii_modtable_import(&index, _mii_shards[i]) || mii_modtable_materialize(&index)) {
+            mii_error("Couldn't load the index for %s, try running `mii build`", _mii_roots[i]);
+            mii_modtable_free(&index);
+            _mii_unlock(lock);
+            return -1;
+        }
+
+        if (mii_modtable_export(&index, _mii_shards[i])) {
+            mii_error("Error occurred during index write, terminating!");
+            mii_modtable_free(&index);
+            _mii_unlock(lock);
+            return -1;
+        }
+
+        count += index.num_modules;
+        mii_modtable_free(&index);
+    }
+
+    _mii_unlock(lock);
+
+    mii_info("Compacted %d modules into the index", count);
+
+    return 0;
+}
+
+int mii_list() {
+    mii_modtable* tables = _mii_load_shards();
+
+    if (!tables) return -1;
+
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (mii_modtable_materialize(tables + i)) {
+            mii_error("Couldn't read the module index!");
+            _mii_free_shards(tables);
             return -1;
         }
     }
@@ -322,30 +621,35 @@ int mii_list() {
     if (should_color) {
         code_width = 0;
 
-        for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-            for (mii_modtable_entry* cur = index.buf[i]; cur; cur = cur->next) {
-                int len = strlen(cur->code);
-                if (len > code_width) code_width = len;
-                ++count;
+        for (int r = 0; r < _mii_num_roots; ++r) {
+            for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+                for (mii_modtable_entry* cur = tables[r].buf[i]; cur; cur = cur->next) {
+                    int len = strlen(cur->code);
+                    if (len > code_width) code_width = len;
+                    ++count;
+                }
             }
         }
 
         printf("\033[0;39mIndexed modules (total %d):\n", count);
     }
 
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        for (mii_modtable_entry* cur = index.buf[i]; cur; cur = cur->next) {
-            if (should_color) {
-                printf("    \033[0;39m%-*s    \033[2;37m%s\n", code_width, cur->code, cur->path);
-            } else {
-                printf("%s\n", cur->code);
+    /* list roots in MODULEPATH order */
+    for (int r = 0; r < _mii_num_roots; ++r) {
+        for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+            for (mii_modtable_entry* cur = tables[r].buf[i]; cur; cur = cur->next) {
+                if (should_color) {
+                    printf("    \033[0;39m%-*s    \033[2;37m%s\n", code_width, cur->code, cur->path);
+                } else {
+                    printf("%s\n", cur->code);
+                }
             }
         }
     }
 
     if (should_color) printf("\033[0;39m");
 
-    mii_modtable_free(&index);
+    _mii_free_shards(tables);
     return 0;
 }
 
@@ -371,7 +675,6 @@ int mii_disable() {
 
     if (!disable_fd) {
         mii_error("Couldn't write disable lock: %s\n", strerror(errno));
-        free(disable_path);
         return -1;
     }
 
@@ -396,6 +699,393 @@ int mii_status() {
         printf("enabled\n");
     }
 
+    long pid = mii_watching();
+
+    if (pid) {
+        printf("watch: running (pid %ld)\n", pid);
+    } else {
+        printf("watch: stopped\n");
+    }
+
+    /* one shard per root */
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        mii_index_header header;
+
+        if (!mii_index_read_header(_mii_shards[i], &header)) {
+            printf("index: %s -> %s (generation %llu%s)\n", _mii_roots[i], _mii_shards[i], (unsigned long long) header.generation, _mii_readonly[i] ? ", system" : "");
+        } else {
+            printf("index: %s -> %s (missing)\n", _mii_roots[i], _mii_shards[i]);
+        }
+    }
+
     free(disable_path);
     return 0;
 }
+
+/*
+ * split the MODULEPATH into roots, in order and without duplicates,
+ * and name each root's shard after a hash of its path.
+ * roots with a shard in the system index use it, the rest are kept in the user's overlay
+ */
+int _mii_init_roots() {
+    char* modulepath = mii_strdup(_mii_modulepath);
+    char* saveptr;
+
+    for (char* root = strtok_r(modulepath, ":", &saveptr); root; root = strtok_r(NULL, ":", &saveptr)) {
+        /* "/a/b/" and "/a/b" are the same root */
+        size_t len = strlen(root);
+        while (len > 1 && root[len - 1] == '/') root[--len] = 0;
+
+        int duplicate = 0;
+
+        for (int i = 0; i < _mii_num_roots && !duplicate; ++i) {
+            duplicate = !strcmp(_mii_roots[i], root);
+        }
+
+        if (duplicate) continue;
+
+        _mii_roots = realloc(_mii_roots, (_mii_num_roots + 1) * sizeof *_mii_roots);
+        _mii_shards = realloc(_mii_shards, (_mii_num_roots + 1) * sizeof *_mii_shards);
+        _mii_readonly = realloc(_mii_readonly, (_mii_num_roots + 1) * sizeof *_mii_readonly);
+
+        _mii_roots[_mii_num_roots] = mii_strdup(root);
+        _mii_shards[_mii_num_roots] = NULL;
+        _mii_readonly[_mii_num_roots] = 0;
+
+        if (_mii_system_datafile) {
+            char* system_shard = _mii_shard_path(_mii_system_datafile, root);
+            mii_index_header header;
+
+            if (_mii_system) {
+                _mii_shards[_mii_num_roots] = system_shard;
+            } else if (!mii_index_read_header(system_shard, &header)) {
+                _mii_shards[_mii_num_roots] = system_shard;
+                _mii_readonly[_mii_num_roots] = 1;
+            } else {
+                free(system_shard);
+            }
+        }
+
+        if (!_mii_shards[_mii_num_roots]) _mii_shards[_mii_num_roots] = _mii_shard_path(_mii_datafile, root);
+
+        ++_mii_num_roots;
+    }
+
+    free(modulepath);
+
+    if (!_mii_num_roots) {
+        mii_error("Empty or blank MODULEPATH!");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * get the shard path for a root under an index path
+ */
+char* _mii_shard_path(const char* datafile, const char* root) {
+    char* out = malloc(strlen(datafile) + 18);
+    sprintf(out, "%s.%016llx", datafile, (unsigned long long) XXH64(root, strlen(root), 0));
+    return out;
+}
+
+/*
+ * rebuild the shard for a single root
+ * analysis must be initialized by the caller
+ */
+int _mii_build_root(int root, int* count) {
+    mii_modtable index;
+    mii_modtable_init(&index);
+    int res = -1;
+    int root_count;
+
+    index.num_jobs = _mii_jobs;
+
+#if MII_ENABLE_SPIDER
+    if (mii_modtable_spider_gen(&index, _mii_roots[root], &root_count)) {
+        mii_error("Unexpected failure generating the index with spider!");
+        goto cleanup;
+    }
+#else
+    /* generate a partial index from the disk */
+    if (mii_modtable_gen(&index, _mii_roots[root])) {
+        mii_error("Error occurred during index generation, terminating!");
+        goto cleanup;
+    }
+
+    /* perform analysis over the entire index */
+    if (mii_modtable_analysis(&index, &root_count)) {
+        mii_error("Error occurred during index analysis, terminating!");
+        goto cleanup;
+    }
+#endif
+
+    mii_debug("Analyzed %d modules in %s", root_count, _mii_roots[root]);
+    *count += root_count;
+
+    /* export back to the disk */
+    if (mii_modtable_export(&index, _mii_shards[root])) {
+        mii_error("Error occurred during index write, terminating!");
+        goto cleanup;
+    }
+
+    res = 0;
+
+cleanup:
+    /* cleanup */
+    mii_modtable_free(&index);
+
+    return res;
+}
+
+/*
+ * bring the shard for a single root up to date
+ * analysis must be initialized by the caller
+ * past the sync deadline, modules left to analyze keep their saved results and stay stale
+ */
+int _mii_sync_root(int root, const mii_modtable_hints* hints, mii_watcher* watcher, int* count, int* num_removed, int* num_stale) {
+    mii_modtable index;
+    mii_modtable_init(&index);
+    int res = -1;
+
+    index.num_jobs = _mii_jobs;
+    index.hints = hints;
+    index.deadline = _mii_deadline;
+
+    /* the saved shard lets the crawl skip unchanged directories, and holds the bins of unchanged modules */
+    int rebuild = 0;
+
+    if (mii_modtable_load_cache(&index, _mii_shards[root])) {
+        mii_warn("Couldn't load the index for %s, will rebuild it!", _mii_roots[root]);
+        rebuild = 1;
+    }
+
+    /* generate a partial index from the disk */
+    if (mii_modtable_gen(&index, _mii_roots[root])) {
+        mii_error("Error occurred during index generation, terminating!");
+        goto cleanup;
+    }
+
+    /* try and import up-to-date modules from the cache */
+    if (!rebuild && mii_modtable_preanalysis(&index, _mii_shards[root])) {
+        mii_warn("Couldn't preanalyze the index for %s, will rebuild it!", _mii_roots[root]);
+        rebuild = 1;
+    }
+
+    /* perform analysis over any remaining modules */
+    int root_count;
+
+    if (mii_modtable_analysis(&index, &root_count)) {
+        mii_error("Error occurred during index analysis, terminating!");
+        goto cleanup;
+    }
+
+    /* export back to the disk only if modules were analyzed or removed, directories changed, or there is no shard yet.
+     * small changes go to the journal, larger ones replace the shard */
+    if (root_count || index.num_unchanged || index.num_removed || index.num_changed_dirs || index.num_removed_dirs || rebuild) {
+        mii_debug("Analyzed %d modules in %s, %d removed, %d touched but unchanged", root_count, _mii_roots[root], index.num_removed, index.num_unchanged);
+
+        if ((rebuild || mii_modtable_export_journal(&index, _mii_shards[root])) && mii_modtable_export(&index, _mii_shards[root])) {
+            mii_error("Error occurred during index write, terminating!");
+            goto cleanup;
+        }
+    }
+
+    *count += root_count;
+    *num_removed += index.num_removed;
+    *num_stale += index.num_stale;
+
+    /* a full check watches everything, an update only what it added */
+    if (watcher) _mii_watch_table(watcher, &index, !hints);
+
+    res = 0;
+
+cleanup:
+    /* cleanup, the error paths free the table too */
+    mii_modtable_free(&index);
+
+    return res;
+}
+
+/*
+ * check whether the shard of a root still matches the disk, without crawling the root
+ * a missing or unreadable shard is left to the sync, which reports it
+ */
+int _mii_root_current(int root) {
+    if (access(_mii_shards[root], F_OK)) return 0;
+
+    mii_modtable index;
+    mii_modtable_init(&index);
+
+    /* a corrupt shard isn't current, the sync rebuilds it */
+    int res = !mii_modtable_import(&index, _mii_shards[root]) && !mii_index_verify(&index.index) && mii_modtable_current(&index);
+
+    if (res) mii_debug("%s is up to date", _mii_roots[root]);
+
+    mii_modtable_free(&index);
+
+    return res;
+}
+
+/*
+ * watch the module directories of a synced table and the bin directories of its modules
+ * with all unset, only directories listed from the disk and modules analyzed are watched
+ */
+void _mii_watch_table(mii_watcher* watcher, mii_modtable* table, int all) {
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_dir* dir = table->dirs[i]; dir; dir = dir->next) {
+            if (all || dir->changed) mii_watcher_add(watcher, dir->path, MII_WATCH_MODULES);
+        }
+
+        for (mii_modtable_entry* cur = table->buf[i]; cur; cur = cur->next) {
+            if (!all && !cur->changed) continue;
+
+            for (int j = 0; j < cur->num_bin_dirs; ++j) {
+                mii_watcher_add(watcher, cur->bin_dirs[j], MII_WATCH_BINS);
+            }
+        }
+    }
+}
+
+/*
+ * take the lock on the index being written, which holds off other syncs, builds and watchers
+ * the lock is advisory (fcntl, so it also works over NFS) and released when the process exits.
+ *
+ * returns the locked descriptor. if another process holds the lock, *held is set and
+ * either -1 is returned or, with wait set, the lock is taken once it is released.
+ * an index whose lock can't be opened is written without it
+ */
+int _mii_lock(int wait, int* held) {
+    struct flock fl;
+    memset(&fl, 0, sizeof fl);
+
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+
+    *held = 0;
+
+    int fd = open(_mii_lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        mii_debug("Couldn't open %s, continuing without the lock: %s", _mii_lockfile, strerror(errno));
+        return -1;
+    }
+
+    if (!fcntl(fd, F_SETLK, &fl)) return fd;
+
+    if (errno != EACCES && errno != EAGAIN) {
+        mii_debug("Couldn't lock %s, continuing without the lock: %s", _mii_lockfile, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    *held = 1;
+
+    if (!wait) {
+        close(fd);
+        return -1;
+    }
+
+    mii_debug("Waiting for another process to release %s", _mii_lockfile);
+
+    while (fcntl(fd, F_SETLKW, &fl)) {
+        if (errno == EINTR) continue;
+
+        mii_debug("Couldn't wait for %s, continuing without the lock: %s", _mii_lockfile, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * release a lock taken with _mii_lock, closing the descriptor drops it
+ */
+void _mii_unlock(int fd) {
+    if (fd >= 0) close(fd);
+}
+
+/*
+ * import the shard of every root, in MODULEPATH order
+ * shards which are missing are built on the spot, without touching the other roots
+ * returns NULL on failure
+ */
+mii_modtable* _mii_load_shards() {
+    mii_modtable* tables = malloc(_mii_num_roots * sizeof *tables);
+
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        mii_modtable_init(tables + i);
+    }
+
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        if (!mii_modtable_import(tables + i, _mii_shards[i])) continue;
+
+        /* fall back to the user's overlay if the system shard can't be read */
+        if (_mii_readonly[i]) {
+            mii_warn("Couldn't import the system index for %s, using the user index instead.", _mii_roots[i]);
+
+            free(_mii_shards[i]);
+            _mii_shards[i] = _mii_shard_path(_mii_datafile, _mii_roots[i]);
+            _mii_readonly[i] = 0;
+
+            if (!mii_modtable_import(tables + i, _mii_shards[i])) continue;
+        }
+
+        mii_warn("Couldn't import the module index for %s, will try and build it now.", _mii_roots[i]);
+
+        int count = 0, res, held;
+
+        /* a login sync might be building it already */
+        int lock = _mii_lock(1, &held);
+
+        if (held && !mii_modtable_import(tables + i, _mii_shards[i])) {
+            _mii_unlock(lock);
+            continue;
+        }
+
+#if MII_ENABLE_SPIDER
+        res = _mii_build_root(i, &count);
+#else
+        if (mii_analysis_init(_mii_jobs)) {
+            mii_error("Unexpected failure initializing analysis functions!");
+            _mii_unlock(lock);
+            _mii_free_shards(tables);
+            return NULL;
+        }
+
+        mii_analysis_load_cache(_mii_binfile, 1);
+
+        res = _mii_build_root(i, &count);
+
+        mii_analysis_save_cache(_mii_binfile, 0);
+        mii_analysis_free();
+#endif
+
+        _mii_unlock(lock);
+
+        if (res) {
+            _mii_free_shards(tables);
+            return NULL;
+        }
+
+        mii_info("Trying to import new index..");
+
+        if (mii_modtable_import(tables + i, _mii_shards[i])) {
+            mii_error("Failed to import again, giving up..");
+            _mii_free_shards(tables);
+            return NULL;
+        }
+    }
+
+    return tables;
+}
+
+void _mii_free_shards(mii_modtable* tables) {
+    for (int i = 0; i < _mii_num_roots; ++i) {
+        mii_modtable_free(tables + i);
+    }
+
+    free(tables);
+}
@@ -14,6 +14,10 @@
 
 void mii_option_modulepath(const char* modulepath);
 void mii_option_datadir(const char* datadir);
+void mii_option_system(); /* write the system index (MII_INDEX_FILE) instead of the user's */
+void mii_option_jobs(int jobs); /* threads used to crawl the MODULEPATH and analyze modules */
+void mii_option_budget(int budget_ms); /* time a sync may spend, the modules it doesn't get to are left for the next one */
+void mii_option_wait(); /* a sync finding another one running waits for it and keeps its index, instead of leaving */
 
 int mii_init();
 void mii_free();
@@ -24,6 +28,15 @@ int mii_build();
 /* time-based cache sync, updates out-of-date modules */
 int mii_sync();
 
+/* keep the index up to date as modules change, runs until killed */
+int mii_watch();
+
+/* pid of the running watcher, 0 if there is none */
+long mii_watching();
+
+/* merge journaled changes back into the index */
+int mii_compact();
+
 /* list modules */
 int mii_list();
 
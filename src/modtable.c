@@ -1,19 +1,23 @@
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* statx, d_type */
 
 #include "modtable.h"
 #include "util.h"
 #include "log.h"
 #include "analysis.h"
+#include "pool.h"
 
+#define XXH_STATIC_LINKING_ONLY
 #include "xxhash/xxhash.h"
 
 #if MII_ENABLE_SPIDER
 #include "cjson/cJSON.h"
-#include <unistd.h>
 #endif
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -22,24 +26,95 @@
 #include <stdio.h>
 #include <string.h>
 
-/* should never really need to change. identify the mii_modtable file format */
-static const unsigned char MII_MODTABLE_MAGIC_BYTES[] = { 0xBE, 0xE5 };
-
-int _mii_modtable_parse_from(mii_modtable* p, const char* path, int (*handler)(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp));
 int _mii_modtable_get_target_index(const char* path);
 mii_modtable_entry* _mii_modtable_locate_entry(mii_modtable* p, const char* path);
-
-/* parse handlers */
-int _mii_modtable_parse_handler_import(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp);
-int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp);
+mii_modtable_entry* _mii_modtable_locate_removed(mii_modtable* p, const char* path);
+mii_modtable_entry* _mii_modtable_unlink_entry(mii_modtable* p, const char* path);
+void _mii_modtable_add_removed(mii_modtable* p, const char* path);
+void _mii_modtable_add_module(mii_modtable* p, char* path, char* code, int type, const mii_index_fingerprint* fingerprint);
+void _mii_modtable_fingerprint(mii_modtable* p, const struct stat* st, mii_index_fingerprint* out);
+int _mii_modtable_same_file(const mii_index_fingerprint* a, const mii_index_fingerprint* b);
+void _mii_modtable_entry_free(mii_modtable_entry* e);
+
+/* directory helpers */
+mii_modtable_dir* _mii_modtable_locate_dir(mii_modtable* p, const char* path);
+mii_modtable_dir* _mii_modtable_add_dir(mii_modtable* p, const char* path, int64_t mtime);
+mii_modtable_dir* _mii_modtable_parent_dir(mii_modtable* p, const char* path);
+void _mii_modtable_set_dir_mtime(mii_modtable* p, mii_modtable_dir* dir, int64_t mtime);
+void _mii_modtable_dir_free(mii_modtable_dir* d);
+
+/* fuzzy search over a mapped index */
+typedef struct {
+    mii_modtable* table;
+    mii_search_result* res;
+} _mii_modtable_similar_data;
+
+void _mii_modtable_similar_handler(void* data, const char* name, int distance, const uint32_t* providers, uint32_t num_providers);
+
+/* journal replay */
+int _mii_modtable_journal_handler(void* data, int op, const char* path, const char* code, int type, char** bins, int num_bins, char** parents, int num_parents, char** bin_dirs, const int64_t* bin_dir_mtimes, int num_bin_dirs, const mii_index_fingerprint* fingerprint);
+int _mii_modtable_journal_dir_handler(void* data, int op, const char* path, int64_t mtime);
+
+/* watcher hints */
+int _mii_modtable_hinted(char** list, int num, const char* path);
+int _mii_modtable_bin_dirs_changed(mii_modtable* p, const mii_modtable_entry* cached);
+
+/* string list helpers */
+char** _mii_modtable_copy_strings(char** strs, int num);
+int64_t* _mii_modtable_copy_mtimes(const int64_t* mtimes, int num);
+void _mii_modtable_copy_results(mii_modtable_entry* mod, const mii_modtable_entry* cached);
+
+/* search helpers */
+void _mii_modtable_add_index_result(mii_modtable* p, mii_search_result* res, uint32_t module, const char* bin, int distance);
 
 /* mii_modtable generation */
-int _mii_modtable_gen_recursive(mii_modtable* p, const char* root);
-int _mii_modtable_gen_recursive_sub(mii_modtable* p, const char* root, const char* prefix);
+typedef struct {
+    mii_modtable* table;
+    const char* root;
+    char* prefix;
+    struct stat st;
+} _mii_modtable_crawl_task;
+
+int _mii_modtable_gen_recursive(mii_modtable* p, mii_pool* pool, const char* root);
+int _mii_modtable_gen_recursive_sub(mii_modtable* p, mii_pool_worker* w, const char* root, const char* prefix, const struct stat* dir_st);
+int _mii_modtable_gen_cached(mii_modtable* p, mii_pool_worker* w, const char* root, const char* prefix, const mii_modtable_dir* cached);
+int _mii_modtable_gen_subdir(mii_modtable* p, mii_pool_worker* w, const char* root, const char* prefix, const struct stat* st);
+void _mii_modtable_queue_dir(mii_modtable* p, mii_pool* pool, mii_pool_worker* w, const char* root, const char* prefix, const struct stat* st);
+void _mii_modtable_crawl_task_run(mii_pool_worker* w, void* arg);
+
+/* per-worker filesystem batches */
+void _mii_modtable_batches_init(mii_modtable* p, int num);
+void _mii_modtable_batches_free(mii_modtable* p);
+
+/* up to date check, directories and modulefiles are stat'ed a batch at a time */
+typedef struct {
+    mii_batch batch;
+    char* paths[MII_BATCH_SIZE];
+    mii_index_fingerprint fingerprints[MII_BATCH_SIZE]; /* only the mtime is compared for directories */
+    int modules[MII_BATCH_SIZE];
+    int num, changed;
+} _mii_modtable_check;
+
+void _mii_modtable_check_dir(_mii_modtable_check* c, const char* path, int64_t mtime);
+void _mii_modtable_check_module(_mii_modtable_check* c, const char* path, const mii_index_fingerprint* fingerprint);
+void _mii_modtable_check_path(_mii_modtable_check* c, const char* path, const mii_index_fingerprint* fingerprint, int module);
+void _mii_modtable_check_flush(_mii_modtable_check* c);
+
+/* mii_modtable analysis */
+typedef struct {
+    mii_modtable* table;
+    mii_modtable_entry** entries;
+    int num_entries;
+} _mii_modtable_analysis_chunk;
+
+void _mii_modtable_analyze_chunk(mii_modtable* p, int worker, mii_modtable_entry** entries, int num);
+void _mii_modtable_analysis_task(mii_pool_worker* w, void* arg);
 
 /* initialize an empty mii_modtable */
 void mii_modtable_init(mii_modtable* out) {
     memset(out, 0, sizeof *out);
+    out->num_jobs = 1;
+    pthread_mutex_init(&out->lock, NULL);
     mii_debug("Initialized empty mii_modtable, hash modulus %d", MII_MODTABLE_HASHTABLE_WIDTH);
 }
 
@@ -55,26 +130,42 @@ void mii_modtable_free(mii_modtable* p) {
         mii_modtable_entry* cur = p->buf[i];
 
         while (cur) {
-            free(cur->code);
-            free(cur->path);
+            tmp = cur->next;
 
-            for (int j = 0; j < cur->num_bins; ++j) {
-                free(cur->bins[j]);
+            /* imported entries only borrow from the mapped index */
+            if (!p->imported || cur < p->imported || cur >= p->imported + p->index.num_modules) {
+                _mii_modtable_entry_free(cur);
             }
 
-            for (int j = 0; j < cur->num_parents; ++j) {
-                free(cur->parents[j]);
-            }
+            cur = tmp;
+        }
 
-            free(cur->bins);
-            if (cur->num_parents > 0) free(cur->parents);
+        for (cur = p->removed[i]; cur; cur = tmp) {
             tmp = cur->next;
+            _mii_modtable_entry_free(cur);
+        }
 
-            free(cur);
-            cur = tmp;
+        for (mii_modtable_dir* dir = p->dirs[i], *next; dir; dir = next) {
+            next = dir->next;
+            _mii_modtable_dir_free(dir);
         }
     }
 
+    if (p->cache) {
+        mii_modtable_free(p->cache);
+        free(p->cache);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+
+    if (p->index.base) {
+        free(p->imported);
+        free(p->imported_refs);
+        free(p->imported_bin_dirs);
+        free(p->imported_bin_dir_mtimes);
+        mii_index_close(&p->index);
+    }
+
     memset(p, 0, sizeof *p);
 }
 
@@ -94,13 +185,41 @@ int mii_modtable_gen(mii_modtable* p, char* modulepath) {
     }
 
     p->modulepath = mii_strdup(modulepath);
+    p->crawl_time = time(NULL);
+
+    /* split modulepath into roots, recursively crawl each.
+     * with several jobs, directories are crawled as tasks on a thread pool instead */
+    mii_pool pool, *crawl_pool = NULL;
+
+    _mii_modtable_batches_init(p, p->num_jobs);
+
+    if (p->num_jobs > 1) {
+        mii_pool_init(&pool, p->num_jobs);
+        crawl_pool = &pool;
+    }
 
-    /* split modulepath into roots, recursively crawl each */
     for (char* root = strtok(p->modulepath, ":"); root; root = strtok(NULL, ":")) {
-        _mii_modtable_gen_recursive(p, root);
+        _mii_modtable_gen_recursive(p, crawl_pool, root);
+    }
+
+    if (crawl_pool) {
+        mii_pool_run(crawl_pool);
+        mii_pool_free(crawl_pool);
+    }
+
+    _mii_modtable_batches_free(p);
+
+    /* cached directories the crawl didn't reach are gone */
+    if (p->cache) {
+        for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+            for (mii_modtable_dir* dir = p->cache->dirs[i]; dir; dir = dir->next) {
+                if (!dir->visited && !dir->removed) ++p->num_removed_dirs;
+            }
+        }
     }
 
-    mii_debug("Found %d modules", p->num_modules);
+    mii_debug("Found %d modules, reused %d of %d directory listings", p->num_modules, p->num_reused_dirs, p->num_dirs);
+    mii_debug("Stat'ed %d entries relative to their directory instead of by full path, skipped %d by their listed type", p->num_relative_stats, p->num_stats_skipped);
 
     /* after gen, every module requires analysis */
     p->modules_requiring_analysis = p->num_modules;
@@ -110,538 +229,1335 @@ int mii_modtable_gen(mii_modtable* p, char* modulepath) {
 
 /*
  * import a mii_modtable from the disk
+ * the index is only mapped here, entries are built on demand by mii_modtable_materialize().
+ * journaled changes are small, so they are loaded into the hashtable straight away
  */
 int mii_modtable_import(mii_modtable* p, const char* path) {
+    if (p->num_modules || p->index.base) {
+        mii_error("Table already has modules present. Will not import over it!\n");
+        return -1;
+    }
+
+    if (mii_index_open(&p->index, path)) return -1;
+
+    /* replay changes made since the index was written */
+    if (mii_index_journal_read(path, p->index.header->generation, _mii_modtable_journal_handler, _mii_modtable_journal_dir_handler, p)) {
+        mii_warn("Couldn't replay the index journal, results may be out of date");
+    }
+
     /* consider imported cache to be current */
     p->analysis_complete = 1;
 
-    return _mii_modtable_parse_from(p, path, _mii_modtable_parse_handler_import);
+    return 0;
 }
 
 /*
- * perform pre-analysis
- *
- * pre-fills module bins if they are still up to date
+ * fill the hashtable from an imported index
+ * searches which can be answered from the index directly skip this
  */
-int mii_modtable_preanalysis(mii_modtable* p, const char* path) {
-    return _mii_modtable_parse_from(p, path, _mii_modtable_parse_handler_preanalysis);
-}
+int mii_modtable_materialize(mii_modtable* p) {
+    if (!p->index.base || p->imported) return 0;
 
-/*
- * perform analysis
- * reads any modulefiles that require analysis
- *
- * number of modules analyzed saved in *num if non-NULL
- */
-int mii_modtable_analysis(mii_modtable* p, int* num) {
-    mii_modtable_entry* cur;
-    int count = 0;
+    const mii_index* index = &p->index;
 
-    if (!p->modules_requiring_analysis) {
-        p->analysis_complete = 1;
-        if (num) *num = 0;
-        return 0;
+    if (mii_index_verify(index) || mii_index_decode_strings(&p->index)) return -1;
+
+    /* resolve every string reference in one pass, the strings themselves stay with the index */
+    p->imported_refs = malloc(index->num_refs * sizeof *p->imported_refs);
+
+    for (uint32_t i = 0; i < index->num_refs; ++i) {
+        p->imported_refs[i] = (char*) mii_index_string(&p->index, p->index.refs[i], NULL);
     }
 
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        cur = p->buf[i];
+    p->imported_bin_dirs = malloc((index->num_bin_dirs ? index->num_bin_dirs : 1) * sizeof *p->imported_bin_dirs);
+    p->imported_bin_dir_mtimes = malloc((index->num_bin_dirs ? index->num_bin_dirs : 1) * sizeof *p->imported_bin_dir_mtimes);
 
-        while (cur) {
-            if (!cur->analysis_complete) {
-                /* need to perform analysis on this module */
+    for (uint32_t i = 0; i < index->num_bin_dirs; ++i) {
+        p->imported_bin_dirs[i] = (char*) mii_index_string(&p->index, index->bin_dirs[i].path, NULL);
+        p->imported_bin_dir_mtimes[i] = index->bin_dirs[i].mtime;
+    }
 
-                if (!mii_analysis_run(cur->path, cur->type, &cur->bins, &cur->num_bins)) {
-                    mii_debug("analysis for %s : %d bins", cur->path, cur->num_bins);
+    /* entries are allocated in a single block */
+    p->imported = malloc(index->num_modules * sizeof *p->imported);
 
-                    cur->num_parents = 0;
-                    cur->analysis_complete = 1;
-                    ++count;
-                }
-            }
+    for (uint32_t i = 0; i < index->num_modules; ++i) {
+        const mii_index_module* mod = p->index.modules + i;
+        mii_modtable_entry* new_entry = p->imported + i;
 
-            cur = cur->next;
+        if ((uint64_t) mod->bins + mod->num_bins > index->num_refs || (uint64_t) mod->parents + mod->num_parents > index->num_refs
+                || (uint64_t) mod->bin_dirs + mod->num_bin_dirs > index->num_bin_dirs) {
+            mii_error("Couldn't materialize index: module %u has references out of range", i);
+            return -1;
         }
+
+        new_entry->path = (char*) mii_index_string(&p->index, mod->path, NULL);
+
+        /* skip modules replaced or removed by the journal */
+        if (_mii_modtable_locate_entry(p, new_entry->path) || _mii_modtable_locate_removed(p, new_entry->path)) continue;
+
+        new_entry->code = (char*) mii_index_string(&p->index, mod->code, NULL);
+        new_entry->type = mod->type;
+        new_entry->bins = p->imported_refs + mod->bins;
+        new_entry->num_bins = mod->num_bins;
+        new_entry->parents = p->imported_refs + mod->parents;
+        new_entry->num_parents = mod->num_parents;
+        new_entry->bin_dirs = p->imported_bin_dirs + mod->bin_dirs;
+        new_entry->bin_dir_mtimes = p->imported_bin_dir_mtimes + mod->bin_dirs;
+        new_entry->num_bin_dirs = mod->num_bin_dirs;
+        new_entry->fingerprint = mod->fingerprint;
+        new_entry->previous = NULL;
+        new_entry->analysis_complete = 1;
+        new_entry->changed = 0;
+        new_entry->stale = 0;
+
+        int target_index = _mii_modtable_get_target_index(new_entry->path);
+
+        new_entry->next = p->buf[target_index];
+        p->buf[target_index] = new_entry;
+        ++p->num_modules;
+
+        mii_debug("Imported module: path %s, code %s, %d bins", new_entry->path, new_entry->code, new_entry->num_bins);
     }
 
-    if (num) *num = count;
+    /* directories replaced or removed by the journal are already present */
+    for (uint32_t i = 0; i < index->num_dirs; ++i) {
+        const char* path = mii_index_string(&p->index, index->dirs[i].path, NULL);
 
-    p->modules_requiring_analysis = 0;
-    p->analysis_complete = 1;
+        if (!_mii_modtable_locate_dir(p, path)) _mii_modtable_add_dir(p, path, index->dirs[i].mtime);
+    }
 
     return 0;
 }
 
 /*
- * export a mii_modtable to disk
+ * load the saved index for a table about to be generated
+ * the crawl lists unchanged directories from it instead of the disk, and
+ * preanalysis takes the bins of unchanged modules from it
  */
-int mii_modtable_export(mii_modtable* p, const char* path) {
-    FILE* f = fopen(path, "wb");
+int mii_modtable_load_cache(mii_modtable* p, const char* path) {
+    mii_modtable* cache = malloc(sizeof *cache);
+    mii_modtable_init(cache);
 
-    if (!f) {
-        mii_error("Couldn't open %s for writing: %s\n", path, strerror(errno));
+    if (mii_modtable_import(cache, path) || mii_modtable_materialize(cache)) {
+        mii_modtable_free(cache);
+        free(cache);
         return -1;
     }
 
-    mii_debug("Exporting %d modules to %s", p->num_modules, path);
-
-    /* write magic sequence */
-    fwrite(MII_MODTABLE_MAGIC_BYTES, sizeof MII_MODTABLE_MAGIC_BYTES, 1, f);
-
-    /* write number of expected modules */
-    fwrite(&p->num_modules, sizeof p->num_modules, 1, f);
-
-    /* write each module entry */
+    /* link each module and directory to the listing of its parent */
     for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
-
-        while(cur) {
-            /* don't write modules that analysis failed for */
-            if (!cur->analysis_complete) {
-                cur = cur->next;
-                continue;
-            }
-
-            /* write path size and data */
-            int path_len = strlen(cur->path);
-            fwrite(&path_len, sizeof path_len, 1, f);
-            fwrite(cur->path, 1, path_len, f);
+        for (mii_modtable_entry* cur = cache->buf[i]; cur; cur = cur->next) {
+            mii_modtable_dir* parent = _mii_modtable_parent_dir(cache, cur->path);
 
-            /* write code size and data */
-            int code_len = strlen(cur->code);
-            fwrite(&code_len, sizeof code_len, 1, f);
-            fwrite(cur->code, 1, code_len, f);
+            if (!parent) continue;
 
-            /* write timestamp */
-            fwrite(&cur->timestamp, sizeof cur->timestamp, 1, f);
+            if (parent->num_modules == parent->max_modules) {
+                parent->max_modules = parent->max_modules ? parent->max_modules * 2 : 8;
+                parent->modules = realloc(parent->modules, parent->max_modules * sizeof *parent->modules);
+            }
 
-            /* write number of bins */
-            fwrite(&cur->num_bins, sizeof cur->num_bins, 1, f);
+            parent->modules[parent->num_modules++] = cur;
+        }
 
-            /* write each bin length and data */
-            for (int j = 0; j < cur->num_bins; ++j) {
-                int bin_len = strlen(cur->bins[j]);
-                fwrite(&bin_len, sizeof bin_len, 1, f);
-                fwrite(cur->bins[j], 1, bin_len, f);
-            }
+        for (mii_modtable_dir* dir = cache->dirs[i]; dir; dir = dir->next) {
+            mii_modtable_dir* parent = _mii_modtable_parent_dir(cache, dir->path);
 
-            /* write number of parents */
-            fwrite(&cur->num_parents, sizeof cur->num_parents, 1, f);
+            if (!parent || dir->removed) continue;
 
-            /* write parent codes size and data (if any) */
-            for (int j = 0; j < cur->num_parents; ++j) {
-                int parent_len = strlen(cur->parents[j]);
-                fwrite(&parent_len, sizeof parent_len, 1, f);
-                fwrite(cur->parents[j], 1, parent_len, f);
+            if (parent->num_subdirs == parent->max_subdirs) {
+                parent->max_subdirs = parent->max_subdirs ? parent->max_subdirs * 2 : 8;
+                parent->subdirs = realloc(parent->subdirs, parent->max_subdirs * sizeof *parent->subdirs);
             }
 
-            cur = cur->next;
+            parent->subdirs[parent->num_subdirs++] = dir;
         }
     }
 
-    /* all done. close the fd */
-    fclose(f);
+    p->cache = cache;
     return 0;
 }
 
 /*
- * search for exact bin matches
+ * check whether an imported table still matches the disk, without crawling or materializing it
+ *
+ * every directory crawled and every bin directory scanned must still have its saved mtime, and
+ * every modulefile its saved fingerprint, as writing a file in place leaves its directory alone.
+ * adding, removing or renaming a module changes the mtime of its directory, so removed modules
+ * are caught too.
+ * returns nonzero if the table is up to date
  */
-int mii_modtable_search_exact(mii_modtable* p, const char* cmd, mii_search_result* res) {
-    if (!p->analysis_complete) return -1;
+int mii_modtable_current(mii_modtable* p) {
+    const mii_index* index = &p->index;
 
-    mii_search_result_init(res, cmd);
+    if (!index->base || !index->dirs) return 0;
 
-    mii_debug("Searching for bin \"%s\"..", cmd);
+    _mii_modtable_check c;
+    memset(&c, 0, sizeof c);
+    mii_batch_init(&c.batch);
 
-    /* walk through the table and search for exact matches */
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+    char* buf = malloc(MII_INDEX_STRING_MAX);
 
-        while (cur) {
-            for (int j = 0; j < cur->num_bins; ++j) {
-                if (!strcmp(cur->bins[j], cmd)) {
-                    /* show different parents as different results */
-                    for (int k = 0; k < cur->num_parents; ++k) {
-                        mii_search_result_add(res, cur->code, cmd, 0, cur->parents[k]);
-                    }
+    /* directories and modules the journal replaced are checked as journaled */
+    for (uint32_t i = 0; i < index->num_dirs && !c.changed; ++i) {
+        const char* path = mii_index_string(index, index->dirs[i].path, buf);
 
-                    /* if no parents, send null */
-                    if (cur->num_parents == 0) {
-                        mii_search_result_add(res, cur->code, cmd, 0, NULL);
-                    }
-                }
-            }
+        if (!_mii_modtable_locate_dir(p, path)) _mii_modtable_check_dir(&c, path, index->dirs[i].mtime);
+    }
 
-            cur = cur->next;
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH && !c.changed; ++i) {
+        for (mii_modtable_dir* dir = p->dirs[i]; dir && !c.changed; dir = dir->next) {
+            if (!dir->removed) _mii_modtable_check_dir(&c, dir->path, dir->mtime);
         }
     }
 
-    mii_search_result_sort(res);
+    int journaled = p->num_modules || p->num_removed;
 
-    return 0;
-}
-
-/*
- * search for similar bin matches
- */
-int mii_modtable_search_similar(mii_modtable* p, const char* cmd, mii_search_result* res) {
-    if (!p->analysis_complete) return -1;
+    for (uint32_t i = 0; i < index->num_modules && !c.changed; ++i) {
+        const mii_index_module* mod = index->modules + i;
 
-    mii_search_result_init(res, cmd);
+        if ((uint64_t) mod->bin_dirs + mod->num_bin_dirs > index->num_bin_dirs) {
+            c.changed = 1;
+            break;
+        }
 
-    mii_debug("Searching for bins similar to \"%s\"..", cmd);
+        if (journaled) {
+            const char* path = mii_index_string(index, mod->path, buf);
+            if (_mii_modtable_locate_entry(p, path) || _mii_modtable_locate_removed(p, path)) continue;
+        }
 
-    /* walk through the table and search for exact matches */
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+        _mii_modtable_check_module(&c, mii_index_string(index, mod->path, buf), &mod->fingerprint);
 
-        while (cur) {
-            for (int j = 0; j < cur->num_bins; ++j) {
-                int dist = mii_levenshtein_distance(cmd, cur->bins[j]); 
+        for (uint32_t j = 0; j < mod->num_bin_dirs; ++j) {
+            const mii_index_dir* dir = index->bin_dirs + mod->bin_dirs + j;
+            _mii_modtable_check_dir(&c, mii_index_string(index, dir->path, buf), dir->mtime);
+        }
+    }
 
-                if (dist < MII_MODTABLE_DISTANCE_THRESHOLD) {
-                    /* show different parents as different results */
-                    for (int k = 0; k < cur->num_parents; ++k) {
-                        mii_search_result_add(res, cur->code, cur->bins[j], dist, cur->parents[k]);
-                    }
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH && !c.changed; ++i) {
+        for (mii_modtable_entry* cur = p->buf[i]; cur && !c.changed; cur = cur->next) {
+            _mii_modtable_check_module(&c, cur->path, &cur->fingerprint);
 
-                    /* if no parents, send null */
-                    if (cur->num_parents == 0) {
-                        mii_search_result_add(res, cur->code, cur->bins[j], dist, NULL);
-                    }
-                }
+            for (int j = 0; j < cur->num_bin_dirs; ++j) {
+                _mii_modtable_check_dir(&c, cur->bin_dirs[j], cur->bin_dir_mtimes[j]);
             }
-
-            cur = cur->next;
         }
     }
 
-    mii_search_result_sort(res);
+    _mii_modtable_check_flush(&c);
 
-    return 0;
+    for (int i = 0; i < MII_BATCH_SIZE; ++i) {
+        free(c.paths[i]);
+    }
+
+    free(buf);
+    mii_batch_free(&c.batch);
+
+    return !c.changed;
 }
 
 /*
- * search for all commands provided by a module
+ * queue a directory for the up to date check, which fails if its mtime changed
+ * directories which couldn't be reached count as mtime 0, as bin directories record them
  */
-int mii_modtable_search_info(mii_modtable* p, const char* code, mii_search_result* res) {
-    if (!p->analysis_complete) return -1;
-
-    mii_search_result_init(res, code);
+void _mii_modtable_check_dir(_mii_modtable_check* c, const char* path, int64_t mtime) {
+    mii_index_fingerprint fingerprint = { mtime, 0, 0, 0 };
 
-    /* walk through the table and search for exact matches */
-    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
-        mii_modtable_entry* cur = p->buf[i];
+    _mii_modtable_check_path(c, path, &fingerprint, 0);
+}
 
-        while (cur) {
-            if (!strcmp(cur->code, code)) {
-                for (int j = 0; j < cur->num_bins; ++j) {
-                    /* parent modules are not important here */
-                    mii_search_result_add(res, cur->code, cur->bins[j], 0, NULL);
-                }
+/*
+ * queue a modulefile for the up to date check, which fails if it changed or is gone
+ */
+void _mii_modtable_check_module(_mii_modtable_check* c, const char* path, const mii_index_fingerprint* fingerprint) {
+    _mii_modtable_check_path(c, path, fingerprint, 1);
+}
 
-                break;
-            }
+/*
+ * queue a path for the up to date check, an unsettled one fails it right away
+ */
+void _mii_modtable_check_path(_mii_modtable_check* c, const char* path, const mii_index_fingerprint* fingerprint, int module) {
+    if (c->changed) return;
 
-            cur = cur->next;
-        }
+    if (fingerprint->mtime == MII_MODTABLE_MTIME_UNSETTLED) {
+        c->changed = 1;
+        return;
     }
 
-    return 0;
-}
+    /* path slots are kept between batches, and only grow */
+    size_t len = strlen(path) + 1;
 
-/*
- * recursively walk a root and add modules to the hashtable
- */
-int _mii_modtable_gen_recursive(mii_modtable* p, const char* root) {
-    return _mii_modtable_gen_recursive_sub(p, root, NULL);
+    c->paths[c->num] = realloc(c->paths[c->num], len);
+    memcpy(c->paths[c->num], path, len);
+    c->fingerprints[c->num] = *fingerprint;
+    c->modules[c->num++] = module;
+
+    if (c->num == MII_BATCH_SIZE) _mii_modtable_check_flush(c);
 }
 
 /*
- * subroutine for _mii_modtable_gen_recursive which allows for recursively
- * computing the module relative paths (and the loading codes)
+ * stat the queued paths of an up to date check
  */
-int _mii_modtable_gen_recursive_sub(mii_modtable* p, const char* root, const char* prefix) {
-    char* dir_path = mii_join_path(root, prefix);
-    DIR* d = opendir(dir_path);
+void _mii_modtable_check_flush(_mii_modtable_check* c) {
+    struct stat st[MII_BATCH_SIZE];
+    int errs[MII_BATCH_SIZE];
 
-    struct dirent* dp;
-    struct stat st;
+    if (!c->num || c->changed) return;
 
-    int result = 0;
+    mii_batch_stat(&c->batch, AT_FDCWD, c->paths, c->num, st, errs);
 
-    if (!d) {
-        free(dir_path);
-        return -1;
-    }
+    for (int i = 0; i < c->num; ++i) {
+        const mii_index_fingerprint* saved = c->fingerprints + i;
+        int64_t mtime = errs[i] ? 0 : (int64_t) st[i].st_mtim.tv_sec * 1000000000 + st[i].st_mtim.tv_nsec;
 
-    while ((dp = readdir(d))) {
-        if (dp->d_name[0] == '.') continue;
+        int changed = (mtime != saved->mtime);
 
-        /* compute the absolute file path */
-        char* abs_path = mii_join_path(dir_path, dp->d_name);
+        if (c->modules[i]) {
+            changed |= errs[i] || (uint64_t) st[i].st_size != saved->size || (uint64_t) st[i].st_ino != saved->inode;
+        }
 
-        /* stat the type */
-        if (stat(abs_path, &st)) {
-            mii_warn("Couldn't stat %s: %s", abs_path, strerror(errno));
-            free(abs_path);
-            continue;
+        if (changed) {
+            mii_debug("%s changed since the last sync", c->paths[i]);
+            c->changed = 1;
+            break;
         }
+    }
 
-        char* rel_path = mii_join_path(prefix, dp->d_name);
+    c->num = 0;
+}
 
-        /* check for normal files (likely modules) */
-        if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
-            /* parse the relative path to get the module type and code */
-            int rel_len = strlen(rel_path);
-            int mod_type = MII_MODTABLE_MODTYPE_TCL; /* assume tcl unless we detect lmod */
+/*
+ * perform pre-analysis
+ *
+ * pre-fills module bins if they are still up to date.
+ * a module is up to date if neither its file nor any bin directory it was analyzed with have changed
+ */
+int mii_modtable_preanalysis(mii_modtable* p, const char* path) {
+    /* bring in the saved index with its journal applied, unless the crawl already did */
+    if (!p->cache && mii_modtable_load_cache(p, path)) return -1;
 
-            if (strlen(rel_path) > 4 && !strcmp(rel_path + rel_len - 4, ".lua")) {
-                /* mutate the rel_path in place for the code, we don't need it anymore anyway */
-                rel_path[rel_len - 4] = 0;
-                mod_type = MII_MODTABLE_MODTYPE_LMOD;
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_entry* cached = p->cache->buf[i]; cached; cached = cached->next) {
+            /* locate any matching modules and check if they are up to date.
+             * if so, then prefill the binary list.
+             * otherwise, leave it NULL so it gets regenerated in analysis. */
+            mii_modtable_entry* mod = _mii_modtable_locate_entry(p, cached->path);
+
+            if (!mod) {
+                /* the module is gone from the disk */
+                _mii_modtable_add_removed(p, cached->path);
+                continue;
             }
 
-            mii_debug("Found module %s at %s", rel_path, abs_path);
-
-            /* insert the new module in */
-            mii_modtable_entry* new_module = malloc(sizeof *new_module);
+            if (mod->analysis_complete) continue;
 
-            new_module->path = abs_path;
-            new_module->code = rel_path; /* rel_path was mutated to become the code */
-            new_module->type = mod_type;
-            new_module->timestamp = st.st_mtime;
-            new_module->bins = NULL;
-            new_module->num_bins = 0;
-            new_module->analysis_complete = 0;
+            /* modulefiles a watcher saw written in place kept their directory's listing, so the
+             * fingerprint they were crawled with is stale */
+            int hinted = p->hints && _mii_modtable_hinted(p->hints->modules, p->hints->num_modules, mod->path);
 
-            int target_index = _mii_modtable_get_target_index(abs_path);
+            if (hinted) {
+                struct stat st;
+                if (!mii_batch_stat_at(AT_FDCWD, mod->path, &st)) _mii_modtable_fingerprint(p, &st, &mod->fingerprint);
+            }
 
-            new_module->next = p->buf[target_index];
-            p->buf[target_index] = new_module;
+            /* commands installed into an existing bin directory: analyze again.
+             * unchanged directories come from the bin directory cache, so only the changed ones are listed */
+            if (_mii_modtable_bin_dirs_changed(p, cached)) continue;
 
-            /* increment the counter */
-            ++p->num_modules;
+            if (hinted || !_mii_modtable_same_file(&mod->fingerprint, &cached->fingerprint)) {
+                /* copies and publishes touch files without changing them,
+                 * so analysis first checks the contents against the saved hash */
+                if (cached->fingerprint.hash) mod->previous = cached;
+                continue;
+            }
 
-            /* skip the other checks and cleanup */
-            continue;
-        }
+            mod->fingerprint.hash = cached->fingerprint.hash;
+            _mii_modtable_copy_results(mod, cached);
 
-        /* add if module, recurse if directory */
-        if (S_ISDIR(st.st_mode)) {
-            result |= _mii_modtable_gen_recursive_sub(p, root, rel_path);
+            --p->modules_requiring_analysis;
         }
-
-        /*
-         * only free these if entry is a non-module, otherwise
-         * ownership is transferred to the module entry
-         */
-        free(rel_path);
-        free(abs_path);
     }
 
-    closedir(d);
-    free(dir_path);
-    return result;
+    return 0;
 }
 
 /*
- * generic function for parsing saved modtables
- * <handler> is called for each imported module with allocated module info
- * if the handler returns nonzero this function is interrupted and returns immediately
+ * perform analysis
+ * reads any modulefiles that require analysis
+ *
+ * number of modules analyzed saved in *num if non-NULL
  */
-int _mii_modtable_parse_from(mii_modtable* p, const char* path, int (*handler)(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp)) {
-    int res, num_modules;
-
-    res = 0;
-    FILE* f = fopen(path, "rb");
-
-    /* TODO: add error checking for unexpected EOF */
-
-    if (!f) {
-        mii_error("Couldn't open %s for reading: %s", path, strerror(errno));
-        return -1;
-    }
-
-    /* verify magic bytes */
-    unsigned char magic_seq[sizeof MII_MODTABLE_MAGIC_BYTES]; /* sneaky array width copy ;) */
+int mii_modtable_analysis(mii_modtable* p, int* num) {
+    int count = 0;
 
-    if (fread(magic_seq, sizeof magic_seq, 1, f) != 1) {
-        goto unexpected_eof;
+    if (!p->modules_requiring_analysis) {
+        p->analysis_complete = 1;
+        if (num) *num = 0;
+        return 0;
     }
 
-    if (memcmp(magic_seq, MII_MODTABLE_MAGIC_BYTES, sizeof magic_seq)) {
-        mii_error("Couldn't parse from %s: bad magic sequence", path);
-        fclose(f);
-        return -1;
-    }
+    /* gather the modules which need analysis */
+    mii_modtable_entry** pending = malloc(p->num_modules * sizeof *pending);
+    int num_pending = 0;
 
-    /* try and bring in some modules */
-    if (fread(&num_modules, sizeof num_modules, 1, f) != 1) {
-        goto unexpected_eof;
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+            if (!cur->analysis_complete) pending[num_pending++] = cur;
+        }
     }
 
-    for (int i = 0; i < num_modules; ++i) {
-        /* read module path */
-        int mod_path_size;
+    /* with several jobs each chunk of modules is a task on a thread pool, small enough to keep every worker busy.
+     * tasks only write to their own entries, so the table needs no locking */
+    int jobs = mii_min(p->num_jobs, mii_analysis_num_workers());
 
-        if (fread(&mod_path_size, sizeof mod_path_size, 1, f) != 1) {
-            goto unexpected_eof;
-        }
+    _mii_modtable_batches_init(p, jobs);
 
-        char* mod_path = malloc(mod_path_size + 1);
+    if (jobs > 1) {
+        int chunk_size = mii_max(1, mii_min(MII_BATCH_SIZE, num_pending / (jobs * 4)));
+        int num_chunks = (num_pending + chunk_size - 1) / chunk_size;
 
-        if (fread(mod_path, 1, mod_path_size, f) != mod_path_size) {
-            goto unexpected_eof;
-        }
+        _mii_modtable_analysis_chunk* chunks = malloc(num_chunks * sizeof *chunks);
 
-        mod_path[mod_path_size] = 0;
+        mii_pool pool;
+        mii_pool_init(&pool, jobs);
 
-        /* read module code */
-        int mod_code_size;
+        for (int i = 0; i < num_chunks; ++i) {
+            chunks[i].table = p;
+            chunks[i].entries = pending + i * chunk_size;
+            chunks[i].num_entries = mii_min(chunk_size, num_pending - i * chunk_size);
 
-        if (fread(&mod_code_size, sizeof mod_code_size, 1, f) != 1) {
-            goto unexpected_eof;
+            mii_pool_submit(&pool, NULL, _mii_modtable_analysis_task, chunks + i);
         }
 
-        char* mod_code = malloc(mod_code_size + 1);
+        mii_pool_run(&pool);
+        mii_pool_free(&pool);
 
-        if (fread(mod_code, 1, mod_code_size, f) != mod_code_size) {
-            goto unexpected_eof;
+        free(chunks);
+    } else {
+        for (int i = 0; i < num_pending; i += MII_BATCH_SIZE) {
+            _mii_modtable_analyze_chunk(p, 0, pending + i, mii_min(MII_BATCH_SIZE, num_pending - i));
         }
+    }
 
-        mod_code[mod_code_size] = 0;
-
-        /* read module timestamp */
-        time_t mod_timestamp;
+    _mii_modtable_batches_free(p);
 
-        if (fread(&mod_timestamp, sizeof mod_timestamp, 1, f) != 1) {
-            goto unexpected_eof;
-        }
+    for (int i = 0; i < num_pending; ++i) {
+        if (pending[i]->analysis_complete) {
+            if (pending[i]->previous && pending[i]->previous->fingerprint.hash == pending[i]->fingerprint.hash) {
+                ++p->num_unchanged;
+            } else {
+                ++count;
+            }
 
-        /* read module bins */
-        int mod_num_bins;
-        if (fread(&mod_num_bins, sizeof mod_num_bins, 1, f) != 1) {
-            goto unexpected_eof;
+            continue;
         }
 
-        char** mod_bins = NULL;
-        if (mod_num_bins) mod_bins = malloc(mod_num_bins * sizeof *mod_bins);
+        if (pending[i]->stale) {
+            ++p->num_stale;
 
-        for (int j = 0; j < mod_num_bins; ++j) {
-            /* grab bin size */
-            int bin_size;
+            /* queries keep the saved results until a later sync gets to the module.
+             * the saved fingerprint stays too, so that sync still checks the module */
+            const mii_modtable_entry* cached = p->cache ? _mii_modtable_locate_entry(p->cache, pending[i]->path) : NULL;
 
-            if (fread(&bin_size, sizeof bin_size, 1, f) != 1) {
-                goto unexpected_eof;
+            if (cached) {
+                _mii_modtable_copy_results(pending[i], cached);
+                pending[i]->fingerprint = cached->fingerprint;
             }
-
-            /* allocate and read bin data */
-            mod_bins[j] = malloc(bin_size + 1);
-
-            if (fread(mod_bins[j], 1, bin_size, f) != bin_size) {
-                goto unexpected_eof;
-            }
-
-            /* null-terminate bin string */
-            mod_bins[j][bin_size] = 0;
         }
 
-        /* read module parent */
-        int mod_num_parents;
-        if (fread(&mod_num_parents, sizeof mod_num_parents, 1, f) != 1) {
-            goto unexpected_eof;
-        }
+        /* the module isn't saved as analyzed, so its directory has to be listed again next time */
+        mii_modtable_dir* dir = _mii_modtable_parent_dir(p, pending[i]->path);
+        if (dir) _mii_modtable_set_dir_mtime(p, dir, MII_MODTABLE_MTIME_UNSETTLED);
+    }
 
-        char** mod_parents = NULL;
-        if (mod_num_parents) mod_parents = malloc(mod_num_parents * sizeof *mod_parents);
+    free(pending);
 
-        for (int j = 0; j < mod_num_parents; ++j) {
-            /* grab parent size */
-            int parent_size;
+    if (num) *num = count;
 
-            if (fread(&parent_size, sizeof parent_size, 1, f) != 1) {
-                goto unexpected_eof;
-            }
+    p->modules_requiring_analysis = 0;
+    p->analysis_complete = 1;
+
+    return 0;
+}
+
+/*
+ * analyze a chunk of modules with a worker's analysis state
+ * the modulefiles are read as one batch first
+ *
+ * the first chunk ignores the deadline. a crawl can use up the whole budget, and the modules
+ * it leaves stale make the next crawl just as slow, so each sync gets through at least one chunk
+ */
+void _mii_modtable_analyze_chunk(mii_modtable* p, int worker, mii_modtable_entry** entries, int num) {
+    char* paths[MII_BATCH_SIZE], *texts[MII_BATCH_SIZE];
+    size_t sizes[MII_BATCH_SIZE];
+    int errs[MII_BATCH_SIZE];
+
+    pthread_mutex_lock(&p->lock);
+    int64_t deadline = p->analysis_started ? p->deadline : 0;
+    p->analysis_started = 1;
+    pthread_mutex_unlock(&p->lock);
+
+    /* out of time, the rest is left for a later sync */
+    if (deadline && mii_clock_ns() >= deadline) {
+        for (int i = 0; i < num; ++i) {
+            entries[i]->stale = 1;
+        }
+
+        return;
+    }
+
+    for (int i = 0; i < num; ++i) {
+        paths[i] = entries[i]->path;
+    }
+
+    mii_batch_read(p->batches + worker, paths, num, texts, sizes, errs);
+
+    for (int i = 0; i < num; ++i) {
+        mii_modtable_entry* e = entries[i];
+
+        if (deadline && mii_clock_ns() >= deadline) {
+            e->stale = 1;
+            free(texts[i]);
+            continue;
+        }
+
+        if (errs[i]) {
+            mii_error("Couldn't open %s for reading : %s", e->path, strerror(errs[i]));
+            continue;
+        }
+
+        e->fingerprint.hash = XXH3_64bits(texts[i], sizes[i]);
+
+        /* touched but not changed, the saved results still hold. the new fingerprint is saved */
+        if (e->previous && e->previous->fingerprint.hash == e->fingerprint.hash) {
+            mii_debug("%s is unchanged", e->path);
+
+            free(texts[i]);
+            _mii_modtable_copy_results(e, e->previous);
+            e->changed = 1;
+            continue;
+        }
+
+        int res = mii_analysis_run(worker, e->path, e->type, texts[i], sizes[i], &e->bins, &e->num_bins, &e->bin_dirs, &e->bin_dir_mtimes, &e->num_bin_dirs);
+
+        free(texts[i]);
+
+        if (res) continue;
+
+        mii_debug("analysis for %s : %d bins", e->path, e->num_bins);
+
+        e->num_parents = 0;
+        e->analysis_complete = 1;
+        e->changed = 1;
+    }
+}
+
+/*
+ * pool task analyzing a chunk of modules
+ */
+void _mii_modtable_analysis_task(mii_pool_worker* w, void* arg) {
+    _mii_modtable_analysis_chunk* chunk = arg;
+    _mii_modtable_analyze_chunk(chunk->table, w->id, chunk->entries, chunk->num_entries);
+}
+
+/*
+ * export a mii_modtable to disk
+ */
+int mii_modtable_export(mii_modtable* p, const char* path) {
+    mii_index_writer w;
+    mii_index_writer_init(&w);
+
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+            /* don't write modules that analysis failed for */
+            if (!cur->analysis_complete) continue;
+
+            mii_index_writer_add(&w, cur->path, cur->code, cur->type, cur->bins, cur->num_bins, cur->parents, cur->num_parents,
+                                 cur->bin_dirs, cur->bin_dir_mtimes, cur->num_bin_dirs, &cur->fingerprint);
+        }
 
-            /* allocate and read parent data */
-            mod_parents[j] = malloc(parent_size + 1);
+        for (mii_modtable_dir* dir = p->dirs[i]; dir; dir = dir->next) {
+            if (!dir->removed) mii_index_writer_add_dir(&w, dir->path, dir->mtime);
+        }
+    }
+
+    int res = mii_index_writer_save(&w, path);
+
+    mii_index_writer_free(&w);
+
+    /* the journal belonged to the replaced generation */
+    if (!res) {
+        char* journal_path = mii_index_journal_path(path);
+        unlink(journal_path);
+        free(journal_path);
+    }
+
+    return res;
+}
+
+/*
+ * append changed and removed modules to the index journal
+ * returns nonzero without writing anything if the index should be exported in full instead,
+ * either because there is no saved index or because the journal has outgrown it
+ */
+int mii_modtable_export_journal(mii_modtable* p, const char* path) {
+    mii_index_header header;
+    mii_index_journal j;
+    struct stat st;
+
+    if (mii_index_read_header(path, &header)) return 1;
 
-            if (fread(mod_parents[j], 1, parent_size, f) != parent_size) {
-                goto unexpected_eof;
+    mii_index_journal_init(&j);
+
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        for (mii_modtable_entry* cur = p->buf[i]; cur; cur = cur->next) {
+            if (cur->changed) {
+                mii_index_journal_upsert(&j, cur->path, cur->code, cur->type, cur->bins, cur->num_bins, cur->parents, cur->num_parents,
+                                         cur->bin_dirs, cur->bin_dir_mtimes, cur->num_bin_dirs, &cur->fingerprint);
+            } else if (!cur->analysis_complete) {
+                /* analysis failed, a full export would drop the module too */
+                mii_index_journal_remove(&j, cur->path);
             }
+        }
 
-            /* null-terminate parent string */
-            mod_parents[j][parent_size] = 0;
+        for (mii_modtable_entry* cur = p->removed[i]; cur; cur = cur->next) {
+            mii_index_journal_remove(&j, cur->path);
         }
 
-        /* that's all we need! call the handler */
-        if ((res = handler(p, mod_path, mod_code, mod_bins, mod_num_bins, mod_parents, mod_num_parents, mod_timestamp))) {
-            break;
+        for (mii_modtable_dir* dir = p->dirs[i]; dir; dir = dir->next) {
+            if (dir->changed) mii_index_journal_upsert_dir(&j, dir->path, dir->mtime);
+        }
+
+        if (!p->cache) continue;
+
+        for (mii_modtable_dir* dir = p->cache->dirs[i]; dir; dir = dir->next) {
+            if (!dir->visited && !dir->removed) mii_index_journal_remove_dir(&j, dir->path);
         }
     }
 
-    fclose(f);
+    /* fold the journal back into the index once it gets large */
+    char* journal_path = mii_index_journal_path(path);
+    off_t journal_size = stat(journal_path, &st) ? 0 : st.st_size;
+
+    free(journal_path);
+
+    if ((journal_size + j.size) * MII_MODTABLE_JOURNAL_RATIO > header.file_size) {
+        mii_debug("Journal would grow to %lld bytes, compacting instead", (long long) (journal_size + j.size));
+        mii_index_journal_free(&j);
+        return 1;
+    }
+
+    int res = mii_index_journal_append(&j, path, header.generation);
+
+    mii_index_journal_free(&j);
     return res;
+}
+
+/*
+ * search for exact bin matches
+ */
+int mii_modtable_search_exact(mii_modtable* p, const char* cmd, mii_search_result* res) {
+    if (!p->analysis_complete) return -1;
+
+    mii_debug("Searching for bin \"%s\"..", cmd);
+
+    /* imported tables answer from the inverted command table without a scan.
+     * the hashtable then only holds journaled modules, which are searched below */
+    if (p->index.base && !p->imported) {
+        const uint32_t* providers;
+        uint32_t num_providers;
+
+        if (!mii_index_find_command(&p->index, cmd, &providers, &num_providers)) {
+            for (uint32_t i = 0; i < num_providers; ++i) {
+                _mii_modtable_add_index_result(p, res, providers[i], cmd, 0);
+            }
+        }
+    }
 
-    /* Catch all read errors here */
-    unexpected_eof:
-    mii_error("Couldn't parse from %s: unexpected EOF or read fail\n", path);
-    return -1;
+    /* walk through the table and search for exact matches */
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        mii_modtable_entry* cur = p->buf[i];
+
+        while (cur) {
+            for (int j = 0; j < cur->num_bins; ++j) {
+                if (!strcmp(cur->bins[j], cmd)) {
+                    /* show different parents as different results */
+                    for (int k = 0; k < cur->num_parents; ++k) {
+                        mii_search_result_add(res, cur->code, cmd, 0, cur->parents[k]);
+                    }
+
+                    /* if no parents, send null */
+                    if (cur->num_parents == 0) {
+                        mii_search_result_add(res, cur->code, cmd, 0, NULL);
+                    }
+                }
+            }
+
+            cur = cur->next;
+        }
+    }
+
+    return 0;
 }
 
-int _mii_modtable_parse_handler_import(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp) {
-    /* import: just insert every module into the modtable and don't worry too much */
-    int target_index = _mii_modtable_get_target_index(path);
+/*
+ * search for similar bin matches
+ */
+int mii_modtable_search_similar(mii_modtable* p, const char* cmd, mii_search_result* res) {
+    if (!p->analysis_complete) return -1;
+
+    mii_debug("Searching for bins similar to \"%s\"..", cmd);
+
+    /* imported tables search the bk-tree over command names, older indices without one are scanned.
+     * the hashtable then only holds journaled modules, which are searched below */
+    if (p->index.base && !p->imported) {
+        _mii_modtable_similar_data data = { p, res };
+
+        if (mii_index_find_similar(&p->index, cmd, MII_MODTABLE_DISTANCE_THRESHOLD - 1, _mii_modtable_similar_handler, &data)
+                && mii_modtable_materialize(p)) {
+            return -1;
+        }
+    }
+
+    /* walk through the table and search for similar matches */
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        mii_modtable_entry* cur = p->buf[i];
+
+        while (cur) {
+            for (int j = 0; j < cur->num_bins; ++j) {
+                int dist = mii_levenshtein_distance(cmd, cur->bins[j]); 
+
+                if (dist < MII_MODTABLE_DISTANCE_THRESHOLD) {
+                    /* show different parents as different results */
+                    for (int k = 0; k < cur->num_parents; ++k) {
+                        mii_search_result_add(res, cur->code, cur->bins[j], dist, cur->parents[k]);
+                    }
+
+                    /* if no parents, send null */
+                    if (cur->num_parents == 0) {
+                        mii_search_result_add(res, cur->code, cur->bins[j], dist, NULL);
+                    }
+                }
+            }
+
+            cur = cur->next;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * search for all commands provided by a module
+ */
+int mii_modtable_search_info(mii_modtable* p, const char* code, mii_search_result* res) {
+    if (!p->analysis_complete) return -1;
+    if (mii_modtable_materialize(p)) return -1;
+
+    /* walk through the table and search for exact matches */
+    for (int i = 0; i < MII_MODTABLE_HASHTABLE_WIDTH; ++i) {
+        mii_modtable_entry* cur = p->buf[i];
+
+        while (cur) {
+            if (!strcmp(cur->code, code)) {
+                for (int j = 0; j < cur->num_bins; ++j) {
+                    /* parent modules are not important here */
+                    mii_search_result_add(res, cur->code, cur->bins[j], 0, NULL);
+                }
+
+                break;
+            }
+
+            cur = cur->next;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * recursively walk a root and add modules to the hashtable
+ */
+int _mii_modtable_gen_recursive(mii_modtable* p, mii_pool* pool, const char* root) {
+    struct stat st;
+
+    if (mii_batch_stat_at(AT_FDCWD, root, &st)) {
+        mii_warn("Couldn't stat %s: %s", root, strerror(errno));
+        return -1;
+    }
+
+    if (pool) {
+        _mii_modtable_queue_dir(p, pool, NULL, root, NULL, &st);
+        return 0;
+    }
+
+    return _mii_modtable_gen_recursive_sub(p, NULL, root, NULL, &st);
+}
+
+/*
+ * subroutine for _mii_modtable_gen_recursive which allows for recursively
+ * computing the module relative paths (and the loading codes)
+ *
+ * directories with the same mtime as in the cache are listed from the cache,
+ * which costs a batch of stats instead of reading the directory
+ *
+ * on a thread pool (w non-NULL) subdirectories are queued instead of recursed into
+ *
+ * entries are looked up relative to the open directory, so neither the kernel nor the crawl
+ * builds their full path unless they turn out to be modules
+ */
+int _mii_modtable_gen_recursive_sub(mii_modtable* p, mii_pool_worker* w, const char* root, const char* prefix, const struct stat* dir_st) {
+    char* dir_path = mii_join_path(root, prefix);
+
+    /* a listing read in the same second as the directory changed might miss the change */
+    int64_t mtime = (int64_t) dir_st->st_mtim.tv_sec * 1000000000 + dir_st->st_mtim.tv_nsec;
+    if (dir_st->st_mtime >= p->crawl_time - 1) mtime = MII_MODTABLE_MTIME_UNSETTLED;
+
+    pthread_mutex_lock(&p->lock);
+    _mii_modtable_set_dir_mtime(p, _mii_modtable_add_dir(p, dir_path, mtime), mtime);
+    pthread_mutex_unlock(&p->lock);
+
+    mii_modtable_dir* cached = p->cache ? _mii_modtable_locate_dir(p->cache, dir_path) : NULL;
+
+    if (cached) {
+        cached->visited = 1;
+
+        /* a watcher can report a change the mtime doesn't show yet */
+        int hinted = p->hints && _mii_modtable_hinted(p->hints->dirs, p->hints->num_dirs, dir_path);
+
+        if (!cached->removed && cached->mtime == mtime && mtime != MII_MODTABLE_MTIME_UNSETTLED && !hinted) {
+            free(dir_path);
+            return _mii_modtable_gen_cached(p, w, root, prefix, cached);
+        }
+    }
+
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* d = (dir_fd < 0) ? NULL : fdopendir(dir_fd);
+
+    struct dirent* dp;
+
+    int result = 0, stats_skipped = 0;
+
+    if (!d) {
+        if (dir_fd >= 0) close(dir_fd);
+        free(dir_path);
+        return -1;
+    }
+
+    /* list every entry first, so they can be stat'ed as one batch */
+    char** names = NULL;
+    int num_names = 0, max_names = 0;
+
+    while ((dp = readdir(d))) {
+        if (dp->d_name[0] == '.') continue;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+        /* most filesystems report the entry type in the listing.
+         * anything other than a file, directory or link can't be a module, so it needs no stat */
+        if (dp->d_type != DT_UNKNOWN && dp->d_type != DT_REG && dp->d_type != DT_DIR && dp->d_type != DT_LNK) {
+            ++stats_skipped;
+            continue;
+        }
+#endif
+
+        if (num_names == max_names) {
+            max_names = max_names ? max_names * 2 : 64;
+            names = realloc(names, max_names * sizeof *names);
+        }
+
+        names[num_names++] = mii_strdup(dp->d_name);
+    }
+
+    /* stat the types */
+    struct stat* sts = malloc(mii_max(num_names, 1) * sizeof *sts);
+    int* errs = malloc(mii_max(num_names, 1) * sizeof *errs);
+
+    mii_batch_stat(p->batches + (w ? w->id : 0), dir_fd, names, num_names, sts, errs);
+
+    for (int i = 0; i < num_names; ++i) {
+        const struct stat* st = sts + i;
+
+        if (errs[i]) {
+            mii_warn("Couldn't stat %s/%s: %s", dir_path, names[i], strerror(errs[i]));
+            continue;
+        }
+
+        /* only files and directories are of interest, the rest needs no path */
+        if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)) continue;
+
+        char* rel_path = mii_join_path(prefix, names[i]);
+
+        /* check for normal files (likely modules) */
+        if (S_ISREG(st->st_mode)) {
+            /* compute the absolute file path */
+            char* abs_path = mii_join_path(dir_path, names[i]);
+
+            /* parse the relative path to get the module type and code */
+            int rel_len = strlen(rel_path);
+            int mod_type = MII_MODTABLE_MODTYPE_TCL; /* assume tcl unless we detect lmod */
+
+            if (strlen(rel_path) > 4 && !strcmp(rel_path + rel_len - 4, ".lua")) {
+                /* mutate the rel_path in place for the code, we don't need it anymore anyway */
+                rel_path[rel_len - 4] = 0;
+                mod_type = MII_MODTABLE_MODTYPE_LMOD;
+            }
+
+            mii_debug("Found module %s at %s", rel_path, abs_path);
+
+            mii_index_fingerprint fingerprint;
+            _mii_modtable_fingerprint(p, st, &fingerprint);
+
+            /* rel_path was mutated to become the code, ownership of both is transferred to the entry */
+            pthread_mutex_lock(&p->lock);
+            _mii_modtable_add_module(p, abs_path, rel_path, mod_type, &fingerprint);
+            pthread_mutex_unlock(&p->lock);
+
+            /* skip the other checks and cleanup */
+            continue;
+        }
+
+        /* recurse if directory */
+        result |= _mii_modtable_gen_subdir(p, w, root, rel_path, st);
+
+        free(rel_path);
+    }
+
+    for (int i = 0; i < num_names; ++i) {
+        free(names[i]);
+    }
+
+    free(names);
+    free(sts);
+    free(errs);
+
+    pthread_mutex_lock(&p->lock);
+    p->num_stats_skipped += stats_skipped;
+    p->num_relative_stats += num_names;
+    pthread_mutex_unlock(&p->lock);
+
+    closedir(d);
+    free(dir_path);
+    return result;
+}
+
+/*
+ * list a directory from the cache
+ * modules are taken as they were saved, subdirectories are still checked for changes
+ *
+ * writing a modulefile in place leaves the mtime of its directory alone, so the modules are
+ * stat'ed again as one batch and get fresh fingerprints. with a watcher, modules it didn't
+ * report are known to be unchanged and keep their saved ones
+ */
+int _mii_modtable_gen_cached(mii_modtable* p, mii_pool_worker* w, const char* root, const char* prefix, const mii_modtable_dir* cached) {
+    struct stat st;
+    int result = 0, num = cached->num_modules;
+
+    mii_debug("Reusing listing of %s", cached->path);
+
+    char** paths = NULL;
+    struct stat* sts = NULL;
+    int* errs = NULL;
+
+    if (!p->hints && num) {
+        paths = malloc(num * sizeof *paths);
+        sts = malloc(num * sizeof *sts);
+        errs = malloc(num * sizeof *errs);
+
+        for (int i = 0; i < num; ++i) {
+            paths[i] = cached->modules[i]->path;
+        }
+
+        mii_batch_stat(p->batches + (w ? w->id : 0), AT_FDCWD, paths, num, sts, errs);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    ++p->num_reused_dirs;
+
+    for (int i = 0; i < num; ++i) {
+        const mii_modtable_entry* mod = cached->modules[i];
+        mii_index_fingerprint fingerprint = mod->fingerprint;
+
+        if (paths) {
+            if (errs[i]) {
+                mii_warn("Couldn't stat %s: %s", mod->path, strerror(errs[i]));
+                continue;
+            }
+
+            if (!S_ISREG(sts[i].st_mode)) continue;
+
+            _mii_modtable_fingerprint(p, sts + i, &fingerprint);
+        }
+
+        _mii_modtable_add_module(p, mii_strdup(mod->path), mii_strdup(mod->code), mod->type, &fingerprint);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    free(paths);
+    free(sts);
+    free(errs);
+
+    for (int i = 0; i < cached->num_subdirs; ++i) {
+        const mii_modtable_dir* subdir = cached->subdirs[i];
+        const char* abs_path = subdir->path;
+
+        /* with a watcher, subdirectories it didn't report are known to be unchanged and need no stat */
+        if (p->hints && subdir->mtime != MII_MODTABLE_MTIME_UNSETTLED && !_mii_modtable_hinted(p->hints->dirs, p->hints->num_dirs, abs_path)) {
+            memset(&st, 0, sizeof st);
+
+            st.st_mode = S_IFDIR;
+            st.st_mtim.tv_sec = subdir->mtime / 1000000000;
+            st.st_mtim.tv_nsec = subdir->mtime % 1000000000;
+        } else if (mii_batch_stat_at(AT_FDCWD, abs_path, &st)) {
+            mii_warn("Couldn't stat %s: %s", abs_path, strerror(errno));
+            continue;
+        }
+
+        if (!S_ISDIR(st.st_mode)) continue;
+
+        char* rel_path = mii_join_path(prefix, strrchr(abs_path, '/') + 1);
+        result |= _mii_modtable_gen_subdir(p, w, root, rel_path, &st);
+        free(rel_path);
+    }
+
+    return result;
+}
+
+/*
+ * crawl a subdirectory, right away or as a task on the pool
+ */
+int _mii_modtable_gen_subdir(mii_modtable* p, mii_pool_worker* w, const char* root, const char* prefix, const struct stat* st) {
+    if (!w) return _mii_modtable_gen_recursive_sub(p, NULL, root, prefix, st);
+
+    _mii_modtable_queue_dir(p, w->pool, w, root, prefix, st);
+    return 0;
+}
+
+/*
+ * queue a directory crawl on the pool, on the worker's own queue if w is non-NULL
+ */
+void _mii_modtable_queue_dir(mii_modtable* p, mii_pool* pool, mii_pool_worker* w, const char* root, const char* prefix, const struct stat* st) {
+    _mii_modtable_crawl_task* task = malloc(sizeof *task);
+
+    task->table = p;
+    task->root = root;
+    task->prefix = prefix ? mii_strdup(prefix) : NULL;
+    task->st = *st;
+
+    mii_pool_submit(pool, w, _mii_modtable_crawl_task_run, task);
+}
+
+/*
+ * pool task crawling one directory
+ * errors are only logged, as a serial crawl ignores them too
+ */
+void _mii_modtable_crawl_task_run(mii_pool_worker* w, void* arg) {
+    _mii_modtable_crawl_task* task = arg;
+
+    _mii_modtable_gen_recursive_sub(task->table, w, task->root, task->prefix, &task->st);
+
+    free(task->prefix);
+    free(task);
+}
+
+/*
+ * set up a filesystem batch for each of num workers
+ */
+void _mii_modtable_batches_init(mii_modtable* p, int num) {
+    p->num_batches = mii_max(num, 1);
+    p->batches = malloc(p->num_batches * sizeof *p->batches);
+
+    for (int i = 0; i < p->num_batches; ++i) {
+        mii_batch_init(p->batches + i);
+    }
+}
+
+/*
+ * cleanup the workers' filesystem batches
+ */
+void _mii_modtable_batches_free(mii_modtable* p) {
+    for (int i = 0; i < p->num_batches; ++i) {
+        mii_batch_free(p->batches + i);
+    }
+
+    free(p->batches);
+
+    p->batches = NULL;
+    p->num_batches = 0;
+}
+
+/*
+ * add search results for a module in the mapped index, one per parent
+ */
+void _mii_modtable_add_index_result(mii_modtable* p, mii_search_result* res, uint32_t module, const char* bin, int distance) {
+    const mii_index* index = &p->index;
+
+    if (module >= index->num_modules) return;
+
+    const mii_index_module* mod = index->modules + module;
+    char code_buf[MII_INDEX_STRING_MAX], buf[MII_INDEX_STRING_MAX];
+
+    /* skip modules replaced or removed by the journal */
+    if (p->num_modules || p->num_removed) {
+        const char* path = mii_index_string(index, mod->path, buf);
+        if (_mii_modtable_locate_entry(p, path) || _mii_modtable_locate_removed(p, path)) return;
+    }
+
+    if ((uint64_t) mod->parents + mod->num_parents > index->num_refs) return;
+
+    const char* code = mii_index_string(index, mod->code, code_buf);
+
+    /* show different parents as different results */
+    for (uint32_t i = 0; i < mod->num_parents; ++i) {
+        mii_search_result_add(res, code, bin, distance, mii_index_string(index, index->refs[mod->parents + i], buf));
+    }
+
+    /* if no parents, send null */
+    if (mod->num_parents == 0) {
+        mii_search_result_add(res, code, bin, distance, NULL);
+    }
+}
+
+/*
+ * add search results for each module providing a name close to the query
+ */
+void _mii_modtable_similar_handler(void* data, const char* name, int distance, const uint32_t* providers, uint32_t num_providers) {
+    _mii_modtable_similar_data* d = data;
+
+    for (uint32_t i = 0; i < num_providers; ++i) {
+        _mii_modtable_add_index_result(d->table, d->res, providers[i], name, distance);
+    }
+}
+
+/*
+ * cleanup hint lists
+ */
+void mii_modtable_hints_free(mii_modtable_hints* h) {
+    for (int i = 0; i < h->num_dirs; ++i) free(h->dirs[i]);
+    for (int i = 0; i < h->num_modules; ++i) free(h->modules[i]);
+    for (int i = 0; i < h->num_bin_dirs; ++i) free(h->bin_dirs[i]);
+
+    free(h->dirs);
+    free(h->modules);
+    free(h->bin_dirs);
+
+    memset(h, 0, sizeof *h);
+}
+
+/*
+ * check whether a path is in a sorted hint list
+ */
+int _mii_modtable_hinted(char** list, int num, const char* path) {
+    int lo = 0, hi = num;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(list[mid], path);
+
+        if (!cmp) return 1;
+
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * check whether the bin directories a saved module was analyzed with have changed
+ * with a watcher only the directories it reported (or that weren't settled) are suspect, otherwise each is checked on the disk
+ */
+int _mii_modtable_bin_dirs_changed(mii_modtable* p, const mii_modtable_entry* cached) {
+    if (!p->hints) return mii_analysis_dirs_changed(cached->bin_dirs, cached->bin_dir_mtimes, cached->num_bin_dirs);
+
+    for (int i = 0; i < cached->num_bin_dirs; ++i) {
+        if (cached->bin_dir_mtimes[i] == MII_MODTABLE_MTIME_UNSETTLED) return 1;
+        if (_mii_modtable_hinted(p->hints->bin_dirs, p->hints->num_bin_dirs, cached->bin_dirs[i])) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * fingerprint a modulefile from its stat, the hash is filled in once the file is read
+ */
+void _mii_modtable_fingerprint(mii_modtable* p, const struct stat* st, mii_index_fingerprint* out) {
+    out->mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    out->size = st->st_size;
+    out->inode = st->st_ino;
+    out->hash = 0;
+
+    /* a file written in the same second as the crawl might be written again without a new mtime */
+    if (st->st_mtime >= p->crawl_time - 1) out->mtime = MII_MODTABLE_MTIME_UNSETTLED;
+}
+
+/*
+ * check whether two fingerprints are of the same file, unsettled ones never are
+ */
+int _mii_modtable_same_file(const mii_index_fingerprint* a, const mii_index_fingerprint* b) {
+    if (a->mtime == MII_MODTABLE_MTIME_UNSETTLED || b->mtime == MII_MODTABLE_MTIME_UNSETTLED) return 0;
+
+    return a->mtime == b->mtime && a->size == b->size && a->inode == b->inode;
+}
+
+/*
+ * duplicate a list of strings
+ */
+char** _mii_modtable_copy_strings(char** strs, int num) {
+    if (!num) return NULL;
+
+    char** out = malloc(num * sizeof *out);
+
+    for (int i = 0; i < num; ++i) {
+        out[i] = mii_strdup(strs[i]);
+    }
+
+    return out;
+}
+
+/*
+ * take the results of a module from its saved entry, copying them since entries own their strings
+ */
+void _mii_modtable_copy_results(mii_modtable_entry* mod, const mii_modtable_entry* cached) {
+    mod->bins = _mii_modtable_copy_strings(cached->bins, cached->num_bins);
+    mod->num_bins = cached->num_bins;
+    mod->parents = _mii_modtable_copy_strings(cached->parents, cached->num_parents);
+    mod->num_parents = cached->num_parents;
+    mod->bin_dirs = _mii_modtable_copy_strings(cached->bin_dirs, cached->num_bin_dirs);
+    mod->bin_dir_mtimes = _mii_modtable_copy_mtimes(cached->bin_dir_mtimes, cached->num_bin_dirs);
+    mod->num_bin_dirs = cached->num_bin_dirs;
+    mod->analysis_complete = 1;
+}
+
+/*
+ * duplicate a list of directory mtimes
+ */
+int64_t* _mii_modtable_copy_mtimes(const int64_t* mtimes, int num) {
+    if (!num) return NULL;
+
+    int64_t* out = malloc(num * sizeof *out);
+    memcpy(out, mtimes, num * sizeof *out);
+
+    return out;
+}
+
+/*
+ * apply a journal record to an imported table
+ * later records replace earlier ones for the same path
+ */
+int _mii_modtable_journal_handler(void* data, int op, const char* path, const char* code, int type, char** bins, int num_bins, char** parents, int num_parents, char** bin_dirs, const int64_t* bin_dir_mtimes, int num_bin_dirs, const mii_index_fingerprint* fingerprint) {
+    mii_modtable* p = data;
+    mii_modtable_entry* old = _mii_modtable_unlink_entry(p, path);
+
+    if (old) {
+        _mii_modtable_entry_free(old);
+        --p->num_modules;
+    }
+
+    if (op == MII_INDEX_JOURNAL_REMOVE) {
+        _mii_modtable_add_removed(p, path);
+        return 0;
+    }
 
     mii_modtable_entry* new_entry = malloc(sizeof *new_entry);
 
-    new_entry->path = path;
-    new_entry->code = code;
-    new_entry->bins = bins;
+    new_entry->path = mii_strdup(path);
+    new_entry->code = mii_strdup(code);
+    new_entry->type = type;
+    new_entry->bins = _mii_modtable_copy_strings(bins, num_bins);
     new_entry->num_bins = num_bins;
-    new_entry->parents = parents;
+    new_entry->parents = _mii_modtable_copy_strings(parents, num_parents);
     new_entry->num_parents = num_parents;
-    new_entry->timestamp = timestamp;
-    new_entry->next = p->buf[target_index];
+    new_entry->bin_dirs = _mii_modtable_copy_strings(bin_dirs, num_bin_dirs);
+    new_entry->bin_dir_mtimes = _mii_modtable_copy_mtimes(bin_dir_mtimes, num_bin_dirs);
+    new_entry->num_bin_dirs = num_bin_dirs;
+    new_entry->fingerprint = *fingerprint;
+    new_entry->previous = NULL;
     new_entry->analysis_complete = 1;
+    new_entry->changed = 0;
+    new_entry->stale = 0;
 
+    int target_index = _mii_modtable_get_target_index(path);
+
+    new_entry->next = p->buf[target_index];
     p->buf[target_index] = new_entry;
     ++p->num_modules;
 
-    mii_debug("Imported module: path %s, code %s, %d bins", path, code, num_bins);
+    mii_debug("Replayed journaled module: path %s, code %s, %d bins", path, code, num_bins);
     return 0;
 }
 
-int _mii_modtable_parse_handler_preanalysis(mii_modtable* p, char* path, char* code, char** bins, int num_bins, char** parents, int num_parents, time_t timestamp) {
-    /* preanalysis phase
-     * locate any matching modules and check if they are up to date.
-     * if so, then prefill the binary list.
-     * otherwise, leave it NULL so it gets regenerated in analysis. */
+/*
+ * apply a directory record to an imported table
+ */
+int _mii_modtable_journal_dir_handler(void* data, int op, const char* path, int64_t mtime) {
+    mii_modtable* p = data;
+    mii_modtable_dir* dir = _mii_modtable_locate_dir(p, path);
 
-    mii_modtable_entry* mod = _mii_modtable_locate_entry(p, path);
+    if (!dir) dir = _mii_modtable_add_dir(p, path, mtime);
 
-    if (mod && (mod->timestamp <= timestamp)) {
-        /* found a matching module, and the timestamp in the db is up to date.
-         * pass over the bins */
+    dir->mtime = mtime;
+    dir->removed = (op == MII_INDEX_JOURNAL_DIR_REMOVE);
 
-        mod->bins = bins;
-        mod->num_bins = num_bins;
-        mod->parents = parents;
-        mod->num_parents = num_parents;
-        mod->analysis_complete = 1;
+    return 0;
+}
 
-        --p->modules_requiring_analysis;
-    } else {
-        /* didn't find anything. free the bins */
-        free(bins);
+/*
+ * insert a new module entry, taking ownership of the path and code
+ */
+void _mii_modtable_add_module(mii_modtable* p, char* path, char* code, int type, const mii_index_fingerprint* fingerprint) {
+    mii_modtable_entry* new_module = malloc(sizeof *new_module);
+
+    new_module->path = path;
+    new_module->code = code;
+    new_module->type = type;
+    new_module->fingerprint = *fingerprint;
+    new_module->previous = NULL;
+    new_module->bins = NULL;
+    new_module->num_bins = 0;
+    new_module->parents = NULL;
+    new_module->num_parents = 0;
+    new_module->bin_dirs = NULL;
+    new_module->bin_dir_mtimes = NULL;
+    new_module->num_bin_dirs = 0;
+    new_module->analysis_complete = 0;
+    new_module->changed = 0;
+    new_module->stale = 0;
+
+    int target_index = _mii_modtable_get_target_index(path);
+
+    new_module->next = p->buf[target_index];
+    p->buf[target_index] = new_module;
+
+    ++p->num_modules;
+}
+
+/*
+ * free an owned entry and its strings
+ */
+void _mii_modtable_entry_free(mii_modtable_entry* e) {
+    free(e->code);
+    free(e->path);
+
+    for (int j = 0; j < e->num_bins; ++j) {
+        free(e->bins[j]);
     }
 
-    /* free everything else too */
-    free(path);
-    free(code);
+    for (int j = 0; j < e->num_parents; ++j) {
+        free(e->parents[j]);
+    }
 
-    return 0;
+    for (int j = 0; j < e->num_bin_dirs; ++j) {
+        free(e->bin_dirs[j]);
+    }
+
+    free(e->bins);
+    free(e->parents);
+    free(e->bin_dirs);
+    free(e->bin_dir_mtimes);
+    free(e);
 }
 
 /*
@@ -667,6 +1583,126 @@ mii_modtable_entry* _mii_modtable_locate_entry(mii_modtable* p, const char* path
     return NULL;
 }
 
+/*
+ * locate a removed path, returns NULL if the path was not removed
+ */
+mii_modtable_entry* _mii_modtable_locate_removed(mii_modtable* p, const char* path) {
+    if (!p->num_removed) return NULL;
+
+    for (mii_modtable_entry* cur = p->removed[_mii_modtable_get_target_index(path)]; cur; cur = cur->next) {
+        if (!strcmp(cur->path, path)) return cur;
+    }
+
+    return NULL;
+}
+
+/*
+ * locate a directory, returns NULL if it wasn't crawled
+ */
+mii_modtable_dir* _mii_modtable_locate_dir(mii_modtable* p, const char* path) {
+    if (!p->num_dirs) return NULL;
+
+    for (mii_modtable_dir* cur = p->dirs[_mii_modtable_get_target_index(path)]; cur; cur = cur->next) {
+        if (!strcmp(cur->path, path)) return cur;
+    }
+
+    return NULL;
+}
+
+/*
+ * record a directory, or return it if it is already present
+ */
+mii_modtable_dir* _mii_modtable_add_dir(mii_modtable* p, const char* path, int64_t mtime) {
+    mii_modtable_dir* dir = _mii_modtable_locate_dir(p, path);
+
+    if (dir) return dir;
+
+    int target_index = _mii_modtable_get_target_index(path);
+
+    dir = calloc(1, sizeof *dir);
+    dir->path = mii_strdup(path);
+    dir->mtime = mtime;
+    dir->next = p->dirs[target_index];
+    p->dirs[target_index] = dir;
+
+    ++p->num_dirs;
+    return dir;
+}
+
+/*
+ * locate the directory containing a path, returns NULL if it wasn't crawled
+ */
+mii_modtable_dir* _mii_modtable_parent_dir(mii_modtable* p, const char* path) {
+    const char* sep = strrchr(path, '/');
+
+    if (!sep || sep == path) return NULL;
+
+    char* parent = mii_strdup(path);
+    parent[sep - path] = 0;
+
+    mii_modtable_dir* out = _mii_modtable_locate_dir(p, parent);
+
+    free(parent);
+    return out;
+}
+
+/*
+ * set the mtime of a crawled directory, marking it changed if the cache has a different one
+ */
+void _mii_modtable_set_dir_mtime(mii_modtable* p, mii_modtable_dir* dir, int64_t mtime) {
+    mii_modtable_dir* cached = p->cache ? _mii_modtable_locate_dir(p->cache, dir->path) : NULL;
+    int changed = !cached || cached->removed || cached->mtime != mtime;
+
+    p->num_changed_dirs += changed - dir->changed;
+
+    dir->mtime = mtime;
+    dir->changed = changed;
+}
+
+/*
+ * free a directory and its listing, the entries listed belong to the table
+ */
+void _mii_modtable_dir_free(mii_modtable_dir* d) {
+    free(d->path);
+    free(d->modules);
+    free(d->subdirs);
+    free(d);
+}
+
+/*
+ * record a removed path
+ */
+void _mii_modtable_add_removed(mii_modtable* p, const char* path) {
+    if (_mii_modtable_locate_removed(p, path)) return;
+
+    int target_index = _mii_modtable_get_target_index(path);
+    mii_modtable_entry* tombstone = calloc(1, sizeof *tombstone);
+
+    tombstone->path = mii_strdup(path);
+    tombstone->next = p->removed[target_index];
+    p->removed[target_index] = tombstone;
+
+    ++p->num_removed;
+}
+
+/*
+ * take an entry out of the hashtable without freeing it
+ * returns NULL if not found
+ */
+mii_modtable_entry* _mii_modtable_unlink_entry(mii_modtable* p, const char* path) {
+    mii_modtable_entry** cur = p->buf + _mii_modtable_get_target_index(path);
+
+    for (; *cur; cur = &(*cur)->next) {
+        if (!strcmp((*cur)->path, path)) {
+            mii_modtable_entry* out = *cur;
+            *cur = out->next;
+            return out;
+        }
+    }
+
+    return NULL;
+}
+
 #if MII_ENABLE_SPIDER
 
 /* generate the index using the spider command provided by Lmod */
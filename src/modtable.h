@@ -7,8 +7,12 @@
  * keeps track of every module in the local filesystem
  */
 
+#include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "batch.h"
+#include "index.h"
 #include "search_result.h"
 
 /* modulo for the hashtable, preferably a power of 2 */
@@ -17,10 +21,16 @@
 /* minimum levenshtein distance for bins to be considered 'similar' */
 #define MII_MODTABLE_DISTANCE_THRESHOLD 4
 
+/* compact the journal into the index once it grows past 1/N of the index size */
+#define MII_MODTABLE_JOURNAL_RATIO 8
+
 /* module file types */
 #define MII_MODTABLE_MODTYPE_LMOD 0
 #define MII_MODTABLE_MODTYPE_TCL 1
 
+/* directory mtime which never matches, for listings that may have changed while they were read */
+#define MII_MODTABLE_MTIME_UNSETTLED INT64_MIN
+
 #define MII_MODTABLE_SPIDER_CMD ""
 #define MII_MODTABLE_BUF_SIZE 4096
 
@@ -28,15 +38,78 @@ typedef struct _mii_modtable_entry {
     char* path, *code;
     int type, num_bins, num_parents;
     char** bins, **parents;
-    time_t timestamp;
+    char** bin_dirs; /* directories the bins were found in */
+    int64_t* bin_dir_mtimes; /* nanoseconds, 0 if the directory was missing */
+    int num_bin_dirs;
+    mii_index_fingerprint fingerprint; /* of the modulefile, mtime is MII_MODTABLE_MTIME_UNSETTLED if it was written during the crawl */
+    const struct _mii_modtable_entry* previous; /* saved entry to reuse if analysis finds the contents unchanged, or NULL */
     int analysis_complete; /* truthy if the bin list is confirmed to be complete */
+    int changed; /* truthy if the entry was analyzed since the index was saved */
+    int stale; /* truthy if analysis was put off to a later sync, the saved results are kept meanwhile */
     struct _mii_modtable_entry* next;
 } mii_modtable_entry;
 
+/* crawled directory. cached tables also link each directory to its listing */
+typedef struct _mii_modtable_dir {
+    char* path;
+    int64_t mtime; /* nanoseconds */
+    int changed; /* truthy if the mtime differs from the saved index */
+    int visited; /* truthy if the crawl reached this directory */
+    int removed; /* truthy if the journal removed this directory */
+    mii_modtable_entry** modules;
+    int num_modules, max_modules;
+    struct _mii_modtable_dir** subdirs;
+    int num_subdirs, max_subdirs;
+    struct _mii_modtable_dir* next;
+} mii_modtable_dir;
+
+/* changes reported by a watcher, as sorted lists of absolute paths.
+ * a sync given hints trusts every saved directory, module and bin directory which isn't listed */
+typedef struct _mii_modtable_hints {
+    char** dirs; /* module directories whose entries changed */
+    char** modules; /* modulefiles written in place */
+    char** bin_dirs; /* bin directories whose commands changed */
+    int num_dirs, num_modules, num_bin_dirs;
+} mii_modtable_hints;
+
 typedef struct _mii_modtable {
     int analysis_complete, num_modules, modules_requiring_analysis;
     mii_modtable_entry* buf[MII_MODTABLE_HASHTABLE_WIDTH];
     char* modulepath; /* split into chunks on init via strtok() */
+
+    int num_jobs; /* worker threads for gen, set before calling it */
+    int64_t deadline; /* mii_clock_ns() at which analysis stops and leaves the rest stale, 0 for none */
+    int num_stale; /* modules left stale by the deadline */
+    int analysis_started; /* set by the first chunk analyzed, which runs whatever the deadline */
+    int num_unchanged; /* modules whose metadata changed but whose contents didn't */
+    pthread_mutex_t lock; /* guards the tables while workers insert into them */
+    mii_batch* batches; /* filesystem requests of each worker, during gen and analysis */
+    int num_batches;
+
+    /* modules removed since the saved index, by path */
+    mii_modtable_entry* removed[MII_MODTABLE_HASHTABLE_WIDTH];
+    int num_removed;
+
+    /* directories crawled, by path */
+    mii_modtable_dir* dirs[MII_MODTABLE_HASHTABLE_WIDTH];
+    int num_dirs, num_changed_dirs, num_removed_dirs, num_reused_dirs;
+    int num_stats_skipped; /* entries the crawl skipped by their listed type alone */
+    int num_relative_stats; /* entries stat'ed by name relative to their directory instead of by full path */
+    time_t crawl_time;
+
+    /* saved index the crawl reuses unchanged directory listings from, or NULL */
+    struct _mii_modtable* cache;
+
+    /* changes known to a watcher, or NULL to check everything on the disk. set before calling gen */
+    const mii_modtable_hints* hints;
+
+    /* imported tables point into the mapped index instead of owning their strings.
+     * entries replayed from the journal are owned, and sit in the hashtable before materializing */
+    mii_index index;
+    mii_modtable_entry* imported;
+    char** imported_refs;
+    char** imported_bin_dirs;
+    int64_t* imported_bin_dir_mtimes;
 } mii_modtable;
 
 void mii_modtable_init(mii_modtable* p);
@@ -44,6 +117,11 @@ void mii_modtable_free(mii_modtable* p);
 
 int mii_modtable_gen(mii_modtable* p, char* modulepath); /* scan for modules and build a partial table */
 int mii_modtable_import(mii_modtable* p, const char* path); /* import an existing table from the disk */
+int mii_modtable_materialize(mii_modtable* p); /* build the hashtable for an imported table */
+int mii_modtable_load_cache(mii_modtable* p, const char* path); /* load a saved table for gen and preanalysis to reuse */
+int mii_modtable_current(mii_modtable* p); /* nonzero if an imported table still matches the disk, checked without a crawl */
+
+void mii_modtable_hints_free(mii_modtable_hints* h);
 
 #if MII_ENABLE_SPIDER
 int mii_modtable_spider_gen(mii_modtable* p, const char* path, int* count);
@@ -52,7 +130,9 @@ int mii_modtable_spider_gen(mii_modtable* p, const char* path, int* count);
 int mii_modtable_preanalysis(mii_modtable* p, const char* path); /* preanalyze up-to-date modules */
 int mii_modtable_analysis(mii_modtable* p, int* count); /* perform analysis on all required modules */
 int mii_modtable_export(mii_modtable* p, const char* output_path); /* export table to disk, overwriting */
+int mii_modtable_export_journal(mii_modtable* p, const char* output_path); /* journal changed modules, nonzero if a full export is needed */
 
+/* searches append to an initialized result, so several tables can be searched into one */
 int mii_modtable_search_exact(mii_modtable* p, const char* cmd, mii_search_result* res);
 int mii_modtable_search_similar(mii_modtable* p, const char* cmd, mii_search_result* res);
 int mii_modtable_search_info(mii_modtable* p, const char* code, mii_search_result* res);
@@ -0,0 +1,201 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pool.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void* _mii_pool_thread(void* arg);
+void _mii_pool_work(mii_pool_worker* w);
+int _mii_pool_take(mii_pool* p, int id, mii_pool_task* out);
+int _mii_pool_steal(mii_pool* p, int id, mii_pool_task* out);
+
+/*
+ * initialize an empty pool
+ */
+void mii_pool_init(mii_pool* p, int num_workers) {
+    memset(p, 0, sizeof *p);
+
+    if (num_workers < 1) num_workers = 1;
+
+    p->num_workers = num_workers;
+    p->queues = calloc(num_workers, sizeof *p->queues);
+    p->workers = calloc(num_workers, sizeof *p->workers);
+
+    for (int i = 0; i < num_workers; ++i) {
+        pthread_mutex_init(&p->queues[i].lock, NULL);
+
+        p->workers[i].pool = p;
+        p->workers[i].id = i;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+}
+
+/*
+ * cleanup pool memory, any tasks left unrun are dropped
+ */
+void mii_pool_free(mii_pool* p) {
+    for (int i = 0; i < p->num_workers; ++i) {
+        pthread_mutex_destroy(&p->queues[i].lock);
+        free(p->queues[i].tasks);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+
+    free(p->queues);
+    free(p->workers);
+
+    memset(p, 0, sizeof *p);
+}
+
+/*
+ * queue a task
+ * the pending count is raised before the task is visible, so it can't reach zero while
+ * a follow-up task is still being submitted
+ */
+void mii_pool_submit(mii_pool* p, mii_pool_worker* w, mii_pool_task_fn fn, void* arg) {
+    mii_pool_queue* q = p->queues + (w ? w->id : 0);
+
+    pthread_mutex_lock(&p->lock);
+    ++p->pending;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->num_tasks == q->max_tasks) {
+        int max_tasks = q->max_tasks ? q->max_tasks * 2 : 64;
+        mii_pool_task* tasks = malloc(max_tasks * sizeof *tasks);
+
+        /* unroll the ring into the new buffer */
+        for (int i = 0; i < q->num_tasks; ++i) {
+            tasks[i] = q->tasks[(q->head + i) % q->max_tasks];
+        }
+
+        free(q->tasks);
+
+        q->tasks = tasks;
+        q->max_tasks = max_tasks;
+        q->head = 0;
+    }
+
+    q->tasks[(q->head + q->num_tasks++) % q->max_tasks] = (mii_pool_task) { fn, arg };
+
+    pthread_mutex_unlock(&q->lock);
+
+    ++p->generation;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * run the pool until every task has finished
+ */
+void mii_pool_run(mii_pool* p) {
+    pthread_t* threads = malloc(p->num_workers * sizeof *threads);
+    int num_threads = 1;
+
+    for (; num_threads < p->num_workers; ++num_threads) {
+        if (pthread_create(threads + num_threads, NULL, _mii_pool_thread, p->workers + num_threads)) {
+            mii_warn("Couldn't start worker thread %d, continuing with %d", num_threads, num_threads);
+            break;
+        }
+    }
+
+    _mii_pool_work(p->workers);
+
+    for (int i = 1; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+/*
+ * thread entry point
+ */
+void* _mii_pool_thread(void* arg) {
+    _mii_pool_work(arg);
+    return NULL;
+}
+
+/*
+ * worker loop: run own tasks, then stolen ones, then sleep until there is more work or none is left
+ */
+void _mii_pool_work(mii_pool_worker* w) {
+    mii_pool* p = w->pool;
+    mii_pool_task task;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        unsigned generation = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        if (_mii_pool_take(p, w->id, &task) || _mii_pool_steal(p, w->id, &task)) {
+            task.fn(w, task.arg);
+
+            pthread_mutex_lock(&p->lock);
+            if (!--p->pending) pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+
+            continue;
+        }
+
+        /* nothing to take: wait for a submit made after the queues were checked */
+        pthread_mutex_lock(&p->lock);
+
+        while (p->pending && p->generation == generation) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+
+        int done = !p->pending;
+        pthread_mutex_unlock(&p->lock);
+
+        if (done) return;
+    }
+}
+
+/*
+ * pop the newest task from a worker's own queue
+ */
+int _mii_pool_take(mii_pool* p, int id, mii_pool_task* out) {
+    mii_pool_queue* q = p->queues + id;
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->num_tasks) {
+        *out = q->tasks[(q->head + --q->num_tasks) % q->max_tasks];
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/*
+ * take the oldest task from another worker's queue, starting with the next worker
+ */
+int _mii_pool_steal(mii_pool* p, int id, mii_pool_task* out) {
+    for (int i = 1; i < p->num_workers; ++i) {
+        mii_pool_queue* q = p->queues + (id + i) % p->num_workers;
+        int found = 0;
+
+        pthread_mutex_lock(&q->lock);
+
+        if (q->num_tasks) {
+            *out = q->tasks[q->head];
+            q->head = (q->head + 1) % q->max_tasks;
+            --q->num_tasks;
+            found = 1;
+        }
+
+        pthread_mutex_unlock(&q->lock);
+
+        if (found) return 1;
+    }
+
+    return 0;
+}
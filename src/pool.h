@@ -0,0 +1,62 @@
+#pragma once
+
+/*
+ * mii_pool
+ *
+ * work-stealing thread pool
+ *
+ * each worker owns a queue of tasks. workers take their newest task first, which keeps a
+ * recursive walk depth-first and its working set small, and idle workers steal the oldest
+ * task from another queue, which tends to be the largest piece of remaining work.
+ *
+ * tasks may submit more tasks. mii_pool_run() returns once every task has finished.
+ */
+
+#include <pthread.h>
+
+/* default number of threads, set with -j */
+#define MII_POOL_DEFAULT_JOBS 1
+
+struct _mii_pool;
+
+/* worker handle passed to each task, used to submit follow-up tasks */
+typedef struct _mii_pool_worker {
+    struct _mii_pool* pool;
+    int id;
+} mii_pool_worker;
+
+typedef void (*mii_pool_task_fn)(mii_pool_worker* w, void* arg);
+
+typedef struct _mii_pool_task {
+    mii_pool_task_fn fn;
+    void* arg;
+} mii_pool_task;
+
+/* ring buffer of tasks, the owner pops the tail and thieves take the head */
+typedef struct _mii_pool_queue {
+    pthread_mutex_t lock;
+    mii_pool_task* tasks;
+    int head, num_tasks, max_tasks;
+} mii_pool_queue;
+
+typedef struct _mii_pool {
+    int num_workers;
+    mii_pool_queue* queues;
+    mii_pool_worker* workers;
+
+    /* idle workers sleep until a task is submitted or none are left */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending; /* tasks queued or running */
+    unsigned generation; /* bumped on each submit */
+} mii_pool;
+
+void mii_pool_init(mii_pool* p, int num_workers);
+void mii_pool_free(mii_pool* p);
+
+/* queue a task, on the worker's own queue if w is non-NULL */
+void mii_pool_submit(mii_pool* p, mii_pool_worker* w, mii_pool_task_fn fn, void* arg);
+
+/* run every queued task (and the tasks they submit) to completion.
+ * the calling thread is worker 0, so a pool of one worker starts no threads */
+void mii_pool_run(mii_pool* p);
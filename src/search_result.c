@@ -322,8 +322,12 @@ int _mii_search_result_compare(mii_search_result* res, int a, int b) {
     if (diff < 0) return 1;
     if (diff > 0) return -1;
 
-    /* finally, compare code alpha + version */
-    return _mii_search_result_compare_codes(res->codes[a], res->codes[b]);
+    /* compare code alpha + version */
+    diff = _mii_search_result_compare_codes(res->codes[a], res->codes[b]);
+    if (diff) return diff;
+
+    /* finally, compare bins so the order doesn't depend on how the index was searched */
+    return strcmp(res->bins[a], res->bins[b]);
 }
 
 /* compare module names alphabetically and versions numerically */
@@ -0,0 +1,863 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "tcl.h"
+#include "util.h"
+#include "log.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* nesting of bodies and command substitutions, deeper scripts are skipped */
+#define MII_TCL_MAX_DEPTH 32
+
+typedef struct _mii_tcl_str {
+    char* buf;
+    size_t len, max;
+} _mii_tcl_str;
+
+typedef struct _mii_tcl_expr_state {
+    mii_tcl* t;
+    const char* cur, *end;
+    int failed;
+} _mii_tcl_expr_state;
+
+void _mii_tcl_str_append(_mii_tcl_str* s, const char* str, size_t len);
+char* _mii_tcl_str_finish(_mii_tcl_str* s);
+
+char* _mii_tcl_script(mii_tcl* t, const char* cur, const char* end);
+int _mii_tcl_words(mii_tcl* t, const char** cur, const char* end, char*** words_out, int* num_out);
+int _mii_tcl_word(mii_tcl* t, const char** cur, const char* end, _mii_tcl_str* out);
+int _mii_tcl_subst_var(mii_tcl* t, const char** cur, const char* end, _mii_tcl_str* out);
+int _mii_tcl_subst_cmd(mii_tcl* t, const char** cur, const char* end, _mii_tcl_str* out);
+void _mii_tcl_escape(const char** cur, const char* end, _mii_tcl_str* out);
+const char* _mii_tcl_close(const char* cur, const char* end);
+
+char* _mii_tcl_command(mii_tcl* t, char** words, int num);
+char* _mii_tcl_path(mii_tcl* t, char** words, int num);
+char* _mii_tcl_if(mii_tcl* t, char** words, int num);
+char* _mii_tcl_file(char** words, int num);
+
+int _mii_tcl_expr(mii_tcl* t, const char* cond);
+char* _mii_tcl_expr_or(_mii_tcl_expr_state* e);
+char* _mii_tcl_expr_and(_mii_tcl_expr_state* e);
+char* _mii_tcl_expr_not(_mii_tcl_expr_state* e);
+char* _mii_tcl_expr_operand(_mii_tcl_expr_state* e);
+int _mii_tcl_expr_match(_mii_tcl_expr_state* e, const char* op);
+int _mii_tcl_truth(const char* value);
+
+const char* _mii_tcl_get(mii_tcl* t, const char* name);
+void _mii_tcl_set(mii_tcl* t, const char* name, const char* value);
+
+/*
+ * initialize an empty evaluator
+ */
+void mii_tcl_init(mii_tcl* t) {
+    memset(t, 0, sizeof *t);
+}
+
+/*
+ * cleanup evaluator memory
+ */
+void mii_tcl_free(mii_tcl* t) {
+    for (int i = 0; i < t->num_vars; ++i) {
+        free(t->names[i]);
+        free(t->values[i]);
+    }
+
+    for (int i = 0; i < t->num_paths; ++i) {
+        free(t->paths[i]);
+    }
+
+    free(t->names);
+    free(t->values);
+    free(t->paths);
+
+    memset(t, 0, sizeof *t);
+}
+
+/*
+ * evaluate a modulefile
+ * commands which fail are skipped, evaluation always carries on to the end
+ */
+void mii_tcl_eval(mii_tcl* t, const char* text, size_t size) {
+    free(_mii_tcl_script(t, text, text + size));
+}
+
+/*
+ * append bytes to a string
+ */
+void _mii_tcl_str_append(_mii_tcl_str* s, const char* str, size_t len) {
+    if (s->len + len + 1 > s->max) {
+        s->max = (s->len + len + 1) * 2;
+        s->buf = realloc(s->buf, s->max);
+    }
+
+    memcpy(s->buf + s->len, str, len);
+    s->len += len;
+    s->buf[s->len] = 0;
+}
+
+/*
+ * take the contents of a string, an empty one is still allocated
+ */
+char* _mii_tcl_str_finish(_mii_tcl_str* s) {
+    char* buf = s->buf ? s->buf : mii_strdup("");
+
+    memset(s, 0, sizeof *s);
+    return buf;
+}
+
+/*
+ * evaluate every command of a script
+ * returns the result of the last command, or NULL if it failed
+ */
+char* _mii_tcl_script(mii_tcl* t, const char* cur, const char* end) {
+    char* result = mii_strdup("");
+
+    if (t->depth >= MII_TCL_MAX_DEPTH) {
+        mii_debug("skipping script nested deeper than %d", MII_TCL_MAX_DEPTH);
+        free(result);
+        return NULL;
+    }
+
+    ++t->depth;
+
+    while (cur < end) {
+        /* skip separators and empty commands */
+        if (isspace((unsigned char) *cur) || *cur == ';') {
+            ++cur;
+            continue;
+        }
+
+        if (*cur == '\\' && cur + 1 < end && cur[1] == '\n') {
+            cur += 2;
+            continue;
+        }
+
+        if (*cur == '#') {
+            /* comments run to the end of the line, which a backslash continues */
+            for (; cur < end && *cur != '\n'; ++cur) {
+                if (*cur == '\\' && cur + 1 < end) ++cur;
+            }
+
+            continue;
+        }
+
+        char** words;
+        int num;
+
+        int res = _mii_tcl_words(t, &cur, end, &words, &num);
+
+        free(result);
+        result = (res || !num) ? NULL : _mii_tcl_command(t, words, num);
+
+        for (int i = 0; i < num; ++i) {
+            free(words[i]);
+        }
+
+        free(words);
+    }
+
+    --t->depth;
+    return result;
+}
+
+/*
+ * parse and substitute the words of the next command
+ * cur is left after the command even if a substitution fails, which returns -1
+ */
+int _mii_tcl_words(mii_tcl* t, const char** cur, const char* end, char*** words_out, int* num_out) {
+    int res = 0, max = 0;
+
+    *words_out = NULL;
+    *num_out = 0;
+
+    for (;;) {
+        while (*cur < end) {
+            char c = **cur;
+
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f') {
+                ++*cur;
+            } else if (c == '\\' && *cur + 1 < end && (*cur)[1] == '\n') {
+                *cur += 2;
+            } else {
+                break;
+            }
+        }
+
+        if (*cur == end || **cur == '\n' || **cur == ';') break;
+
+        _mii_tcl_str word = {0};
+
+        if (_mii_tcl_word(t, cur, end, &word)) res = -1;
+
+        if (*num_out == max) {
+            max = max ? max * 2 : 8;
+            *words_out = realloc(*words_out, max * sizeof **words_out);
+        }
+
+        (*words_out)[(*num_out)++] = _mii_tcl_str_finish(&word);
+    }
+
+    if (*cur < end) ++*cur;
+
+    return res;
+}
+
+/*
+ * parse and substitute a single word, which is braced, quoted or bare
+ */
+int _mii_tcl_word(mii_tcl* t, const char** cur, const char* end, _mii_tcl_str* out) {
+    if (**cur == '{') {
+        const char* close = _mii_tcl_close(*cur, end);
+
+        if (!close) {
+            *cur = end;
+            return -1;
+        }
+
+        _mii_tcl_str_append(out, *cur + 1, close - *cur - 1);
+        *cur = close + 1;
+
+        return 0;
+    }
+
+    int quoted = (**cur == '"'), res = 0;
+
+    if (quoted) ++*cur;
+
+    while (*cur < end) {
+        char c = **cur;
+
+        if (quoted) {
+            if (c == '"') break;
+        } else if (isspace((unsigned char) c) || c == ';') {
+            break;
+        }
+
+        if (c == '$') {
+            if (_mii_tcl_subst_var(t, cur, end, out)) res = -1;
+        } else if (c == '[') {
+            if (_mii_tcl_subst_cmd(t, cur, end, out)) res = -1;
+        } else if (c == '\\') {
+            /* outside of quotes a continued line separates words */
+            if (!quoted && *cur + 1 < end && (*cur)[1] == '\n') break;
+
+            _mii_tcl_escape(cur, end, out);
+        } else {
+            _mii_tcl_str_append(out, &c, 1);
+            ++*cur;
+        }
+    }
+
+    if (quoted) {
+        if (*cur == end) return -1;
+
+        ++*cur;
+    }
+
+    return res;
+}
+
+/*
+ * substitute a variable reference at cur, a lone $ is kept as is
+ */
+int _mii_tcl_subst_var(mii_tcl* t, const char** cur, const char* end, _mii_tcl_str* out) {
+    const char* p = *cur + 1;
+    _mii_tcl_str name = {0};
+    int res = 0;
+
+    if (p < end && *p == '{') {
+        const char* close = memchr(p, '}', end - p);
+
+        if (!close) {
+            _mii_tcl_str_append(out, "$", 1);
+            ++*cur;
+            return 0;
+        }
+
+        _mii_tcl_str_append(&name, p + 1, close - p - 1);
+        p = close + 1;
+    } else {
+        const char* start = p;
+
+        for (;;) {
+            if (p < end && (isalnum((unsigned char) *p) || *p == '_')) {
+                ++p;
+            } else if (end - p >= 2 && p[0] == ':' && p[1] == ':') {
+                p += 2;
+            } else {
+                break;
+            }
+        }
+
+        if (p == start) {
+            _mii_tcl_str_append(out, "$", 1);
+            ++*cur;
+            return 0;
+        }
+
+        _mii_tcl_str_append(&name, start, p - start);
+
+        if (p < end && *p == '(') {
+            /* array element, the index is substituted too */
+            _mii_tcl_str_append(&name, "(", 1);
+
+            for (++p; p < end && *p != ')';) {
+                if (*p == '$') {
+                    if (_mii_tcl_subst_var(t, &p, end, &name)) res = -1;
+                } else if (*p == '[') {
+                    if (_mii_tcl_subst_cmd(t, &p, end, &name)) res = -1;
+                } else if (*p == '\\') {
+                    _mii_tcl_escape(&p, end, &name);
+                } else {
+                    _mii_tcl_str_append(&name, p++, 1);
+                }
+            }
+
+            if (p == end) res = -1;
+            else ++p;
+
+            _mii_tcl_str_append(&name, ")", 1);
+        }
+    }
+
+    *cur = p;
+
+    char* key = _mii_tcl_str_finish(&name);
+    const char* value = res ? NULL : _mii_tcl_get(t, key);
+
+    if (!value) {
+        mii_debug("can't read \"%s\": no such variable", key);
+        free(key);
+        return -1;
+    }
+
+    _mii_tcl_str_append(out, value, strlen(value));
+
+    free(key);
+    return 0;
+}
+
+/*
+ * substitute the result of a bracketed script at cur
+ */
+int _mii_tcl_subst_cmd(mii_tcl* t, const char** cur, const char* end, _mii_tcl_str* out) {
+    const char* close = _mii_tcl_close(*cur, end);
+
+    if (!close) {
+        *cur = end;
+        return -1;
+    }
+
+    char* result = _mii_tcl_script(t, *cur + 1, close);
+
+    *cur = close + 1;
+
+    if (!result) return -1;
+
+    _mii_tcl_str_append(out, result, strlen(result));
+
+    free(result);
+    return 0;
+}
+
+/*
+ * substitute a backslash sequence at cur
+ */
+void _mii_tcl_escape(const char** cur, const char* end, _mii_tcl_str* out) {
+    if (*cur + 1 == end) {
+        _mii_tcl_str_append(out, "\\", 1);
+        ++*cur;
+        return;
+    }
+
+    char c = (*cur)[1];
+
+    switch (c) {
+    case 'n':  c = '\n'; break;
+    case 't':  c = '\t'; break;
+    case 'r':  c = '\r'; break;
+    case '\n': c = ' ';  break;
+    }
+
+    _mii_tcl_str_append(out, &c, 1);
+    *cur += 2;
+}
+
+/*
+ * find the brace or bracket closing the one at cur, NULL if there isn't one
+ */
+const char* _mii_tcl_close(const char* cur, const char* end) {
+    char open = *cur, close = (open == '{') ? '}' : ']';
+    int depth = 0;
+
+    for (; cur < end; ++cur) {
+        if (*cur == '\\') {
+            ++cur;
+        } else if (*cur == '{' && open == '[') {
+            /* braces in a script hide brackets */
+            if (!(cur = _mii_tcl_close(cur, end))) return NULL;
+        } else if (*cur == open) {
+            ++depth;
+        } else if (*cur == close && !--depth) {
+            return cur;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * run a command, returning its result or NULL if it failed or isn't supported
+ */
+char* _mii_tcl_command(mii_tcl* t, char** words, int num) {
+    const char* cmd = words[0];
+
+    if (!strncmp(cmd, "::", 2)) cmd += 2;
+
+    if (!strcmp(cmd, "set")) {
+        if (num == 3) {
+            _mii_tcl_set(t, words[1], words[2]);
+            return mii_strdup(words[2]);
+        }
+
+        const char* value = (num == 2) ? _mii_tcl_get(t, words[1]) : NULL;
+        return value ? mii_strdup(value) : NULL;
+    }
+
+    if (!strcmp(cmd, "setenv") || !strcmp(cmd, "unsetenv") || !strcmp(cmd, "getenv")) {
+        int i = 1;
+
+        /* skip options such as --set-if-undef and --return-value */
+        while (i < num && !strncmp(words[i], "--", 2)) ++i;
+
+        if (i == num) return NULL;
+
+        char* name = malloc(strlen(words[i]) + 6);
+        sprintf(name, "env(%s)", words[i]);
+
+        char* result = NULL;
+
+        if (cmd[0] == 's') {
+            if (i + 1 < num) {
+                _mii_tcl_set(t, name, words[i + 1]);
+                result = mii_strdup(words[i + 1]);
+            }
+        } else if (cmd[0] == 'u') {
+            _mii_tcl_set(t, name, NULL);
+            result = mii_strdup("");
+        } else {
+            const char* value = _mii_tcl_get(t, name);
+            result = mii_strdup(value ? value : (i + 1 < num) ? words[i + 1] : "");
+        }
+
+        free(name);
+        return result;
+    }
+
+    if (!strcmp(cmd, "prepend-path") || !strcmp(cmd, "append-path")) {
+        return _mii_tcl_path(t, words, num);
+    }
+
+    if (!strcmp(cmd, "if")) {
+        return _mii_tcl_if(t, words, num);
+    }
+
+    if (!strcmp(cmd, "file")) {
+        return _mii_tcl_file(words, num);
+    }
+
+    if (!strcmp(cmd, "info") && num == 3 && !strcmp(words[1], "exists")) {
+        return mii_strdup(_mii_tcl_get(t, words[2]) ? "1" : "0");
+    }
+
+    if (!strcmp(cmd, "module-info") && num >= 2 && !strcmp(words[1], "mode")) {
+        /* analysis looks at what loading the module does */
+        if (num == 2) return mii_strdup("load");
+
+        return mii_strdup(strcmp(words[2], "load") ? "0" : "1");
+    }
+
+    return NULL;
+}
+
+/*
+ * prepend-path/append-path ?options? variable value ?value ...?
+ * values added to PATH are collected, with other delimiters turned into ':'
+ */
+char* _mii_tcl_path(mii_tcl* t, char** words, int num) {
+    char delim = ':';
+    int i = 1;
+
+    for (; i < num && words[i][0] == '-'; ++i) {
+        if (!strcmp(words[i], "-d") || !strcmp(words[i], "--delim")) {
+            if (++i < num) delim = words[i][0];
+        } else if (!strncmp(words[i], "--delim=", 8)) {
+            delim = words[i][8];
+        }
+    }
+
+    if (i + 1 >= num) return NULL;
+    if (strcmp(words[i], "PATH")) return mii_strdup("");
+
+    for (++i; i < num; ++i) {
+        char* path = mii_strdup(words[i]);
+
+        if (delim && delim != ':') {
+            for (char* c = path; *c; ++c) {
+                if (*c == delim) *c = ':';
+            }
+        }
+
+        t->paths = realloc(t->paths, (t->num_paths + 1) * sizeof *t->paths);
+        t->paths[t->num_paths++] = path;
+    }
+
+    return mii_strdup("");
+}
+
+/*
+ * if cond ?then? body ?elseif cond ?then? body ...? ?else? ?body?
+ */
+char* _mii_tcl_if(mii_tcl* t, char** words, int num) {
+    for (int i = 1; i < num;) {
+        const char* cond = words[i++];
+
+        if (i < num && !strcmp(words[i], "then")) ++i;
+        if (i == num) return NULL;
+
+        const char* body = words[i++];
+        int truth = _mii_tcl_expr(t, cond);
+
+        if (truth) {
+            free(_mii_tcl_script(t, body, body + strlen(body)));
+
+            if (truth > 0) break;
+        }
+
+        if (i == num) break;
+
+        if (!strcmp(words[i], "elseif")) {
+            ++i;
+            continue;
+        }
+
+        if (!strcmp(words[i], "else")) ++i;
+
+        if (i < num) free(_mii_tcl_script(t, words[i], words[i] + strlen(words[i])));
+
+        break;
+    }
+
+    return mii_strdup("");
+}
+
+/*
+ * file join/dirname/tail
+ */
+char* _mii_tcl_file(char** words, int num) {
+    if (num < 3) return NULL;
+
+    if (!strcmp(words[1], "join")) {
+        _mii_tcl_str out = {0};
+
+        for (int i = 2; i < num; ++i) {
+            const char* part = words[i];
+
+            if (!*part) continue;
+
+            /* an absolute element discards everything before it */
+            if (*part == '/') {
+                out.len = 0;
+            } else if (out.len && out.buf[out.len - 1] != '/') {
+                _mii_tcl_str_append(&out, "/", 1);
+            }
+
+            _mii_tcl_str_append(&out, part, strlen(part));
+        }
+
+        /* trailing slashes are dropped, except for the root */
+        while (out.len > 1 && out.buf[out.len - 1] == '/') {
+            out.buf[--out.len] = 0;
+        }
+
+        return _mii_tcl_str_finish(&out);
+    }
+
+    if (num != 3) return NULL;
+
+    const char* path = words[2];
+    size_t len = strlen(path);
+
+    while (len > 1 && path[len - 1] == '/') --len;
+
+    size_t sep = len;
+
+    while (sep && path[sep - 1] != '/') --sep;
+
+    if (!strcmp(words[1], "tail")) {
+        char* out = malloc(len - sep + 1);
+
+        memcpy(out, path + sep, len - sep);
+        out[len - sep] = 0;
+
+        return out;
+    }
+
+    if (!strcmp(words[1], "dirname")) {
+        if (!sep) return mii_strdup(".");
+
+        while (sep > 1 && path[sep - 1] == '/') --sep;
+
+        char* out = malloc(sep + 1);
+
+        memcpy(out, path, sep);
+        out[sep] = 0;
+
+        return out;
+    }
+
+    return NULL;
+}
+
+/*
+ * evaluate the condition of an if
+ * returns 1 if true, 0 if false and -1 if it can't be decided
+ */
+int _mii_tcl_expr(mii_tcl* t, const char* cond) {
+    _mii_tcl_expr_state e = { t, cond, cond + strlen(cond), 0 };
+
+    char* value = _mii_tcl_expr_or(&e);
+
+    while (e.cur < e.end && isspace((unsigned char) *e.cur)) ++e.cur;
+
+    int truth = (e.failed || e.cur != e.end) ? -1 : _mii_tcl_truth(value);
+
+    free(value);
+    return truth;
+}
+
+/*
+ * a || b, true if either side is
+ */
+char* _mii_tcl_expr_or(_mii_tcl_expr_state* e) {
+    char* lhs = _mii_tcl_expr_and(e);
+
+    while (_mii_tcl_expr_match(e, "||")) {
+        char* rhs = _mii_tcl_expr_and(e);
+        int a = _mii_tcl_truth(lhs), b = _mii_tcl_truth(rhs);
+
+        free(lhs);
+        free(rhs);
+
+        lhs = (a > 0 || b > 0) ? mii_strdup("1") : (!a && !b) ? mii_strdup("0") : NULL;
+    }
+
+    return lhs;
+}
+
+/*
+ * a && b, false if either side is
+ */
+char* _mii_tcl_expr_and(_mii_tcl_expr_state* e) {
+    char* lhs = _mii_tcl_expr_not(e);
+
+    while (_mii_tcl_expr_match(e, "&&")) {
+        char* rhs = _mii_tcl_expr_not(e);
+        int a = _mii_tcl_truth(lhs), b = _mii_tcl_truth(rhs);
+
+        free(lhs);
+        free(rhs);
+
+        lhs = (!a || !b) ? mii_strdup("0") : (a > 0 && b > 0) ? mii_strdup("1") : NULL;
+    }
+
+    return lhs;
+}
+
+/*
+ * !a, or a comparison of two operands
+ */
+char* _mii_tcl_expr_not(_mii_tcl_expr_state* e) {
+    if (_mii_tcl_expr_match(e, "!")) {
+        char* value = _mii_tcl_expr_not(e);
+        int truth = _mii_tcl_truth(value);
+
+        free(value);
+        return (truth < 0) ? NULL : mii_strdup(truth ? "0" : "1");
+    }
+
+    char* lhs = _mii_tcl_expr_operand(e);
+    int negate;
+
+    if (_mii_tcl_expr_match(e, "==") || _mii_tcl_expr_match(e, "eq")) {
+        negate = 0;
+    } else if (_mii_tcl_expr_match(e, "!=") || _mii_tcl_expr_match(e, "ne")) {
+        negate = 1;
+    } else {
+        return lhs;
+    }
+
+    char* rhs = _mii_tcl_expr_operand(e);
+    char* result = NULL;
+
+    if (lhs && rhs) {
+        char* lhs_end, *rhs_end;
+        double a = strtod(lhs, &lhs_end), b = strtod(rhs, &rhs_end);
+
+        /* numbers compare by value, anything else as strings */
+        int equal = (*lhs && *rhs && !*lhs_end && !*rhs_end) ? a == b : !strcmp(lhs, rhs);
+
+        result = mii_strdup((equal != negate) ? "1" : "0");
+    }
+
+    free(lhs);
+    free(rhs);
+
+    return result;
+}
+
+/*
+ * a parenthesized expression, variable, command, quoted or braced string, or bare word
+ * returns NULL if the operand couldn't be evaluated
+ */
+char* _mii_tcl_expr_operand(_mii_tcl_expr_state* e) {
+    while (e->cur < e->end && isspace((unsigned char) *e->cur)) ++e->cur;
+
+    if (e->cur == e->end) {
+        e->failed = 1;
+        return NULL;
+    }
+
+    if (*e->cur == '(') {
+        ++e->cur;
+
+        char* value = _mii_tcl_expr_or(e);
+
+        if (!_mii_tcl_expr_match(e, ")")) e->failed = 1;
+
+        return value;
+    }
+
+    _mii_tcl_str out = {0};
+    int res = 0;
+
+    if (*e->cur == '$') {
+        res = _mii_tcl_subst_var(e->t, &e->cur, e->end, &out);
+    } else if (*e->cur == '[') {
+        res = _mii_tcl_subst_cmd(e->t, &e->cur, e->end, &out);
+    } else if (*e->cur == '"' || *e->cur == '{') {
+        res = _mii_tcl_word(e->t, &e->cur, e->end, &out);
+    } else {
+        const char* start = e->cur;
+
+        while (e->cur < e->end && (isalnum((unsigned char) *e->cur) || strchr("._-+", *e->cur))) ++e->cur;
+
+        if (e->cur == start) {
+            e->failed = 1;
+            return NULL;
+        }
+
+        _mii_tcl_str_append(&out, start, e->cur - start);
+    }
+
+    char* value = _mii_tcl_str_finish(&out);
+
+    if (res) {
+        free(value);
+        return NULL;
+    }
+
+    return value;
+}
+
+/*
+ * consume an operator if it is next
+ */
+int _mii_tcl_expr_match(_mii_tcl_expr_state* e, const char* op) {
+    size_t len = strlen(op);
+
+    while (e->cur < e->end && isspace((unsigned char) *e->cur)) ++e->cur;
+
+    if ((size_t) (e->end - e->cur) < len || memcmp(e->cur, op, len)) return 0;
+
+    /* word operators need a boundary, != is not ! */
+    if (isalpha((unsigned char) op[0]) && e->cur + len < e->end && isalnum((unsigned char) e->cur[len])) return 0;
+    if (len == 1 && op[0] == '!' && e->cur + 1 < e->end && e->cur[1] == '=') return 0;
+
+    e->cur += len;
+    return 1;
+}
+
+/*
+ * interpret a value as a boolean, -1 if it isn't one
+ */
+int _mii_tcl_truth(const char* value) {
+    if (!value || !*value) return -1;
+
+    char* end;
+    double number = strtod(value, &end);
+
+    if (!*end) return number != 0;
+
+    if (!strcmp(value, "true") || !strcmp(value, "yes") || !strcmp(value, "on")) return 1;
+    if (!strcmp(value, "false") || !strcmp(value, "no") || !strcmp(value, "off")) return 0;
+
+    return -1;
+}
+
+/*
+ * look up a variable, NULL if it isn't set
+ * environment variables the modulefile hasn't touched come from the process
+ */
+const char* _mii_tcl_get(mii_tcl* t, const char* name) {
+    if (!strncmp(name, "::", 2)) name += 2;
+
+    for (int i = 0; i < t->num_vars; ++i) {
+        if (!strcmp(t->names[i], name)) return t->values[i];
+    }
+
+    size_t len = strlen(name);
+
+    if (len > 5 && !strncmp(name, "env(", 4) && name[len - 1] == ')') {
+        char* key = malloc(len - 4);
+
+        memcpy(key, name + 4, len - 5);
+        key[len - 5] = 0;
+
+        const char* value = getenv(key);
+
+        free(key);
+        return value;
+    }
+
+    return NULL;
+}
+
+/*
+ * set a variable, a NULL value unsets it
+ */
+void _mii_tcl_set(mii_tcl* t, const char* name, const char* value) {
+    if (!strncmp(name, "::", 2)) name += 2;
+
+    char* copy = value ? mii_strdup(value) : NULL;
+
+    for (int i = 0; i < t->num_vars; ++i) {
+        if (!strcmp(t->names[i], name)) {
+            free(t->values[i]);
+            t->values[i] = copy;
+            return;
+        }
+    }
+
+    if (t->num_vars == t->max_vars) {
+        t->max_vars = t->max_vars ? t->max_vars * 2 : 16;
+        t->names = realloc(t->names, t->max_vars * sizeof *t->names);
+        t->values = realloc(t->values, t->max_vars * sizeof *t->values);
+    }
+
+    t->names[t->num_vars] = mii_strdup(name);
+    t->values[t->num_vars++] = copy;
+}
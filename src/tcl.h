@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * mii_tcl
+ *
+ * evaluator for the subset of Tcl which modulefiles use to build PATH
+ *
+ * each modulefile is evaluated with a variable table of its own, so nothing it sets
+ * carries over into other modules and any number of them can be evaluated at once.
+ * the process environment is only ever read. the subset covers:
+ *
+ *     "quoted" and {braced} words, [command substitution] and backslash escapes
+ *     $name, ${name}, $name(index), $env(NAME) and $::env(NAME)
+ *     set, setenv, unsetenv, getenv, info exists, module-info mode
+ *     file join, file dirname and file tail
+ *     if/elseif/else, with ==, !=, eq, ne, !, && and || in conditions
+ *     prepend-path and append-path, which collect the PATH entries
+ *
+ * any other command is skipped, as is a command using a variable or command which
+ * isn't known. a condition which can't be decided runs its branch and then carries on
+ * as if it were false, so no PATH entry the modulefile might add is missed.
+ */
+
+#include <stddef.h>
+
+typedef struct _mii_tcl {
+    char** names, **values; /* variables. environment variables set by the modulefile are env(NAME), NULL once unset */
+    int num_vars, max_vars;
+    char** paths; /* PATH entries added, ':' separated */
+    int num_paths;
+    int depth; /* nesting of the scripts being evaluated */
+} mii_tcl;
+
+void mii_tcl_init(mii_tcl* t);
+void mii_tcl_free(mii_tcl* t);
+
+/* evaluate a modulefile, appending the PATH entries it adds to t->paths */
+void mii_tcl_eval(mii_tcl* t, const char* text, size_t size);
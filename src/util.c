@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
+#include <time.h>
 
 char* mii_strdup(const char* str) {
     int len = strlen(str);
@@ -80,6 +81,67 @@ int mii_levenshtein_distance(const char* a, const char* b) {
     return result;
 }
 
+int mii_damerau_distance(const char* a, const char* b) {
+    /*
+     * compute the unrestricted damerau-levenshtein distance between
+     * string <a> and <b>. unlike the optimal string alignment distance above
+     * this is a metric, so it can be used to prune metric trees
+     */
+
+    int a_len = strlen(a), b_len = strlen(b);
+    int width = b_len + 2, mat_num = (a_len + 2) * width;
+    int max_dist = a_len + b_len;
+
+    /* command names are short, avoid the allocation for them */
+    int stack_mat[1024];
+    int* mat = (mat_num <= 1024) ? stack_mat : malloc(mat_num * sizeof *mat);
+
+    /* last row each character was seen in */
+    int last_row[256] = { 0 };
+
+    /* initialize the matrix boundaries, with a sentinel row and column */
+    mat[0] = max_dist;
+
+    for (int i = 0; i <= a_len; ++i) {
+        mat[(i + 1) * width] = max_dist;
+        mat[(i + 1) * width + 1] = i;
+    }
+
+    for (int j = 0; j <= b_len; ++j) {
+        mat[j + 1] = max_dist;
+        mat[width + j + 1] = j;
+    }
+
+    for (int i = 1; i <= a_len; ++i) {
+        int last_col = 0;
+
+        for (int j = 1; j <= b_len; ++j) {
+            int i1 = last_row[tolower((unsigned char) b[j - 1])], j1 = last_col;
+            int cost = 1;
+
+            if (tolower((unsigned char) a[i - 1]) == tolower((unsigned char) b[j - 1])) {
+                cost = 0;
+                last_col = j;
+            }
+
+            int substitution  = mat[i * width + j] + cost;
+            int insertion     = mat[(i + 1) * width + j] + 1;
+            int deletion      = mat[i * width + j + 1] + 1;
+            int transposition = mat[i1 * width + j1] + (i - i1 - 1) + 1 + (j - j1 - 1);
+
+            mat[(i + 1) * width + j + 1] = mii_min(mii_min(substitution, insertion), mii_min(deletion, transposition));
+        }
+
+        last_row[tolower((unsigned char) a[i - 1])] = i;
+    }
+
+    int result = mat[mat_num - 1];
+
+    if (mat != stack_mat) free(mat);
+
+    return result;
+}
+
 int mii_recursive_mkdir(const char *path, mode_t mode) {
     int res;
     struct stat st;
@@ -107,3 +169,10 @@ int mii_recursive_mkdir(const char *path, mode_t mode) {
 
     return mkdir(path, mode);
 }
+
+int64_t mii_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
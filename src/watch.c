@@ -0,0 +1,295 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "watch.h"
+#include "util.h"
+#include "log.h"
+
+#include "xxhash/xxhash.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* events which change what a directory lists */
+#define MII_WATCH_LISTING_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+#define MII_WATCH_EVENTS (MII_WATCH_LISTING_EVENTS | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* events are read in chunks of this size, which holds at least one event with the longest name */
+#define MII_WATCH_BUF_SIZE 65536
+
+int _mii_watcher_get_target_index(int wd);
+mii_watcher_dir* _mii_watcher_locate(mii_watcher* p, int wd);
+void _mii_watcher_remove(mii_watcher* p, int wd);
+int _mii_watcher_event(mii_watcher* p, const struct inotify_event* e, mii_modtable_hints* out);
+void _mii_watcher_hint(char*** list, int* num, char* path);
+void _mii_watcher_sort(char** list, int* num);
+int _mii_watcher_compare(const void* a, const void* b);
+
+/*
+ * initialize a watcher with nothing watched
+ */
+int mii_watcher_init(mii_watcher* p) {
+    memset(p, 0, sizeof *p);
+
+    if ((p->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        mii_error("Couldn't initialize inotify: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * stop watching and cleanup watcher memory
+ */
+void mii_watcher_free(mii_watcher* p) {
+    for (int i = 0; i < MII_WATCH_HASHTABLE_WIDTH; ++i) {
+        for (mii_watcher_dir* cur = p->buf[i], *next; cur; cur = next) {
+            next = cur->next;
+            free(cur->path);
+            free(cur);
+        }
+    }
+
+    if (p->fd >= 0) close(p->fd);
+
+    memset(p, 0, sizeof *p);
+    p->fd = -1;
+}
+
+/*
+ * watch a directory
+ * watching the same directory again returns the same descriptor, so it only adds the kind
+ */
+int mii_watcher_add(mii_watcher* p, const char* path, int kind) {
+    int wd = inotify_add_watch(p->fd, path, MII_WATCH_EVENTS);
+
+    if (wd < 0) {
+        /* bin directories which don't exist yet are normal, running out of watches is not */
+        if (errno == ENOSPC) {
+            if (!p->incomplete) mii_warn("Ran out of inotify watches at %d directories, every change will be checked in full", p->num_dirs);
+            p->incomplete = 1;
+        } else {
+            mii_debug("Couldn't watch %s: %s", path, strerror(errno));
+        }
+
+        return -1;
+    }
+
+    mii_watcher_dir* dir = _mii_watcher_locate(p, wd);
+
+    if (!dir) {
+        int target_index = _mii_watcher_get_target_index(wd);
+
+        dir = malloc(sizeof *dir);
+        dir->wd = wd;
+        dir->kinds = 0;
+        dir->path = mii_strdup(path);
+        dir->next = p->buf[target_index];
+        p->buf[target_index] = dir;
+
+        ++p->num_dirs;
+    } else if (strcmp(dir->path, path)) {
+        /* the directory is known under another name, the newest one is the one the index uses */
+        free(dir->path);
+        dir->path = mii_strdup(path);
+    }
+
+    dir->kinds |= kind;
+    return 0;
+}
+
+/*
+ * wait for a batch of changes
+ */
+int mii_watcher_wait(mii_watcher* p, mii_modtable_hints* out) {
+    struct pollfd pfd = { p->fd, POLLIN, 0 };
+    char* buf = malloc(MII_WATCH_BUF_SIZE);
+    int lost = 0;
+
+    memset(out, 0, sizeof *out);
+
+    /* block for the first event, then read until the tree goes quiet.
+     * events which change nothing the index records (such as a watch going away) don't end the wait */
+    for (int timeout = -1; ; ) {
+        int ready = poll(&pfd, 1, timeout);
+
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+
+            mii_error("Couldn't wait for changes: %s", strerror(errno));
+            free(buf);
+            mii_modtable_hints_free(out);
+            return -1;
+        }
+
+        if (!ready) {
+            if (lost || out->num_dirs || out->num_modules || out->num_bin_dirs) break;
+
+            timeout = -1;
+            continue;
+        }
+
+        ssize_t len = read(p->fd, buf, MII_WATCH_BUF_SIZE);
+
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+
+            mii_error("Couldn't read changes: %s", strerror(errno));
+            free(buf);
+            mii_modtable_hints_free(out);
+            return -1;
+        }
+
+        for (char* cur = buf; cur < buf + len; ) {
+            const struct inotify_event* e = (const struct inotify_event*) cur;
+
+            lost |= _mii_watcher_event(p, e, out);
+            cur += sizeof *e + e->len;
+        }
+
+        timeout = MII_WATCH_SETTLE_MS;
+    }
+
+    free(buf);
+
+    /* syncs look paths up by binary search */
+    _mii_watcher_sort(out->dirs, &out->num_dirs);
+    _mii_watcher_sort(out->modules, &out->num_modules);
+    _mii_watcher_sort(out->bin_dirs, &out->num_bin_dirs);
+
+    mii_debug("Changes: %d directories, %d modules, %d bin directories%s", out->num_dirs, out->num_modules, out->num_bin_dirs, lost ? ", events lost" : "");
+
+    return lost;
+}
+
+/*
+ * turn an event into hints, returns nonzero if events were lost
+ */
+int _mii_watcher_event(mii_watcher* p, const struct inotify_event* e, mii_modtable_hints* out) {
+    if (e->mask & IN_Q_OVERFLOW) {
+        mii_warn("Too many changes at once, checking everything");
+        return 1;
+    }
+
+    if (e->mask & IN_IGNORED) {
+        _mii_watcher_remove(p, e->wd);
+        return 0;
+    }
+
+    mii_watcher_dir* dir = _mii_watcher_locate(p, e->wd);
+
+    if (!dir) return 0;
+
+    /* the directory itself went away or moved: its parent reports the listing change,
+     * and modules using it as a bin directory have to be analyzed again */
+    if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (dir->kinds & MII_WATCH_BINS) _mii_watcher_hint(&out->bin_dirs, &out->num_bin_dirs, mii_strdup(dir->path));
+
+        /* a moved directory keeps its watch, drop it since the path is stale */
+        if (e->mask & IN_MOVE_SELF) inotify_rm_watch(p->fd, e->wd);
+
+        return 0;
+    }
+
+    if (!e->len) return 0;
+
+    if ((dir->kinds & MII_WATCH_MODULES) && e->name[0] != '.') {
+        if (e->mask & MII_WATCH_LISTING_EVENTS) {
+            /* entries added or removed, the directory is listed again */
+            _mii_watcher_hint(&out->dirs, &out->num_dirs, mii_strdup(dir->path));
+        } else if ((e->mask & (IN_CLOSE_WRITE | IN_ATTRIB)) && !(e->mask & IN_ISDIR)) {
+            /* a modulefile written in place doesn't change its directory */
+            _mii_watcher_hint(&out->modules, &out->num_modules, mii_join_path(dir->path, e->name));
+        }
+    }
+
+    if ((dir->kinds & MII_WATCH_BINS) && (e->mask & (MII_WATCH_LISTING_EVENTS | IN_ATTRIB))) {
+        _mii_watcher_hint(&out->bin_dirs, &out->num_bin_dirs, mii_strdup(dir->path));
+    }
+
+    return 0;
+}
+
+/*
+ * append a path to a hint list, taking ownership of it
+ * repeats are common (every file of an install), so the last path is checked before appending
+ */
+void _mii_watcher_hint(char*** list, int* num, char* path) {
+    if (*num && !strcmp((*list)[*num - 1], path)) {
+        free(path);
+        return;
+    }
+
+    *list = realloc(*list, (*num + 1) * sizeof **list);
+    (*list)[(*num)++] = path;
+}
+
+/*
+ * sort a hint list and drop duplicates
+ */
+void _mii_watcher_sort(char** list, int* num) {
+    if (!*num) return;
+
+    qsort(list, *num, sizeof *list, _mii_watcher_compare);
+
+    int out = 1;
+
+    for (int i = 1; i < *num; ++i) {
+        if (strcmp(list[out - 1], list[i])) {
+            list[out++] = list[i];
+        } else {
+            free(list[i]);
+        }
+    }
+
+    *num = out;
+}
+
+int _mii_watcher_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/*
+ * compute the hash index for a watch descriptor, modulo the hash table width
+ */
+int _mii_watcher_get_target_index(int wd) {
+    return XXH32(&wd, sizeof wd, 0) % MII_WATCH_HASHTABLE_WIDTH;
+}
+
+/*
+ * locate a watched directory, returns NULL if not found
+ */
+mii_watcher_dir* _mii_watcher_locate(mii_watcher* p, int wd) {
+    for (mii_watcher_dir* cur = p->buf[_mii_watcher_get_target_index(wd)]; cur; cur = cur->next) {
+        if (cur->wd == wd) return cur;
+    }
+
+    return NULL;
+}
+
+/*
+ * forget a watch the kernel dropped
+ */
+void _mii_watcher_remove(mii_watcher* p, int wd) {
+    mii_watcher_dir** cur = p->buf + _mii_watcher_get_target_index(wd);
+
+    for (; *cur; cur = &(*cur)->next) {
+        if ((*cur)->wd == wd) {
+            mii_watcher_dir* dir = *cur;
+            *cur = dir->next;
+
+            free(dir->path);
+            free(dir);
+
+            --p->num_dirs;
+            return;
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+ * mii_watcher
+ *
+ * inotify watches on module and bin directories
+ *
+ * module directories report modulefiles and subdirectories being added, removed or
+ * written, bin directories report commands being added, removed or made executable.
+ * events are gathered until the tree has been quiet for MII_WATCH_SETTLE_MS, so an
+ * install touching many files is applied as one update.
+ *
+ * the changes are handed to a sync as hints, which lets it skip checking everything
+ * else on the disk.
+ */
+
+#include "modtable.h"
+
+/* modulo for the hashtable, preferably a power of 2 */
+#define MII_WATCH_HASHTABLE_WIDTH 1024
+
+/* quiet time which ends a batch of events */
+#define MII_WATCH_SETTLE_MS 1000
+
+/* what a watched directory holds, a directory can be both */
+#define MII_WATCH_MODULES 1
+#define MII_WATCH_BINS    2
+
+typedef struct _mii_watcher_dir {
+    int wd, kinds;
+    char* path;
+    struct _mii_watcher_dir* next;
+} mii_watcher_dir;
+
+typedef struct _mii_watcher {
+    int fd;
+    mii_watcher_dir* buf[MII_WATCH_HASHTABLE_WIDTH]; /* by watch descriptor */
+    int num_dirs;
+    int incomplete; /* truthy if a directory couldn't be watched, so hints can't be trusted */
+} mii_watcher;
+
+int mii_watcher_init(mii_watcher* p);
+void mii_watcher_free(mii_watcher* p);
+
+/* watch a directory, adding to what is already watched there */
+int mii_watcher_add(mii_watcher* p, const char* path, int kind);
+
+/* block until changes arrive and collect them into hints.
+ * returns 1 if events were lost and everything has to be checked, -1 on error */
+int mii_watcher_wait(mii_watcher* p, mii_modtable_hints* out);